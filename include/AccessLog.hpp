@@ -0,0 +1,170 @@
+/*
+ *  Ryuuk
+ * -------
+ *  Ryuuk is an upcoming webserver written by Shinigamis
+ *
+ * AccessLog - A record of every request, in fixed-size binary records
+ *
+ */
+
+#ifndef ACCESSLOG_HPP
+#define ACCESSLOG_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+
+namespace ryuuk
+{
+    /**
+    * The access log is a series of segment files, "access-<date>-<time>-<nnnn>.rlog"
+    * in the configured directory. Each starts with a SegmentHeader, followed by
+    * Records, all in the byte order of the machine writing them. Records are
+    * rendered as text by ryuuk-logcat, never by the server.
+    *
+    * A segment is allocated to its full size up front and mapped into memory, and
+    * requests claim the next record of it with an atomic increment, so appending
+    * takes neither a lock nor a system call. Records are only complete once their
+    * `committed` field is set: a segment of a server that is still running, or
+    * crashed, may have records which aren't. Segments are truncated to the records
+    * used when they are closed.
+    */
+    namespace accesslog
+    {
+        constexpr char Magic[8] = {'R', 'Y', 'U', 'U', 'K', 'A', 'L', '\0'};
+        constexpr std::uint32_t Version = 1;
+
+        enum Method : std::uint8_t
+        {
+            Other,
+            Get,
+            Head,
+            Post,
+            Put,
+            Delete,
+            Options,
+            Patch,
+            Connect,
+            Trace,
+        };
+
+        constexpr const char* MethodNames[] = {"-", "GET", "HEAD", "POST", "PUT", "DELETE", "OPTIONS",
+                                               "PATCH", "CONNECT", "TRACE"};
+
+        inline Method methodFromName(std::string_view name)
+        {
+            for (std::uint8_t i = Get; i < std::size(MethodNames); ++i)
+                if (name == MethodNames[i])
+                    return Method(i);
+            return Other;
+        }
+
+        // FNV-1a, the pathId of records
+        inline std::uint64_t hashPath(std::string_view path)
+        {
+            std::uint64_t h = 0xcbf29ce484222325ull;
+            for (char c : path)
+            {
+                h ^= static_cast<unsigned char>(c);
+                h *= 0x100000001b3ull;
+            }
+            return h;
+        }
+
+        struct SegmentHeader
+        {
+            char magic[8];
+            std::uint32_t version;
+            std::uint32_t recordSize;       // sizeof(Record)
+            std::uint64_t created;          // ns since the epoch
+            char reserved[40];
+        };
+        static_assert(sizeof(SegmentHeader) == 64, "The segment header is 64 bytes");
+
+        struct Record
+        {
+            std::uint64_t time;             // The request was complete, ns since the epoch
+            std::uint64_t pathId;           // FNV-1a of the whole request target, to tell paths apart when truncated
+            std::uint64_t bytesSent;        // Of the response, head included (HTTP/2: its HEADERS and DATA payloads)
+            // Latency phases, in microseconds
+            std::uint32_t parse;            // From the complete request to starting on the response
+            std::uint32_t respond;          // Resolving the file and creating the response
+            std::uint32_t send;             // From then on until the kernel took the last byte
+            std::uint16_t status;
+            std::uint16_t port;             // Of the client
+            std::uint8_t  address[16];      // Of the client, IPv4 as an IPv4-mapped IPv6 address
+            Method        method;
+            std::uint8_t  version;          // 10, 11 or 20 for HTTP/1.0, HTTP/1.1 and HTTP/2
+            std::uint8_t  reserved[2];
+            // Lengths of the whole fields, the first bytes of which are kept below
+            std::uint16_t pathLength;
+            std::uint16_t refererLength;
+            std::uint16_t userAgentLength;
+            char          path[112];        // The request target, query included
+            char          referer[36];
+            char          userAgent[38];
+            std::uint32_t committed;        // Set last, once the rest of the record is written
+
+            // Keep the first bytes of `value` in `field`
+            template <std::size_t N>
+            static void store(char (&field)[N], std::uint16_t& length, std::string_view value)
+            {
+                length = static_cast<std::uint16_t>(std::min<std::size_t>(value.size(), UINT16_MAX));
+                value.copy(field, N);
+            }
+        };
+        static_assert(sizeof(Record) == 256, "Records are 256 bytes");
+    }
+
+    class AccessLog
+    {
+    public:
+        struct Settings
+        {
+            std::string directory;                      // Where segments are written, empty disables the log
+            std::uint64_t segmentSize = 64 * 1024 * 1024;
+        };
+
+        static AccessLog& get();
+
+        // Start a new segment in the configured directory, or stop logging
+        void configure(const Settings& settings);
+
+        bool enabled() const { return m_current.load(std::memory_order_relaxed) != nullptr; }
+
+        /**
+        * Append `record`, whose timings are filled in already, for the response
+        * to a client at `address`.
+        */
+        void append(accesslog::Record& record, const sockaddr_storage& address);
+
+        // Truncate the segment being written to what it holds, and stop logging
+        void close();
+
+        // Nanoseconds, of the monotonic clock for latencies and since the epoch
+        static std::uint64_t monotonicNow();
+        static std::uint64_t wallclockNow();
+
+    private:
+        struct Segment;
+
+        AccessLog() = default;
+
+        Segment* openSegment();
+        void rotate(Segment* full);
+        void finish(Segment* segment);
+
+        Settings m_settings;
+        std::atomic<Segment*> m_current{nullptr};
+        std::mutex m_mutex;                         // Rotating and configuring only
+        unsigned m_sequence = 0;                    // Of segments opened
+    };
+}
+
+#endif // ACCESSLOG_HPP
@@ -0,0 +1,148 @@
+/*
+ *  Ryuuk
+ * -------
+ *  Ryuuk is an upcoming webserver written by Shinigamis
+ *
+ * BufferPool - Fixed-size buffers shared by all transfers under a global memory limit
+ *
+ */
+
+#ifndef BUFFERPOOL_HPP
+#define BUFFERPOOL_HPP
+
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <sys/types.h>
+#include <vector>
+
+namespace ryuuk
+{
+    class BufferPool
+    {
+    public:
+        // A buffer borrowed from the pool, given back when it's destroyed
+        class Buffer
+        {
+        public:
+            Buffer() = default;
+            Buffer(Buffer&& other) noexcept;
+            Buffer& operator=(Buffer&& other) noexcept;
+            ~Buffer();
+
+            char* data() const { return m_data.get(); }
+            explicit operator bool() const { return m_data != nullptr; }
+
+        private:
+            friend class BufferPool;
+            explicit Buffer(std::unique_ptr<char[]> data) : m_data(std::move(data)) {}
+
+            std::unique_ptr<char[]> m_data;
+        };
+
+        static BufferPool& get();
+
+        // Set the size of a buffer and the most memory all buffers may take together, before any is used
+        void configure(std::size_t bufferSize, std::size_t memoryLimit);
+
+        std::size_t bufferSize() const { return m_bufferSize; }
+
+        /**
+        * Take a buffer if the memory limit allows. If it doesn't, the transfer
+        * is parked: `wake`, an eventfd, is signalled once a buffer is given back,
+        * which is then kept for it until it calls again, or unparks.
+        *
+        * @return The buffer, or an empty one if there's none to spare
+        */
+        Buffer acquire(int wake);
+
+        // Stop waiting with `wake`, its transfer doesn't need the buffer anymore
+        void unpark(int wake);
+
+        // Take a buffer if one is spare right now and nobody is waiting for one
+        Buffer tryAcquire();
+
+    private:
+        BufferPool() = default;
+        void release(std::unique_ptr<char[]> data);
+
+        // These expect m_mutex to be held
+        std::size_t spare() const { return m_free.size() + (m_maxBuffers - m_allocated); }
+        Buffer take();
+        void wakeParked();
+
+        std::size_t m_bufferSize = 128 * 1024;
+        std::size_t m_maxBuffers = 512;
+        std::size_t m_allocated = 0;
+        std::vector<std::unique_ptr<char[]>> m_free;
+        std::deque<int> m_parked;       // Transfers waiting for a buffer, in order
+        std::vector<int> m_woken;       // Those signalled, each with a spare buffer kept for it
+        std::mutex m_mutex;
+    };
+
+    /**
+    * Pool buffers holding the part of a file being sent, for sending files
+    * where it has to go through user space. While the socket drains one
+    * buffer, the following range is read into a second one, and the kernel
+    * is asked to read ahead the range after that.
+    *
+    * Blocks are found by file and offset, so the frames of an HTTP/2 stream
+    * are sent out of the same buffer. While two streams take turns, each
+    * keeps a block of its own rather than the second one being read ahead.
+    */
+    class ReadAhead
+    {
+    public:
+        ReadAhead() = default;
+        ReadAhead(ReadAhead&& other) noexcept;
+        ReadAhead& operator=(ReadAhead&& other) = delete;
+        ~ReadAhead();
+
+        /**
+        * The bytes of `fd` buffered from `offset` on, reading them if needed.
+        * Nothing past `end`, the end of the transfer, is read or returned: for
+        * HTTP/2, that of the stream's range of the file rather than of a frame.
+        *
+        * @param failed - set to true if the file couldn't be read or is shorter than `end`
+        *
+        * @return The buffered data, empty if there's no buffer to spare right now,
+        *         in which case the transfer is parked until wakeDescriptor() is readable
+        */
+        std::string_view data(int fd, off_t offset, off_t end, bool& failed);
+
+        // While parked, a descriptor which polls readable once a buffer is kept for the transfer, -1 otherwise
+        int wakeDescriptor() const { return m_parked ? m_wake : -1; }
+
+        // Read the range following the buffered one, as long as the pool has a buffer to spare
+        void prefetch();
+
+        // Give the buffers back to the pool
+        void release();
+
+        // Give back those holding data of `fd`, once its transfer is over, before the descriptor may be reused
+        void release(int fd);
+
+    private:
+        struct Block
+        {
+            BufferPool::Buffer buffer;
+            int fd = -1;
+            off_t offset = 0;       // Of the data in the file
+            std::size_t length = 0;
+            off_t end = 0;          // Of the transfer it was read for, where reading ahead stops
+
+            bool contains(int fd, off_t offset) const;
+        };
+
+        bool fill(Block& block, int fd, off_t offset, off_t end);
+
+        Block m_front;      // The block being sent
+        Block m_back;       // The one following it, if it's been read already
+        int m_wake = -1;    // An eventfd, opened the first time the transfer is parked
+        bool m_parked = false;
+    };
+}
+
+#endif // BUFFERPOOL_HPP
@@ -0,0 +1,74 @@
+/*
+ *  Ryuuk
+ * -------
+ *  Ryuuk is an upcoming webserver written by Shinigamis
+ *
+ * CachePolicy - Cache-Control and Expires headers, by path or type of what's sent
+ *
+ */
+
+#ifndef CACHEPOLICY_HPP
+#define CACHEPOLICY_HPP
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace ryuuk
+{
+    // The caching rules of the [Caching] section. Each rule has a pattern, one of
+    //   /prefix/        request paths starting with it
+    //   *.css, /a/*.js  globs (fnmatch), matched against the file name unless they contain a '/'
+    //   type:text/html  MIME types, type:image/* for a whole major type
+    // and the Cache-Control directives sent with what it matches. The first rule that
+    // matches applies. Rules are compiled once by configure(), with their header lines built
+    // up front, so lookups are a few hash probes for the common patterns.
+    class CachePolicy
+    {
+    public:
+        struct Rule
+        {
+            std::string pattern;
+            std::string directives;     // max-age=N, immutable, no-store, no-cache, stale-while-revalidate=N...
+        };
+
+        static CachePolicy& get();
+
+        // Replace the rules. Invalid ones are logged and skipped.
+        void configure(const std::vector<Rule>& rules);
+
+        /**
+        * Append the Cache-Control (and Expires, for a max-age) lines of the first rule
+        * matching the response to `out`. Nothing is appended if there's none.
+        *
+        * @param path - request path, with a leading '/'
+        * @param contentType - MIME type of the response, parameters are ignored
+        */
+        void append(std::string& out, std::string_view path, std::string_view contentType) const;
+
+    private:
+        static constexpr std::size_t NoRule = static_cast<std::size_t>(-1);
+
+        struct Policy
+        {
+            std::string header;         // "Cache-Control: ...\r\n"
+            long maxAge = -1;           // For Expires, none if negative
+        };
+
+        // Index of the first rule matching, or NoRule
+        std::size_t match(std::string_view path, std::string_view contentType) const;
+
+        std::vector<Policy> m_policies;     // By rule index, in the order of the config
+
+        // Each list is in rule order and each map keeps the first rule for a key
+        std::vector<std::pair<std::string, std::size_t>> m_prefixes;
+        std::vector<std::pair<std::string, std::size_t>> m_globs;
+        std::unordered_map<std::string, std::size_t> m_extensions;   // *.ext, lowercase
+        std::unordered_map<std::string, std::size_t> m_types;        // type:major/minor
+        std::unordered_map<std::string, std::size_t> m_majorTypes;   // type:major/*
+    };
+}
+
+#endif // CACHEPOLICY_HPP
@@ -0,0 +1,121 @@
+/*
+ *  Ryuuk
+ * -------
+ *  Ryuuk is an upcoming webserver written by Shinigamis
+ *
+ * CompressionCache - Bodies compressed on the fly, off the I/O threads
+ *
+ */
+
+#ifndef COMPRESSIONCACHE_HPP
+#define COMPRESSIONCACHE_HPP
+
+#include "ContentEncoding.hpp"
+#include "FileCache.hpp"
+
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace ryuuk
+{
+    class CompressionCache
+    {
+    public:
+        struct Settings
+        {
+            bool            enabled      = false;
+            std::uintmax_t  minSize      = 1024;                // Smaller bodies aren't worth it
+            std::uintmax_t  maxSize      = 16 * 1024 * 1024;    // Larger ones take too long and crowd the cache
+            std::size_t     cacheSize    = 64 * 1024 * 1024;    // Bytes of compressed bodies kept
+            unsigned        threads      = 1;
+            int             gzipLevel    = 6;
+            int             brotliLevel  = 5;
+            int             zstdLevel    = 3;
+            std::vector<std::string> types = {"text/", "application/javascript", "application/json",
+                                              "application/xml", "image/svg+xml"};  // MIME type prefixes
+        };
+
+        using Body = std::shared_ptr<const std::string>;
+
+        // What to compress: the content of `file`, or `data` if there's no file
+        struct Source
+        {
+            FileCache::Handle file;
+            std::shared_ptr<const std::string> data;
+        };
+
+        static CompressionCache& get();
+
+        void configure(const Settings& settings);
+
+        // Whether a body of this type and size should be compressed at all
+        bool compressible(std::string_view mimeType, std::uintmax_t size) const;
+
+        // Whether we were built with support for this coding
+        static bool supported(ContentEncoding encoding);
+
+        // Key of the body of `path`, as of the metadata `info`, in `encoding`
+        static std::string makeKey(std::string_view path, const FileInfo& info, ContentEncoding encoding);
+
+        /**
+        * Look up a compressed body.
+        *
+        * @param schedule - set to true if the caller should hand us the source
+        *                   with schedule(), because the body is missing or was
+        *                   compressed at a lowered level while we were busy.
+        *
+        * @return The body or null if it isn't (yet) available
+        */
+        Body find(const std::string& key, bool& schedule);
+
+        // Compress `source` on a compression thread and cache the result under `key`
+        void schedule(const std::string& key, ContentEncoding encoding, Source&& source);
+
+        // Compress right away on the calling thread, for when there's no alternative to sending it compressed
+        Body compressNow(const std::string& key, ContentEncoding encoding, const Source& source);
+
+    private:
+        CompressionCache() = default;
+
+        struct Job
+        {
+            std::string key;
+            ContentEncoding encoding;
+            Source source;
+        };
+
+        struct Slot
+        {
+            Body body;
+            bool lowered = false;   // Compressed at a lower level than configured, to keep up
+            bool pending = false;   // A job for this key is queued or running
+            bool failed = false;    // Don't try again, the key changes with the file anyway
+            std::list<std::string>::iterator lruPosition;
+        };
+
+        void run();
+        Body compress(const Job& job, int level);
+        void store(const std::string& key, Body body, bool lowered);
+        void evict();
+        int levelFor(ContentEncoding encoding, bool saturated) const;
+
+        Settings m_settings;
+
+        std::mutex m_mutex;
+        std::condition_variable m_jobReady;
+        std::deque<Job> m_jobs;
+        std::unordered_map<std::string, Slot> m_slots;
+        std::list<std::string> m_lru;   // Most recently used at the front
+        std::size_t m_cachedBytes = 0;
+        unsigned m_runningThreads = 0;
+    };
+}
+
+#endif // COMPRESSIONCACHE_HPP
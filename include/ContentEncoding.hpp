@@ -0,0 +1,60 @@
+#ifndef CONTENTENCODING_HPP
+#define CONTENTENCODING_HPP
+
+#include <array>
+#include <string_view>
+#include <vector>
+
+namespace ryuuk
+{
+    // Content codings we know about, in order of preference when the client likes them equally
+    enum ContentEncoding
+    {
+        Brotli,
+        Zstd,
+        Gzip,
+        Identity,
+        EncodingCount
+    };
+
+    // Token used in Accept-Encoding/Content-Encoding
+    std::string_view encodingName(ContentEncoding encoding);
+
+    // File name suffix of precompressed siblings (".br" etc), empty for Identity
+    std::string_view encodingSuffix(ContentEncoding encoding);
+
+    // One element of a list like "gzip;q=0.8, br"
+    struct QualityValue
+    {
+        std::string_view value;     // Without parameters or surrounding whitespace
+        float quality;              // 0 to 1, 1 when unspecified
+    };
+
+    // Split a comma separated field value into its elements with their q-values
+    std::vector<QualityValue> parseQualityValues(std::string_view header);
+
+    class AcceptEncoding
+    {
+    public:
+        // Without the header any coding would do (RFC 7231 5.3.4), but we stick to identity then
+        AcceptEncoding() = default;
+
+        explicit AcceptEncoding(std::string_view header);
+
+        float quality(ContentEncoding encoding) const { return m_quality[encoding]; }
+
+        bool acceptable(ContentEncoding encoding) const { return m_quality[encoding] > 0; }
+
+        /**
+        * Pick the best of the `available` codings.
+        *
+        * @return The coding, or EncodingCount if none of them is acceptable
+        */
+        ContentEncoding choose(const std::array<bool, EncodingCount>& available) const;
+
+    private:
+        std::array<float, EncodingCount> m_quality = {0, 0, 0, 1};
+    };
+}
+
+#endif // CONTENTENCODING_HPP
@@ -0,0 +1,132 @@
+/*
+ *  Ryuuk
+ * -------
+ *  Ryuuk is an upcoming webserver written by Shinigamis
+ *
+ * DirectoryListing - Reading directories and streaming their listings
+ *
+ */
+
+#ifndef DIRECTORYLISTING_HPP
+#define DIRECTORYLISTING_HPP
+
+#include "ResponseCreator.hpp"
+
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace ryuuk
+{
+    // Reads a directory in batches with getdents64(), only stat()-ing entries the file system has no d_type for
+    class DirectoryReader
+    {
+    public:
+        struct Entry
+        {
+            std::string_view name;
+            bool directory;         // Symbolic links to directories count as directories
+        };
+
+        // Read the directory open as `directory`, through a descriptor of its own
+        explicit DirectoryReader(int directory);
+        ~DirectoryReader();
+
+        DirectoryReader(const DirectoryReader& other) = delete;
+        DirectoryReader& operator=(const DirectoryReader& other) = delete;
+
+        bool isOpen() const { return m_fd >= 0; }
+
+        /**
+        * Read the next batch of entries, in directory order.
+        *
+        * @return The entries, valid until the next call. Empty at the end of the directory.
+        * @throw std::runtime_error if the directory couldn't be read
+        */
+        const std::vector<Entry>& nextBatch();
+
+    private:
+        int m_fd;
+        std::unique_ptr<char[]> m_buffer;
+        std::vector<Entry> m_batch;
+    };
+
+    // How a listing was asked for in the query string: ?format=json&sort=name&offset=100&limit=50
+    struct ListingOptions
+    {
+        enum Format
+        {
+            Html,
+            Json,       // An array of names, directories have a trailing slash
+            Plain,      // One name per line, directories have a trailing slash
+        };
+
+        Format          format  = Html;
+        bool            sorted  = false;
+        std::uintmax_t  offset  = 0;
+        std::uintmax_t  limit   = std::numeric_limits<std::uintmax_t>::max();
+        bool            custom  = false;    // Anything above was given, so the default listing won't do
+
+        static ListingOptions parse(std::string_view query);
+
+        std::string_view contentType() const;
+    };
+
+    // The HTML listing is made of a head, an entry per name and a tail, rendered from the PageTemplates
+    void appendListingHead(std::string& html, std::string_view location);
+    void appendListingEntry(std::string& html, std::string_view name, bool directory);
+    void appendListingTail(std::string& html, std::string_view location);
+
+    /**
+    * A listing generated while it is sent, a batch of entries at a time, so that
+    * a directory of any size takes bounded memory. Sent with chunked encoding,
+    * unless `chunked` is false in which case the end of the body is marked by
+    * closing the connection.
+    *
+    * Entries are sent in directory order, or with `sorted`, in the order of the
+    * cached listing. Sorting a directory too large to sort in memory spills
+    * sorted runs to temporary files, which are then merged.
+    */
+    class ListingGenerator : public ChunkGenerator
+    {
+    public:
+        ListingGenerator(std::unique_ptr<DirectoryReader> reader, const std::string& location,
+                         const ListingOptions& options, bool chunked);
+        ~ListingGenerator();
+
+        Chunk nextChunk() override;
+
+    private:
+        class Sorter;
+
+        // Next entry in the requested order, false at the end
+        bool nextEntry(std::string_view& name, bool& directory);
+
+        void appendEntry(std::string_view name, bool directory);
+
+        // Frame what's generated between these two as one chunk
+        void beginBody();
+        void endBody();
+
+        // Whether the limit cut the listing short
+        bool truncated();
+
+        bool m_done = false;
+        std::string m_out;
+        std::unique_ptr<DirectoryReader> m_reader;
+        std::unique_ptr<Sorter> m_sorter;
+        std::string m_location;
+        ListingOptions m_options;
+        bool m_chunked;
+
+        const std::vector<DirectoryReader::Entry>* m_batch = nullptr;
+        std::size_t m_batchPosition = 0;
+        std::uintmax_t m_skipped = 0;
+        std::uintmax_t m_sent = 0;
+    };
+}
+
+#endif // DIRECTORYLISTING_HPP
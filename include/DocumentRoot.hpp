@@ -0,0 +1,57 @@
+/*
+ *  Ryuuk
+ * -------
+ *  Ryuuk is an upcoming webserver written by Shinigamis
+ *
+ * DocumentRoot - The directory being served, and opening files strictly beneath it
+ *
+ */
+
+#ifndef DOCUMENTROOT_HPP
+#define DOCUMENTROOT_HPP
+
+#include <atomic>
+#include <string>
+#include <string_view>
+
+namespace ryuuk
+{
+    /**
+    * The directory served, held open so that request paths are resolved relative to it
+    * rather than to the working directory. Paths never resolve to anything outside of it:
+    * not through "..", absolute symbolic links, links leading out of it, or /proc magic
+    * links. The kernel enforces that with openat2(RESOLVE_BENEATH), where it is missing
+    * (before Linux 5.6, or filtered out) the path is walked one component at a time.
+    */
+    class DocumentRoot
+    {
+    public:
+        static DocumentRoot& get();
+
+        // Serve `path`, the current working directory by default. Returns false if it can't be opened.
+        bool open(const std::string& path);
+
+        int fd() const { return m_fd; }
+
+        /**
+        * Open `location` ("./a/b", "a/b" or "." for the root itself) with open() `flags`.
+        *
+        * @return The descriptor, or -1 with errno set. Paths leading out of the root fail with EXDEV.
+        */
+        int openBeneath(const std::string& location, int flags) const;
+
+        // The path to give *at() functions along with fd(), "." for the root. Null terminated like `location`.
+        static const char* relative(const std::string& location);
+
+    private:
+        DocumentRoot();
+        ~DocumentRoot();
+
+        int walk(std::string_view path, int flags) const;
+
+        int m_fd;
+        mutable std::atomic<bool> m_useOpenat2{true};
+    };
+}
+
+#endif // DOCUMENTROOT_HPP
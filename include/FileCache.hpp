@@ -0,0 +1,134 @@
+/*
+ *  Ryuuk
+ * -------
+ *  Ryuuk is an upcoming webserver written by Shinigamis
+ *
+ * FileCache - Cache of open file descriptors and their metadata
+ *
+ */
+
+#ifndef FILECACHE_HPP
+#define FILECACHE_HPP
+
+#include "Utility.hpp"
+#include "FileMapping.hpp"
+#include "NamespaceIndex.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace ryuuk
+{
+    // The subset of statx() metadata we care about
+    struct FileInfo
+    {
+        FileType        type   = NonExistent;
+        std::uint64_t   size   = 0;
+        std::uint64_t   inode  = 0;
+        std::uint64_t   device = 0;
+        std::int64_t    mtime  = 0;     // Modification time in nanoseconds since the epoch
+
+        bool sameFile(const FileInfo& other) const
+        {
+            return type == other.type && size == other.size && inode == other.inode &&
+                   device == other.device && mtime == other.mtime;
+        }
+    };
+
+    class FileCache
+    {
+    public:
+        /**
+        * A resolved request path. Entries are immutable once published, a changed
+        * file gets a new entry and responses still holding the old one keep
+        * their (still valid) descriptor until they are done.
+        */
+        struct Entry
+        {
+            Entry() = default;
+            Entry(const Entry& other) = delete;
+            Entry& operator=(const Entry& other) = delete;
+            ~Entry();
+
+            std::string path;       // Resolved path, has "/index.html" appended for directories with an index
+            FileInfo    info;       // Metadata of `path`, taken from `fd` when it is open
+            int         fd = -1;    // Read-only descriptor, only kept open for regular files and directories
+
+            // Read-only mapping of the whole file shared by everyone serving it, created on first use
+            std::shared_ptr<const FileMapping> mapping() const;
+
+            // The entity-tag to send, based on a hash of the content once it has been computed
+            // in the background (if enabled) and on the inode, mtime and size before that.
+            std::string etag() const;
+
+            // Whether `tag` (opaque-tag in quotes, without W/) is one of the tags this entry has sent
+            bool matchesETag(std::string_view tag) const;
+
+        private:
+            friend class FileCache;
+
+            mutable std::once_flag m_mapOnce;
+            mutable std::shared_ptr<const FileMapping> m_mapping;
+
+            std::string m_metadataTag;
+            mutable std::uint64_t m_contentHash = 0;        // Published by the background hasher
+            mutable std::atomic<bool> m_hashed{false};      // Set (with release semantics) once m_contentHash is written
+        };
+
+        using Handle = std::shared_ptr<const Entry>;
+
+        static FileCache& get();
+
+        /**
+        * Set the maximum number of cached entries (0 disables caching) and how
+        * long an entry is trusted before it is revalidated with a statx().
+        */
+        void configure(std::size_t capacity, std::chrono::milliseconds ttl);
+
+        // Compute a hash of each regular file on a background thread to serve as its ETag
+        void enableContentTags(bool enable) { m_contentTags = enable; }
+
+        /**
+        * Resolve `location` (a path relative to the DocumentRoot, which it can't lead out of)
+        * the way it should be served: directories containing an index.html
+        * resolve to the index, regular files come with an open descriptor.
+        *
+        * A fresh hit costs no system call, a stale hit costs exactly one statx(). With the
+        * NamespaceIndex, neither does a stale hit nor a path which doesn't exist.
+        *
+        * @return The entry, never null. Check entry->info.type for the outcome.
+        */
+        Handle resolve(const std::string& location);
+
+    private:
+        FileCache() = default;
+
+        // `known` is what the NamespaceIndex knows of `location`, if anything
+        Handle load(const std::string& location, const NamespaceIndex::Node* known);
+        bool stillValid(const Entry& entry) const;
+
+        struct Slot
+        {
+            Handle entry;
+            std::chrono::steady_clock::time_point validated;
+            std::list<std::string>::iterator lruPosition;
+        };
+
+        std::mutex m_mutex;
+        std::unordered_map<std::string, Slot> m_slots;
+        std::list<std::string> m_lru;  // Most recently used at the front
+
+        std::size_t m_capacity = 1024;
+        std::chrono::milliseconds m_ttl{2000};
+        std::atomic<bool> m_contentTags{false};
+    };
+}
+
+#endif // FILECACHE_HPP
@@ -0,0 +1,59 @@
+/*
+ *  Ryuuk
+ * -------
+ *  Ryuuk is an upcoming webserver written by Shinigamis
+ *
+ * FileMapping - A shared, read-only memory mapping of a file
+ *
+ */
+
+#ifndef FILEMAPPING_HPP
+#define FILEMAPPING_HPP
+
+#include <cstddef>
+#include <memory>
+#include <string_view>
+
+namespace ryuuk
+{
+    class FileMapping
+    {
+    public:
+        /**
+        * Map the first `size` bytes of `fd` read-only.
+        *
+        * @return The mapping, or null if the file can't be mapped
+        */
+        static std::shared_ptr<const FileMapping> create(int fd, std::size_t size);
+
+        FileMapping(const FileMapping& other) = delete;
+        FileMapping& operator=(const FileMapping& other) = delete;
+        ~FileMapping();
+
+        std::string_view data() const { return {m_data, m_size}; }
+
+        /**
+        * Copy `length` bytes at `offset` out of the mapping into `destination`.
+        *
+        * Touching a page past the end of a file that was truncated after being mapped
+        * raises SIGBUS. This copy catches that and fails gracefully instead.
+        *
+        * @return false if the file shrank under us
+        */
+        bool copy(char* destination, std::size_t offset, std::size_t length) const;
+
+        /**
+        * Install the SIGBUS handler which makes copy() safe. Faults outside copy()
+        * are still fatal, as they should be.
+        */
+        static void installSignalHandler();
+
+    private:
+        FileMapping(const char* data, std::size_t size) : m_data(data), m_size(size) {}
+
+        const char* m_data;
+        std::size_t m_size;
+    };
+}
+
+#endif // FILEMAPPING_HPP
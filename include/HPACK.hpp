@@ -0,0 +1,90 @@
+/*
+ *  Ryuuk
+ * -------
+ *  Ryuuk is an upcoming webserver written by Shinigamis
+ *
+ * HPACK - Header compression for HTTP/2 (RFC 7541)
+ *
+ */
+
+#ifndef HPACK_HPP
+#define HPACK_HPP
+
+#include <cstddef>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace ryuuk
+{
+    using HeaderList = std::vector<std::pair<std::string, std::string>>;
+
+    // The dynamic table, newest entry first, as both ends of a connection keep it
+    class HeaderTable
+    {
+    public:
+        explicit HeaderTable(std::size_t maxSize = 4096) : m_maxSize(maxSize) {}
+
+        void add(std::string name, std::string value);
+        void setMaxSize(std::size_t maxSize);
+        std::size_t maxSize() const { return m_maxSize; }
+
+        // Entry `index` of the static and dynamic table combined (starting at 1), false if there's none
+        bool at(std::size_t index, std::string_view& name, std::string_view& value) const;
+
+        /**
+        * The index of the entry `name: value`, or failing that, of an entry with `name`.
+        *
+        * @param exact - set to whether the value matched as well
+        * @return 0 if there's no entry with `name`
+        */
+        std::size_t find(std::string_view name, std::string_view value, bool& exact) const;
+
+    private:
+        void evict();
+
+        std::deque<std::pair<std::string, std::string>> m_entries;
+        std::size_t m_size = 0;         // As HPACK counts it, 32 bytes of overhead per entry
+        std::size_t m_maxSize;
+    };
+
+    class HPACKDecoder
+    {
+    public:
+        /**
+        * Decode a complete header block, appending the fields to `headers`.
+        * Blocks must be decoded in the order they arrive on the connection.
+        *
+        * @return false if the block is malformed, which is fatal to the connection
+        */
+        bool decode(std::string_view block, HeaderList& headers);
+
+        // The table size the block may ask for, our SETTINGS_HEADER_TABLE_SIZE
+        void setMaxTableSize(std::size_t size) { m_limit = size; }
+
+    private:
+        HeaderTable m_table;
+        std::size_t m_limit = 4096;
+    };
+
+    class HPACKEncoder
+    {
+    public:
+        // Start a header block, call before encoding its first field
+        void begin(std::string& out);
+
+        // Append a field, `name` in lowercase
+        void encode(std::string& out, std::string_view name, std::string_view value);
+
+        // The peer's SETTINGS_HEADER_TABLE_SIZE, we use up to 4 KB of it
+        void setMaxTableSize(std::size_t size);
+
+    private:
+        HeaderTable m_table;
+        bool m_sizeChanged = false;
+    };
+}
+
+#endif // HPACK_HPP
@@ -14,12 +14,25 @@ namespace ryuuk
     public:
         struct Result
         {
-            std::unique_ptr<Response> response;
             bool keepAlive;         // Whether connection should be kept
             std::size_t bytesRead;  // Bytes consumed from the request (may not be request.size())
         };
 
-        Result buildResponse(const std::string& request);
+        /**
+        * Parse the first request in `request` and write the response to it into `response`.
+        *
+        * @param flags - ResponseCreator flags of the connection, like UserSpaceSend
+        */
+        Result buildResponse(const std::string& request, Response& response, unsigned int flags = 0);
+
+        /**
+        * Write the response to a parsed request into `response`. The request target
+        * may still carry its query.
+        *
+        * @param flags - ResponseCreator flags of the connection, NoPayload is added for HEAD
+        */
+        void respond(const std::string& method, std::string location, RequestFields fields,
+                     unsigned int flags, Response& response);
     private:
 
         std::string m_response;
@@ -0,0 +1,131 @@
+/*
+ *  Ryuuk
+ * -------
+ *  Ryuuk is an upcoming webserver written by Shinigamis
+ *
+ * HTTP2 - HTTP/2 connections (RFC 7540), their streams answered by the same ResponseCreator as HTTP/1.1
+ *
+ */
+
+#ifndef HTTP2_HPP
+#define HTTP2_HPP
+
+#include "HPACK.hpp"
+#include "ResponseCreator.hpp"
+#include "SocketStream.hpp"
+
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace ryuuk
+{
+    /**
+    * Serves an HTTP/2 connection on a non-blocking socket.
+    *
+    * Each stream gets its own Response. Their DATA frames are interleaved
+    * round-robin, one frame per stream at a time, within the flow control
+    * windows the client grants. A frame carrying part of a file is written
+    * as its 9 byte header followed by sendfile() of the payload, so files
+    * still never pass through user space.
+    */
+    class HTTP2Connection
+    {
+    public:
+        // What a client sends first on an HTTP/2 connection
+        static constexpr std::string_view Preface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+        HTTP2Connection(SocketStream& socket, std::uint32_t maxStreams);
+        ~HTTP2Connection();
+
+        /**
+        * Serve the connection until either end closes it.
+        *
+        * @param received - what was read of the connection already, starting with the preface
+        */
+        void serve(std::string received);
+
+    private:
+        struct Stream
+        {
+            std::uint32_t id;
+            Response response;
+            Chunk chunk;                // What's left to send of the current chunk
+            std::int64_t window;        // Flow control window, may go negative when the client shrinks it
+            bool ready = false;         // In m_ready
+            std::uint64_t sent = 0;     // Bytes of header blocks and DATA payloads, for the AccessLog
+        };
+
+        // Parse and handle the complete frames in m_input. Returns false if the client isn't speaking HTTP/2.
+        bool processInput();
+        void handleFrame(std::uint8_t type, std::uint8_t flags, std::uint32_t streamId, std::string_view payload);
+        void handleSettings(std::string_view payload);
+        void handleWindowUpdate(std::uint32_t streamId, std::uint32_t increment);
+        void handleHeaderBlock(std::uint32_t streamId, bool endStream);
+
+        // Send the status and header fields of a new stream's response
+        void startResponse(std::unique_ptr<Stream> stream);
+
+        // Make sure stream.chunk isn't used up, false if the response is complete
+        bool advance(Stream& stream);
+
+        // Write the next DATA frame of `stream` to m_output
+        void writeData(Stream& stream);
+
+        void schedule(Stream& stream);
+        void retire(std::uint32_t streamId);
+        void resetStream(std::uint32_t streamId, std::uint32_t error);
+        void connectionError(std::uint32_t error);
+
+        void queueFrame(std::uint8_t type, std::uint8_t flags, std::uint32_t streamId, std::string_view payload);
+
+        // Refill m_output with queued frames, then DATA frames
+        void fillOutput();
+
+        // Send as much as the socket takes. Returns false if the connection failed.
+        bool flush();
+        bool outputPending() const;
+
+        SocketStream& m_socket;
+        const std::uint32_t m_maxStreams;
+
+        std::string m_input;
+        bool m_prefaceReceived = false;
+
+        HPACKDecoder m_decoder;
+        HPACKEncoder m_encoder;
+        std::string m_headerBlock;              // Of a HEADERS frame continued by CONTINUATION frames
+        std::uint32_t m_headerStream = 0;       // Its stream, 0 if there's none
+        bool m_headerEndStream = false;
+
+        std::map<std::uint32_t, std::unique_ptr<Stream>> m_streams;
+        std::deque<std::uint32_t> m_ready;      // Streams with DATA to send, in turn
+        std::vector<std::unique_ptr<Stream>> m_retired;     // Done, but their last frame may still be queued
+        std::uint32_t m_lastStream = 0;
+        bool m_answered = false;                // A request was, those after it reuse the connection
+
+        std::int64_t m_sendWindow = 65535;      // Connection flow control window
+        std::uint32_t m_initialWindow = 65535;  // Of new streams, the client's SETTINGS_INITIAL_WINDOW_SIZE
+        std::uint32_t m_maxFrameSize = 16384;   // The client's SETTINGS_MAX_FRAME_SIZE
+
+        bool m_goingAway = false;               // The client sent GOAWAY, finish the streams we have
+        bool m_closing = false;                 // We sent GOAWAY after an error, close once it's out
+
+        std::string m_control;                  // Frames waiting for m_output to be sent
+        std::string m_output;
+        std::size_t m_outputSent = 0;
+        struct
+        {
+            int fd = -1;
+            off_t offset = 0;
+            std::size_t length = 0;
+            off_t end = 0;                      // Of the stream's range of the file, which is read ahead
+        } m_file;                               // Payload of the DATA frame ending m_output
+    };
+}
+
+#endif // HTTP2_HPP
@@ -0,0 +1,69 @@
+/*
+ *  Ryuuk
+ * -------
+ *  Ryuuk is an upcoming webserver written by Shinigamis
+ *
+ * ListingCache - Rendered directory listings, kept while the directory is unchanged
+ *
+ */
+
+#ifndef LISTINGCACHE_HPP
+#define LISTINGCACHE_HPP
+
+#include "FileCache.hpp"
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace ryuuk
+{
+    class ListingCache
+    {
+    public:
+        using Body = std::shared_ptr<const std::string>;
+
+        static ListingCache& get();
+
+        // Set the maximum number of cached listings (0 disables caching) and of entries in a listing
+        void configure(std::size_t capacity, std::size_t maxEntries);
+
+        /**
+        * The HTML listing of a directory.
+        *
+        * A listing is reused for as long as the directory keeps the inode and
+        * mtime it had when it was rendered, which changes whenever an entry
+        * is added, removed or renamed.
+        *
+        * @param directory - the directory, as resolved by the FileCache
+        * @param location  - path of the directory, as shown in the listing
+        * @param tooLarge  - set to true if the directory has more entries than
+        *                    we render in one piece, it should be streamed instead
+        *
+        * @return The listing, or null if the directory couldn't be read or is too large
+        */
+        Body listing(const FileCache::Handle& directory, const std::string& location, bool& tooLarge);
+
+    private:
+        ListingCache() = default;
+
+        static Body render(int directory, const std::string& location, std::size_t maxEntries, bool& tooLarge);
+
+        struct Slot
+        {
+            Body body;          // Null if the directory was too large
+            FileInfo info;      // Of the directory when it was rendered
+            std::list<std::string>::iterator lruPosition;
+        };
+
+        std::mutex m_mutex;
+        std::unordered_map<std::string, Slot> m_slots;
+        std::list<std::string> m_lru;  // Most recently used at the front
+        std::size_t m_capacity = 256;
+        std::size_t m_maxEntries = 4096;
+    };
+}
+
+#endif // LISTINGCACHE_HPP
@@ -13,11 +13,10 @@
 
 #include <iostream>
 #include <string>
-#include <fstream>
-#include <memory>
-#include <cstring>
-#include <thread>
+#include <atomic>
+#include <cstdint>
 #include <mutex>
+#include <utility>
 
 #ifndef __FILENAME__
     #define __FILENAME__ __FILE__
@@ -25,7 +24,7 @@
 
 #define LOG(level) \
 if (level > ryuuk::Log::get().getLevel()) ; \
-else ryuuk::Log::get().getStream() << toLevelString(level) << '[' << __FILENAME__ << ":" << std::dec << __LINE__ << "] "
+else ryuuk::LogRecord(level, __FILENAME__, __LINE__)
 
 namespace ryuuk
 {
@@ -47,79 +46,105 @@ namespace ryuuk
         return "";
     }
 
-    class LockedStream
+    /**
+    * One statement's worth of log output. It is formatted into a buffer of the
+    * calling thread and queued, without taking any lock, when the statement
+    * ends. The "[LEVEL][file:line] " prefix is only formatted by the writer.
+    */
+    class LogRecord
     {
     public:
-        LockedStream(std::ostream& out, std::mutex& mutex);
-        LockedStream(LockedStream&& other) = default;
-        LockedStream(const LockedStream& other) = delete;
-        ~LockedStream();
+        // Without a `file`, the text is written as it is
+        LogRecord(Level level, const char* file, int line);
+        LogRecord(const LogRecord& other) = delete;
+        ~LogRecord();
 
         template <class T>
-        LockedStream& operator<<(T&& t)
+        LogRecord& operator<<(T&& t)
         {
             m_out << std::forward<T>(t);
             return *this;
         }
 
         // Special overload for functions (to allow manipualtors like endl etc)
-        LockedStream& operator<<(std::ostream& (*manip)(std::ostream&));
+        LogRecord& operator<<(std::ostream& (*manip)(std::ostream&));
     private:
         std::ostream& m_out;
-        std::mutex& m_mutex;
+        std::size_t m_start;    // Where the record starts in the thread's buffer, records may nest
+        Level m_level;
+        const char* m_file;
+        int m_line;
     };
 
+    /**
+    * Records are queued by each thread in a ring buffer of its own, which only
+    * it writes and only the writer thread reads. The writer formats what it
+    * finds in all of them, and writes it out in batches to the log file and
+    * the console. Should a ring be full, the record is dropped (and counted)
+    * or the thread waits for room, as configured.
+    */
     class Log
     {
     public:
+        struct Settings
+        {
+            bool block = false;                 // Wait for room in a full ring, rather than drop the record
+            std::size_t ringSize = 32 * 1024;   // Bytes per thread, rounded up to a power of 2
+            std::uint64_t rotateSize = 0;       // Rotate the log file past this many bytes, 0 never does
+            unsigned rotateKeep = 5;            // Rotated files kept, as file.1 (the latest) to file.N
+        };
+
+        static Log& get();
 
-        ~Log();
+        void configure(const Settings& settings);
 
-        void setLogStream(std::ostream& stream);
+        /**
+        * Log to the file at `path`, which is truncated, besides the standard
+        * output. Until then, and if it can't be opened, only to the standard error.
+        *
+        * @return false if the file can't be opened
+        */
+        bool open(const std::string& path);
 
         Log& setLevel(Level level);
 
         Level getLevel();
 
-        LockedStream getStream();
+        // A record without the level and location prefix
+        LogRecord getStream();
 
-        static Log& get();
+        // Wait until everything logged so far is written
+        void flush();
 
     private:
+        struct Ring;
 
-        Level m_logLevel;
+        Log();
 
-        std::ostream* m_logStream;
-        std::mutex m_mutex;
-        static std::unique_ptr<Log> m_instance;
-    };
+        friend class LogRecord;
+        // Queue the record in the calling thread's ring
+        void push(Level level, const char* file, int line, const char* text, std::size_t length);
+        Ring& threadRing();
 
-    //Courtesy of http://wordaligned.org/articles/cpp-streambufs#toctee-streams
-    class TeeBuf : public std::streambuf
-    {
-        public:
-            // Construct a streambuf which tees output to both input
-            // streambufs.
-            TeeBuf(std::streambuf* sb1, std::streambuf* sb2);
-        private:
-            // This tee buffer has no buffer. So every character "overflows"
-            // and can be put directly into the teed buffers.
-            virtual int overflow(int c);
-            // Sync both teed buffers.
-            virtual int sync();
-        private:
-            std::streambuf* m_sb1;
-            std::streambuf* m_sb2;
-    };
+        void run();
+        // Format the records of `ring` into `batch`
+        void drain(Ring& ring, std::string& batch);
+        void write(const std::string& batch);
+        void rotate();
 
-    class TeeStream : public std::ostream
-    {
-        public:
-            // Construct an ostream which tees output to the supplied
-            // ostreams.
-            TeeStream(std::ostream& o1, std::ostream& o2);
-        private:
-            TeeBuf m_tbuf;
+        Level m_logLevel;
+
+        std::atomic<Ring*> m_rings{nullptr};       // A list of all rings, which are never freed
+        std::atomic<std::uint64_t> m_cycles{0};    // Rounds of the writer over the rings
+        std::atomic<bool> m_block{false};
+        std::atomic<std::size_t> m_ringSize{32 * 1024};
+
+        std::mutex m_sinkMutex;                    // Only for the writer and configuration, never by records
+        int m_file = -1;
+        std::string m_path;
+        std::uint64_t m_fileSize = 0;
+        std::uint64_t m_rotateSize = 0;
+        unsigned m_rotateKeep = 5;
     };
 
 };
@@ -1,17 +1,59 @@
 #ifndef MIMEREGISTRY_H
 #define MIMEREGISTRY_H
-#include <unordered_map>
+#include <cstdint>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
 
 namespace ryuuk
 {
+    /**
+    * Types of files by extension. Types are registered while the config is read, from a
+    * mime.types file and the [MIME] section, then freeze() builds a perfect hash table out
+    * of them which is never modified again, so any thread may look them up. Lookups ignore
+    * case and hand out views of strings held by the table, the Content-Type line included.
+    */
     class MIMERegistry
     {
     public:
+        struct Type
+        {
+            std::string_view name;      // text/plain
+            std::string_view header;    // Content-Type: text/plain\r\n
+        };
+
+        // Map `extension` to `mime`, over any type it had, until frozen
         static void registerMIME(const std::string& extension, const std::string& mime);
-        static std::string fromExtension(const std::string& extension);
+
+        /**
+        * Import a mime.types file ("type ext ext..." lines). Extensions registered
+        * already, and the first type of those listed more than once, are kept.
+        *
+        * @return false if the file couldn't be read
+        */
+        static bool import(const std::string& path);
+
+        // Build the lookup table out of the types registered, no more can be added afterwards
+        static void freeze();
+
+        // The type of `extension`, application/octet-stream if it's unknown
+        static Type fromExtension(std::string_view extension);
+
     private:
-        static std::unordered_map<std::string, std::string> mimeTypes;
+        struct Entry
+        {
+            std::string extension;      // Lowercase
+            std::string header;
+        };
+
+        static std::uint64_t hash(std::string_view key, std::uint64_t seed);
+
+        static std::unordered_map<std::string, std::string> pending;    // Extension to type, until frozen
+        static std::vector<Entry> entries;
+        static std::vector<std::uint32_t> seeds;    // Per bucket, the seed placing its extensions in slots, 0 if empty
+        static std::vector<std::uint32_t> slots;    // Index in entries, a power of 2 in size
+        static bool frozen;
     };
 }
 
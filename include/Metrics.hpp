@@ -0,0 +1,175 @@
+/*
+ *  Ryuuk
+ * -------
+ *  Ryuuk is an upcoming webserver written by Shinigamis
+ *
+ * Metrics - Counters and latency histograms of the server, scraped in Prometheus' format
+ *
+ */
+
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include "AccessLog.hpp"
+#include "PerfCounters.hpp"
+#include "Trace.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <string>
+#include <string_view>
+
+namespace ryuuk
+{
+    namespace metrics
+    {
+        // A count only its thread adds to, so a relaxed load and store will do, and scrapes read
+        struct Counter
+        {
+            void add(std::uint64_t n = 1)
+            {
+                value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+            }
+            std::uint64_t get() const { return value.load(std::memory_order_relaxed); }
+
+            std::atomic<std::uint64_t> value{0};
+        };
+
+        /**
+        * Microseconds, counted in log-linear buckets as HdrHistogram does: values
+        * under 32 exactly, then 16 buckets per power of 2. Every value is known to
+        * within 1/16th of itself, up to MaxValue, above which it is counted as that.
+        */
+        struct Histogram
+        {
+            static constexpr std::uint32_t MaxValue = (1u << 26) - 1;      // About 67 s
+            static constexpr std::size_t Buckets = 368;
+
+            static constexpr std::size_t bucketOf(std::uint32_t value)
+            {
+                value = value < MaxValue ? value : MaxValue;
+                if (value < 32)
+                    return value;
+                const unsigned shift = 27 - __builtin_clz(value);          // Keeps the top 5 bits
+                return 16 * shift + (value >> shift);
+            }
+
+            // The highest value counted in `bucket`
+            static constexpr std::uint64_t highestOf(std::size_t bucket)
+            {
+                if (bucket < 32)
+                    return bucket;
+                const unsigned shift = bucket / 16 - 1;
+                return ((bucket % 16 + 17ull) << shift) - 1;
+            }
+
+            void record(std::uint32_t value)
+            {
+                counts[bucketOf(value)].add();
+                sum.add(value);
+            }
+
+            Counter counts[Buckets];
+            Counter sum;
+        };
+        static_assert(Histogram::Buckets == Histogram::bucketOf(Histogram::MaxValue) + 1, "Buckets cover MaxValue");
+
+        // The status codes counted apart, those the server sends. Any other is counted as "other".
+        constexpr std::uint16_t StatusCodes[] = {200, 206, 301, 304, 400, 403, 404, 405, 406, 412, 416, 500, 503};
+        constexpr std::size_t StatusCount = std::size(StatusCodes) + 1;
+        constexpr std::size_t MethodCount = std::size(accesslog::MethodNames);
+
+        inline std::size_t statusIndex(std::uint16_t status)
+        {
+            std::size_t i = 0;
+            while (i < std::size(StatusCodes) && StatusCodes[i] != status)
+                ++i;
+            return i;
+        }
+
+        enum Phase
+        {
+            Parse,
+            Resolve,
+            Send,
+            PhaseCount
+        };
+    }
+
+    /**
+    * The metrics of the server are counted by each thread into a block of its
+    * own, aligned to cache lines so threads never share one, and summed up when
+    * they are scraped. Counting costs a few plain adds: no locks, no atomic
+    * read-modify-writes and no contention with a scrape. Blocks are never freed,
+    * a thread takes over the block of one that exited so its counts still add up.
+    *
+    * Connections are served by a thread each, so each block has the state of at
+    * most one connection.
+    */
+    class Metrics
+    {
+    public:
+        struct Settings
+        {
+            std::string path;                       // Served at this path by the server, empty for none
+            std::string address = "127.0.0.1";      // Served on a listener of its own at address:port
+            unsigned port = 0;                      // 0 for none
+            unsigned perfSampleRate = 0;            // Count the hardware events of 1 in this many requests, 0 for none
+        };
+
+        struct alignas(64) Local
+        {
+            // Responses sent, by method and status
+            metrics::Counter requests[metrics::MethodCount][metrics::StatusCount];
+            metrics::Counter bytesIn;
+            metrics::Counter bytesOut;
+            metrics::Counter connectionsOpened;
+            metrics::Counter connectionsClosed;
+            metrics::Counter active;            // The connection is handling requests, 0 or 1
+            metrics::Counter reused;            // Requests on a connection that answered one already
+            metrics::Counter parseErrors;
+            metrics::Histogram phases[metrics::PhaseCount];
+            // Of the requests sampled by the PerfCounters, by the Trace mark ending the phase
+            metrics::Counter countedRequests;
+            metrics::Counter events[Trace::MarkCount][PerfCounters::EventCount];
+
+            // Count the response of `record`, which is complete
+            void observe(const accesslog::Record& record);
+
+            // Count the hardware events of a sampled request, from the readings at its marks
+            void count(const PerfCounters::Reading (&counters)[Trace::MarkCount]);
+
+            void setActive(bool value) { active.value.store(value, std::memory_order_relaxed); }
+
+        private:
+            friend class Metrics;
+            alignas(64) std::atomic<bool> owned{true};      // By a live thread
+            Local* next = nullptr;                          // Set before the block is listed, then never changed
+        };
+
+        static Metrics& get();
+
+        // The block of the calling thread
+        static Local& local();
+
+        void configure(const Settings& settings);
+        const Settings& settings() const { return m_settings; }
+
+        bool servesPath(std::string_view path) const { return !m_settings.path.empty() && path == m_settings.path; }
+
+        // All metrics, in the Prometheus text exposition format
+        std::string render() const;
+
+        static constexpr std::string_view ContentType = "text/plain; version=0.0.4; charset=utf-8";
+
+    private:
+        Metrics() = default;
+
+        Settings m_settings;
+        std::atomic<Local*> m_blocks{nullptr};      // A list of all blocks, which are never freed
+    };
+}
+
+#endif // METRICS_HPP
@@ -0,0 +1,102 @@
+/*
+ *  Ryuuk
+ * -------
+ *  Ryuuk is an upcoming webserver written by Shinigamis
+ *
+ * NamespaceIndex - The names under the document root, kept in memory and current with inotify
+ *
+ */
+
+#ifndef NAMESPACEINDEX_HPP
+#define NAMESPACEINDEX_HPP
+
+#include "Utility.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace ryuuk
+{
+    /**
+    * Every path under the DocumentRoot with its type and metadata, so requests for paths
+    * that don't exist, the existence of directory indexes and the freshness of cached
+    * files are all answered without a system call.
+    *
+    * The tree is indexed on a background thread, which watches every directory with
+    * inotify. A change makes the index unable to answer for anything below the directory
+    * it happened in, until the background thread has rebuilt it. Symbolic links aren't
+    * followed, paths through them are left to the file system as well.
+    *
+    * Lookups take no lock: the background thread publishes the tree and the changes
+    * it hasn't caught up with as one immutable snapshot, which readers load atomically
+    * and keep alive for as long as they use it.
+    */
+    class NamespaceIndex
+    {
+    public:
+        struct Node
+        {
+            FileType        type     = NonExistent;
+            bool            hasIndex = false;   // Directories containing a regular index.html
+            bool            complete = true;    // Directories whose entries are all indexed
+            bool            link     = false;   // Symbolic links, which the index knows nothing behind
+            std::uint64_t   size     = 0;
+            std::uint64_t   inode    = 0;
+            std::int64_t    mtime    = 0;       // Nanoseconds since the epoch, as in FileInfo
+        };
+
+        static NamespaceIndex& get();
+
+        /**
+        * Start indexing the document root in the background, or stop using the index.
+        * Trees with more than `maxEntries` paths aren't indexed.
+        */
+        void configure(bool enabled, std::size_t maxEntries);
+
+        /**
+        * Look up `location` ("./a/b", with or without a trailing slash).
+        *
+        * @param node - set to what's at `location`, with type NonExistent if there's nothing
+        * @return false if the index can't tell: it's disabled, not built yet, `location` is
+        *         behind a symbolic link or something changed there since it was built
+        */
+        bool lookup(std::string_view location, Node& node) const;
+
+    private:
+        using Tree = std::unordered_map<std::string, Node>;    // By path relative to the root, "" for the root
+
+        // What lookups see, never changed once published
+        struct Snapshot
+        {
+            std::shared_ptr<const Tree> tree;
+            std::unordered_set<std::string> dirty;      // Directories changed since the tree was built
+        };
+
+        NamespaceIndex() = default;
+
+        void run();
+
+        // Index the whole tree, adding inotify watches on its directories. Null if it's too large.
+        std::unique_ptr<Tree> build(int notify, std::unordered_map<int, std::string>& watches);
+
+        // Replace the snapshot lookups see, unless the index was disabled meanwhile
+        void publish(std::shared_ptr<const Tree> tree, const std::unordered_set<std::string>& dirty);
+
+        // Whether a change under `path` hasn't made it to the tree of `snapshot` yet
+        static bool pending(const Snapshot& snapshot, std::string_view path);
+
+        std::shared_ptr<const Snapshot> m_snapshot;     // Only through std::atomic_load and std::atomic_store
+
+        std::mutex m_mutex;                             // Of the settings and the state of the background thread
+        bool m_enabled = false;
+        bool m_running = false;
+        std::size_t m_maxEntries = 1000000;
+    };
+}
+
+#endif // NAMESPACEINDEX_HPP
@@ -0,0 +1,56 @@
+/*
+ *  Ryuuk
+ * -------
+ *  Ryuuk is an upcoming webserver written by Shinigamis
+ *
+ * OutputQueue - Responses of a connection waiting for its socket to become writable
+ *
+ */
+
+#ifndef OUTPUTQUEUE_HPP
+#define OUTPUTQUEUE_HPP
+
+#include "ResponseCreator.hpp"
+#include "SocketStream.hpp"
+
+#include <vector>
+
+namespace ryuuk
+{
+    /**
+    * Responses to (pipelined) requests, sent in order as the socket takes them
+    * without ever blocking on it. The queue holds up to `capacity` responses,
+    * its high-water mark: while it's full, no further requests should be read.
+    * Response objects are reused, with their buffers, as they're sent.
+    */
+    class OutputQueue
+    {
+    public:
+        explicit OutputQueue(std::size_t capacity);
+
+        // A reset response to write the answer to the next request into, queued by push()
+        Response& prepare();
+        void push();
+
+        bool empty() const { return m_count == 0; }
+        bool full() const { return m_count == m_responses.size(); }
+
+        /**
+        * Send as much of the queued responses as `socket` takes now.
+        *
+        * @return false if the connection failed and should be dropped
+        */
+        bool flush(SocketStream& socket);
+
+    private:
+        std::vector<Response> m_responses;     // A ring buffer
+        std::size_t m_first = 0;
+        std::size_t m_count = 0;
+
+        Chunk m_chunk;                          // What's left of the chunk being sent
+        bool m_sending = false;
+        std::uint64_t m_sent = 0;               // Bytes of the first response sent so far
+    };
+}
+
+#endif // OUTPUTQUEUE_HPP
@@ -0,0 +1,76 @@
+/*
+ *  Ryuuk
+ * -------
+ *  Ryuuk is an upcoming webserver written by Shinigamis
+ *
+ * PerfCounters - Hardware events counted around the phases of requests
+ *
+ */
+
+#ifndef PERFCOUNTERS_HPP
+#define PERFCOUNTERS_HPP
+
+#include <cstdint>
+
+namespace ryuuk
+{
+    /**
+    * The cycles, instructions, last level cache misses and branch misses of a
+    * sample of the requests (1 in SampleRate), read from the counters of the thread
+    * handling them with perf_event_open at the marks of the Trace, so the phase
+    * ending at a mark is counted the events since the previous one. Only events
+    * in user space are counted, which an unprivileged process may count of its own
+    * threads with the default perf_event_paranoid of 2: the share of the kernel in
+    * receiving and sending isn't.
+    *
+    * A thread opens its counters as one group, so they're scheduled on the PMU
+    * together, when it counts its first request and closes them as it exits.
+    * Reading them is a system call, which is why only a sample of the requests
+    * is counted. Where there are no counters to open, as in most containers and
+    * many virtual machines, the server runs as it would without them, which is
+    * logged once on startup.
+    */
+    class PerfCounters
+    {
+    public:
+        enum Event
+        {
+            Cycles,
+            Instructions,
+            CacheMisses,        // Of the last level cache, on most CPUs
+            BranchMisses,
+            EventCount
+        };
+
+        static constexpr const char* EventNames[EventCount] = {"cycles", "instructions", "llc_misses", "branch_misses"};
+
+        // The counts of a thread since it opened its counters, 0 for the events it has no counter of
+        struct Reading
+        {
+            std::uint64_t count[EventCount] = {};
+            bool taken = false;
+        };
+
+        // Probe the counters, and count 1 in `sampleRate` requests if there are any. 0 for none.
+        static void configure(unsigned sampleRate);
+
+        // Whether requests are counted at all
+        static bool enabled() { return s_enabled; }
+
+        // Whether `event` is, as not every CPU or hypervisor has every counter
+        static bool counts(Event event) { return s_enabled && (s_events & (1u << event)); }
+
+        // Whether to count the next request of the calling thread, whose counters are opened if need be
+        static bool sample();
+
+        // Read the counters of the calling thread into `reading`, false if it has none
+        static bool read(Reading& reading);
+
+    private:
+        static bool s_enabled;
+        static unsigned s_sampleRate;
+        static unsigned s_events;       // A bit for each event counted
+    };
+}
+
+#endif // PERFCOUNTERS_HPP
@@ -7,41 +7,138 @@
 #include <iterator>
 #include <string_view>
 #include <memory>
-#include <fstream>
+#include <vector>
+#include <sys/types.h>
+
+#include "AccessLog.hpp"
+#include "PerfCounters.hpp"
+#include "Trace.hpp"
+#include "FileCache.hpp"
+#include "ContentEncoding.hpp"
+#include "CompressionCache.hpp"
 
 namespace ryuuk
 {
-    class Response
+    // A piece of a response: `data` then `tail` from memory, followed by `length` bytes of the file `fd` from `offset`
+    struct Chunk
     {
-    public:
-        virtual ~Response() {};
-        virtual std::string_view nextChunk() = 0;
+        std::string_view data;
+        int fd = -1;
+        off_t offset = 0;
+        std::size_t length = 0;
+        bool more = false;      // More follows right away, don't push out a partial segment for `data` alone
+        std::string_view tail{};  // A shared body after the text, sent along with it in one go
+
+        bool empty() const { return data.empty() && tail.empty() && length == 0; }
     };
 
-    class SimpleResponse : public Response
+    // Produces the rest of a body while it is being sent, like a streamed directory listing
+    class ChunkGenerator
     {
     public:
-        SimpleResponse(std::string&& str) : m_responseString(std::move(str)) {}
-
-        std::string_view nextChunk() override;
-    private:
-        std::string m_responseString;
-        bool end = false;
+        virtual ~ChunkGenerator() {};
+        virtual Chunk nextChunk() = 0;
     };
 
-    class FileResponse : public Response
+    /**
+    * The response to a request. A connection keeps one and reuses it for each
+    * request, so its buffers are only allocated when a response needs more than
+    * the ones before it. The text (status line, headers and whatever else is
+    * generated up front) is followed by one of:
+    *  - nothing,
+    *  - slices of a file, each after a part of the text (multipart delimiters),
+    *    sent without copying them through user space,
+    *  - a read-only mapping of the whole file, shared with other responses,
+    *  - a body shared with a cache,
+    *  - the output of a ChunkGenerator.
+    */
+    class Response
     {
     public:
-        FileResponse(std::string&& httpPrefix, const std::string& location);
-        std::string_view nextChunk() override;
+        // Forget the previous response, but keep the buffers
+        void reset();
+
+        // Where the status line and headers are written
+        std::string& text() { return m_text; }
+
+        // Send `length` bytes of `file` from `offset`, after the text written since the previous slice
+        void addFileSlice(const FileCache::Handle& file, off_t offset, std::size_t length);
+
+        void setMapping(std::shared_ptr<const FileMapping> mapping);
+        void setBody(std::shared_ptr<const std::string> body);
+        void setGenerator(std::unique_ptr<ChunkGenerator> generator);
+
+        Chunk nextChunk();
+
+        // What the AccessLog records of the request answered, filled in as it's handled. Kept by reset().
+        accesslog::Record& record() { return m_record; }
+
+        // The phases of handling the request, timed into the record: the request is complete (which
+        // starts a new record), it's parsed, the response is created, and it was sent with `bytes` to
+        // `client`, which completes the record. It's then logged and counted by the Metrics.
+        void markReceived();
+        void markParsed();
+        void markCreated();
+        void markSent(std::uint64_t bytes, const sockaddr_storage& client);
+
+        // The Trace timestamps of the request, which the marks above set too, as they read
+        // the PerfCounters of the requests they sample
+        Trace::Marks& trace() { return m_trace; }
+        void mark(Trace::Mark mark)
+        {
+            if (Trace::enabled())
+                m_trace.at[mark] = Trace::now();
+            if (m_counted)
+                PerfCounters::read(m_counters[mark]);
+        }
 
-        enum class State { Uninitialized, Transferring, Finished };
     private:
-        State m_state = State::Uninitialized;
-        std::ifstream m_file;
-        std::string m_data;
-        std::uintmax_t m_responseSize;
-        std::uintmax_t m_transferred = 0;
+        enum Kind
+        {
+            Text,
+            FileSlices,
+            Mapped,
+            Body,
+            Generated,
+        };
+
+        struct Slice
+        {
+            std::size_t textEnd;    // The text up to here is sent before the slice
+            off_t offset;
+            std::size_t length;
+        };
+
+        Kind m_kind = Text;
+        std::string m_text;
+        FileCache::Handle m_file;
+        std::vector<Slice> m_slices;
+        std::shared_ptr<const FileMapping> m_mapping;
+        std::shared_ptr<const std::string> m_body;
+        std::unique_ptr<ChunkGenerator> m_generator;
+        std::size_t m_next = 0;     // Chunks sent, or with a mapping, the next byte of it to send
+
+        accesslog::Record m_record{};
+        std::uint64_t m_received = 0;   // Monotonic clock, ns
+        std::uint64_t m_phase = 0;      // When the last phase ended
+        Trace::Marks m_trace;
+        bool m_counted = false;
+        PerfCounters::Reading m_counters[Trace::MarkCount];
+    };
+
+    // Request header fields that change how a resource is sent
+    struct RequestFields
+    {
+        std::string range;
+        std::string ifRange;
+        std::string ifMatch;
+        std::string ifNoneMatch;
+        std::string ifModifiedSince;
+        std::string ifUnmodifiedSince;
+        std::string acceptEncoding;
+        std::string query;          // Of the request target, without the '?'
+        std::string referer;        // Only for the AccessLog
+        std::string userAgent;
     };
 
     class ResponseCreator
@@ -51,15 +148,21 @@ namespace ryuuk
         {
             // 2xx
             OK                  = 200,
+            PartialContent      = 206,
             // 3xx
             MovedPermanently    = 301,
+            NotModified         = 304,
             // 4xx
             BadRequest          = 400,
             Forbidden           = 403,
             NotFound            = 404,
             MethodNotAllowed    = 405,
+            NotAcceptable       = 406,
+            PreconditionFailed  = 412,
+            RangeNotSatisfiable = 416,
             // 5xx
             InternalError       = 500,
+            ServiceUnavailable  = 503,
         };
 
         enum Flags
@@ -69,25 +172,123 @@ namespace ryuuk
             NoPayload       = 1 << 2,
             KeepConnection  = 1 << 3,
             HTTPLegacy      = 1 << 4,
+            Multiplexed     = 1 << 5,   // HTTP/2, which frames messages itself and has no connection headers
+            UserSpaceSend   = 1 << 6,   // TLS encrypted in user space (without kTLS), which reads bodies itself
         };
 
-        ResponseCreator() = default;
+        // The response is written into `response`, which is reset first
+        explicit ResponseCreator(Response& response);
+
+        void setRequestFields(RequestFields&& fields) { m_request = std::move(fields); }
 
         // Different flags can be set by OR-ing them. Like SendDirectory | NoPayload
-        std::unique_ptr<Response> create(StatusCode code, const std::string& location = {}, unsigned int flags = None);
+        void create(StatusCode code, const std::string& location = {}, unsigned int flags = None);
+
+        // Send a file (or with SendDirectory, a listing) already resolved through the FileCache with 200 OK
+        void create(FileCache::Handle file, unsigned int flags = None);
+
+        // Send `body`, made up for this request, with 200 OK. It's neither cached nor compressed.
+        void create(std::shared_ptr<const std::string> body, std::string_view contentType, unsigned int flags = None);
+
+        struct Settings
+        {
+            // Files with sizes in [mappingMinSize, mappingMaxSize] are served from a shared mmap, 0 disables this
+            std::uintmax_t mappingMinSize = 0;
+            std::uintmax_t mappingMaxSize = 0;
+
+            // Serve "file.br", "file.zst" or "file.gz" instead of "file" to clients accepting them
+            bool precompressed = false;
+        };
+
+        static void configure(const Settings& settings);
+
+        /**
+        * Render the responses that are the same every time, but for their status line, Date
+        * and Connection: error pages, the body of redirects and 503 Service Unavailable.
+        * Call once after PageTemplates::load(), before any response is created.
+        */
+        static void prerender();
+
     private:
-        void sendResource(const std::string& location, bool nopayload);
+        // What follows the Connection field of a prebuilt response
+        struct Prebuilt
+        {
+            std::shared_ptr<const std::string> message;     // The rest of the head, and the body
+            std::shared_ptr<const std::string> head;        // Only the rest of the head, for HEAD
+        };
+        struct ByteRange
+        {
+            std::uintmax_t first;
+            std::uintmax_t last;    // Inclusive
+        };
 
+        // The status line and the fields every response has
+        void writeStatusLine(StatusCode code, unsigned int flags);
+
+        // Pick the content coding and swap m_file for a precompressed sibling if there's a suitable one,
+        // or fetch the body compressed on the fly if it's ready
+        StatusCode negotiateEncoding();
+
+        // Fetch the listing of m_file out of the ListingCache and pick its content coding, unless it's streamed
+        void negotiateListing(const std::string& path);
+
+        /**
+        * The body of m_file (or `data` if it isn't null) compressed with `encoding`, out of the
+        * CompressionCache. Unless `canWait`, it's compressed right away on a miss. Otherwise
+        * null is returned and it is compressed in the background for the next request.
+        */
+        CompressionCache::Body compressedBody(ContentEncoding encoding, std::shared_ptr<const std::string> data,
+                                              bool canWait);
+
+        // Evaluate the If-* headers against m_file (RFC 7232, section 6). Returns the status to send.
+        StatusCode evaluatePreconditions() const;
+
+        // Whether the list of entity-tags (or "*") in `header` has a match for m_file
+        bool etagListMatches(std::string_view header, bool strong) const;
+
+        // Evaluate the Range header against m_file, filling m_ranges. Returns the status to send.
+        StatusCode selectRanges();
+
+        // ETag and Last-Modified of m_file
+        void appendValidators();
+
+        // Cache-Control and Expires of the first [Caching] rule matching the response
+        void appendCachePolicy();
+
+        // Vary, for responses which depend on Accept-Encoding
+        void appendVary();
+
+        // Send m_file, or the ranges of it selected. Only `mappable` responses may be sent from a shared mmap.
+        void sendResource(bool nopayload, bool mappable);
+
+        // Send the prebuilt response of `code` after the head written so far
         void sendGenericError(StatusCode code, bool nopayload);
 
-        void sendDirectoryListing(const std::string& path, bool nopayload);
+        // Sends the cached listing, or streams it if it's too large or was asked for with options in the query
+        void sendDirectoryListing(const std::string& path, bool nopayload, bool chunked);
 
-        void permanentRedirect(const std::string& new_location);
+        void permanentRedirect(const std::string& new_location, bool nopayload);
 
-        std::string m_responseString;
+        Response& m_response;
+        std::string& m_responseString;      // The text of m_response
+        FileCache::Handle m_file;
+        RequestFields m_request;
+        std::string m_path;                 // As requested, "./..."
+        std::vector<ByteRange> m_ranges;
+        std::string_view m_contentType;            // Without parameters for files
+        std::string_view m_contentTypeHeader;      // Content-Type line of files, held by the MIMERegistry
+        ContentEncoding m_encoding = Identity;
+        CompressionCache::Body m_body;      // Compressed on the fly, which has a weak ETag
+        std::shared_ptr<const std::string> m_listing;   // The cached listing of a directory
+        bool m_streamListing = false;       // Too large to cache, or asked for with options
+        bool m_negotiated = false;          // The response depends on Accept-Encoding
 
         const static std::unordered_map<StatusCode, std::string, std::hash<int>> responsePhrase;
         const static std::string serverName;
+
+        static std::unordered_map<int, Prebuilt> prebuilt;
+
+        static Settings settings;
     };
 
 }
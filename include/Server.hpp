@@ -2,9 +2,17 @@
 #define SERVER_HPP
 
 #include "Log.hpp"
+#include "AccessLog.hpp"
+#include "Metrics.hpp"
+#include "Trace.hpp"
 #include "SocketStream.hpp"
 #include "SocketListener.hpp"
+#include "TLSListener.hpp"
 #include "ResponseCreator.hpp"
+#include "CompressionCache.hpp"
+#include "CachePolicy.hpp"
+#include "Template.hpp"
+#include "Worker.hpp"
 
 #include <map>
 #include <list>
@@ -32,6 +40,14 @@ namespace ryuuk
 
         void setConfigFile(const std::string& file);
 
+    private:
+        // Hand the connections of `listener` to workers until the server is shut down
+        template <typename Listener>
+        void acceptConnections(Listener& listener);
+
+        // Answer scrapes of the metrics listener until the server is shut down
+        void serveMetrics();
+
     public:
         const std::string SERVER_CONFIG_FILE = "ryuuk.conf";
         std::string m_configPath;
@@ -41,10 +57,52 @@ namespace ryuuk
             std::string ip;
             unsigned    port;
             unsigned    backlog;
+            WorkerSettings workers;
+
+            // [Files]
+            std::string root             = ".";
+            bool        indexTree        = false;
+            std::size_t indexTreeMaxEntries = 1000000;
+            std::string mimeTypes        = "/etc/mime.types";   // Empty for [MIME] types only
+            std::size_t fileCacheEntries = 1024;
+            unsigned    fileCacheTTL     = 2000;    // ms
+            bool        contentETags     = false;
+            std::uintmax_t mmapMinSize   = 0;       // 0 disables mmap serving
+            std::uintmax_t mmapMaxSize   = 0;
+            bool        precompressed    = false;
+            std::size_t listingCacheEntries = 256;
+            std::size_t listingMaxEntries   = 4096;   // Larger listings are streamed
+            std::size_t streamBufferSize    = 128 * 1024;
+            std::size_t streamMemory        = 64 * 1024 * 1024;
+
+            // [Compression]
+            CompressionCache::Settings compression;
+
+            // [TLS]
+            unsigned    tlsPort = 0;        // 0 disables HTTPS
+            TLSContext::Settings tls;
+
+            // [Caching], in order
+            std::vector<CachePolicy::Rule> caching;
+
+            // [Templates]
+            PageTemplates::Paths templates;
+
+            // [Logging]
+            Log::Settings logging;
+            AccessLog::Settings accessLog;
+
+            // [Metrics]
+            Metrics::Settings metrics;
+
+            // [Tracing]
+            Trace::Settings tracing;
         } server_manifest;
 
     private:
         SocketListener m_listener;
+        TLSListener m_tlsListener;
+        SocketListener m_metricsListener;       // On a loopback address, usually
         std::mutex m_queueMutex;
         std::list<int> m_cleanupQueue;
         std::map<int, std::thread> m_connections;
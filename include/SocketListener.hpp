@@ -16,6 +16,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <string>
 
 #include "Socket.hpp"
 #include "SocketStream.hpp"
@@ -47,10 +48,11 @@ namespace ryuuk
         *
         * @param port - The port to listen on
         * @param backlog - Max. no. of requests to queue
+        * @param address - The address to bind to, all of them if empty
         *
         * @return true if a socket was bound to `port`
         */
-        bool listen(int port, int backlog);
+        bool listen(int port, int backlog, const std::string& address = {});
 
         /**
         * Accept a client connection.
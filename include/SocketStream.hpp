@@ -12,12 +12,15 @@
 
 
 #include "Socket.hpp"
+#include "BufferPool.hpp"
+#include "TLS.hpp"
 
 #include <cstddef>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <arpa/inet.h>
+#include <memory>
 #include <string_view>
 
 
@@ -27,6 +30,7 @@ namespace ryuuk
     {
         Success,
         Disconnected,
+        WouldBlock,
         Error
     };
 
@@ -73,26 +77,115 @@ namespace ryuuk
         void shutdown();
 
         /**
-        * High level function to send data to
-        * a remote TCP socket.
+        * Speak TLS over the connection from now on, starting
+        * with the handshake.
+        */
+        void startTLS(std::unique_ptr<TLSSession> session);
+
+        /**
+        * Carry the TLS handshake on, if there's one to do.
+        *
+        * @return Done once the connection can carry requests,
+        *         or what to wait for before trying again
+        */
+        TLSStatus handshake();
+
+        /**
+        * The protocol agreed on by ALPN during the TLS handshake,
+        * empty if there was none.
+        */
+        std::string_view protocol() const;
+
+        /**
+        * Whether TLS encrypts what's sent in user space, without
+        * kTLS, reading it there rather than the kernel.
+        */
+        bool userSpaceTLS() const;
+
+        /**
+        * Whether received data is buffered (decrypted by TLS)
+        * and can be receive()d without the socket polling
+        * readable.
+        */
+        bool pending() const;
+
+        /**
+        * The address of the peer, as accept() gave it.
+        */
+        const sockaddr_storage& clientAddress() const { return m_clientAddr; }
+
+        /**
+        * Limit the bytes sitting unsent in the kernel's send buffer, past
+        * which the socket doesn't poll as writable (TCP_NOTSENT_LOWAT).
+        * Keeps the buffer from holding more than needed to keep the
+        * connection busy, so queued data stays in user space a bit longer.
+        */
+        void setNotSentLowat(int bytes);
+
+        /**
+        * Send as much of `data` as the (non-blocking) socket
+        * takes right now.
         *
         * @param data - data to send
+        * @param more - more data follows right away, hold back partial segments
+        *
+        * @return The no. of bytes sent, 0 if the socket isn't
+        *         writable, or -1 on error
+        */
+        ssize_t sendSome(std::string_view data, bool more = false);
+
+        /**
+        * Send as much of `data` followed by `tail` as the socket
+        * takes right now, with a single sendmsg() so neither has
+        * to be copied next to the other.
         *
-        * @return The no. of bytes sent
+        * @return The no. of bytes sent of both, 0 if the socket
+        *         isn't writable, or -1 on error
+        */
+        ssize_t sendSome(std::string_view data, std::string_view tail, bool more = false);
+
+        /**
+        * Send as much as the socket takes right now of the
+        * `length` bytes of the file `fd` starting at `offset`,
+        * with sendfile(), falling back to pread() and send()
+        * where the kernel can't do it without copying through
+        * user space (including TLS without kTLS), through
+        * buffers from the BufferPool.
         *
-        * NOTE: This funciton blocks the current
-        * thread until all the data has been sent.
+        * @return The no. of bytes sent, 0 if the socket isn't
+        *         writable or there's no buffer to copy through,
+        *         or -1 on error or if the file is
+        *         shorter than expected
+        */
+        ssize_t sendFileSome(int fd, off_t offset, std::size_t length);
+
+        /**
+        * The same, for a range which is only the part of a longer
+        * transfer ending at `end`, like the DATA frame of an HTTP/2
+        * stream: the file is read ahead up to `end` rather than the
+        * end of the range.
+        */
+        ssize_t sendFileSome(int fd, off_t offset, std::size_t length, off_t end);
+
+        /**
+        * Give back the buffers holding data of `fd`, whose transfer
+        * was cut short, before the descriptor may be reused.
+        */
+        void releaseFile(int fd) { m_readAhead.release(fd); }
+
+        /**
+        * While sendFileSome() has no buffer to copy through, a
+        * descriptor to poll for reading rather than polling
+        * the socket for writing, -1 otherwise.
         */
-        std::size_t send(std::string_view data);
+        int bufferWait() const { return m_readAhead.wakeDescriptor(); }
 
         /**
         * High level method to receive data from a
         * remote TCP socket.
         *
-        * @return a read-only view of the received message
-        *
-        * Note: This method blocks the current thread
-        * until all the data has been received.
+        * @return a read-only view of the received message,
+        *         WouldBlock if there was nothing to receive
         */
         std::pair<ReceiveResult, std::string_view> receive();
 
@@ -103,6 +196,12 @@ namespace ryuuk
 
         /* Temporary R/W buffer */
         char m_rwbuffer[DEFAULT_MSG_LENGTH];
+
+        /* The TLS session of an HTTPS connection */
+        std::unique_ptr<TLSSession> m_tls;
+
+        /* Buffers for sendFileSome() where sendfile() isn't supported, taken from the BufferPool */
+        ReadAhead m_readAhead;
     };
 }
 
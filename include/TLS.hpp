@@ -0,0 +1,115 @@
+/*
+ *  Ryuuk
+ * -------
+ *  Ryuuk is an upcoming webserver written by Shinigamis
+ *
+ * TLS - TLS sessions over OpenSSL, with the record encryption offloaded to the kernel (kTLS) where possible
+ *
+ */
+
+#ifndef TLS_HPP
+#define TLS_HPP
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <sys/types.h>
+
+// OpenSSL's types, so its headers stay out of ours
+struct ssl_ctx_st;
+struct ssl_st;
+
+namespace ryuuk
+{
+    enum class TLSStatus
+    {
+        Done,
+        WantRead,       // Try again once the socket is readable
+        WantWrite,      // Try again once the socket is writable
+        Closed,         // The peer closed the session
+        Failed
+    };
+
+    /**
+    * One TLS connection on a non-blocking socket. Every operation either
+    * completes at least partially or says what the socket must be waiting
+    * for before it's tried again.
+    */
+    class TLSSession
+    {
+    public:
+        ~TLSSession();
+
+        TLSSession(const TLSSession& other) = delete;
+        TLSSession& operator=(const TLSSession& other) = delete;
+
+        // Carry the handshake on, as far as the socket allows
+        TLSStatus handshake();
+
+        TLSStatus read(char* buffer, std::size_t size, std::size_t& received);
+        TLSStatus write(std::string_view data, std::size_t& sent);
+
+        /**
+        * Send a file range with sendfile(), which the kernel encrypts.
+        * Only possible if kernelSend() is true.
+        */
+        TLSStatus sendFile(int fd, off_t offset, std::size_t length, std::size_t& sent);
+
+        // Whether the records are encrypted by the kernel, so files can be sent without copying them
+        bool kernelSend() const;
+
+        // Whether decrypted data is waiting to be read, which the socket won't poll readable for
+        bool pending() const;
+
+        // The protocol chosen by ALPN, empty if the client didn't ask for one
+        std::string_view protocol() const;
+
+        // Send a close_notify, without waiting for the peer's
+        void shutdown();
+
+    private:
+        friend class TLSContext;
+        explicit TLSSession(ssl_st* ssl) : m_ssl(ssl) {}
+
+        ssl_st* m_ssl;
+    };
+
+    /**
+    * The certificate and settings shared by all sessions of a listener.
+    * Session IDs are cached and tickets issued, so returning clients can
+    * resume without a full handshake.
+    */
+    class TLSContext
+    {
+    public:
+        struct Settings
+        {
+            std::string certificate;        // PEM certificate chain
+            std::string privateKey;         // PEM private key
+            bool kernelOffload = true;      // Use kTLS when the kernel and cipher support it
+            long sessionCacheSize = 20480;  // Sessions kept for resumption by ID
+            long sessionTimeout = 300;      // s
+            bool http2 = false;             // Offer h2 with ALPN, ahead of http/1.1
+        };
+
+        /**
+        * @throw std::runtime_error if the certificate or key can't be loaded,
+        *        or ryuuk was built without OpenSSL
+        */
+        explicit TLSContext(const Settings& settings);
+        ~TLSContext();
+
+        TLSContext(const TLSContext& other) = delete;
+        TLSContext& operator=(const TLSContext& other) = delete;
+
+        // A session for the accepted socket `fd`, null on failure
+        std::unique_ptr<TLSSession> accept(int fd);
+
+    private:
+        ssl_ctx_st* m_context = nullptr;
+        std::string m_protocols;            // We speak, in order of preference, in ALPN's wire format
+    };
+}
+
+#endif // TLS_HPP
@@ -0,0 +1,57 @@
+/**
+*  Ryuuk - Simple, multi-threaded, C++ webserver
+* -----------------------------------------------
+*
+*  TLSListener
+* -------------
+*  Listens for HTTPS connections, which are handed
+*  out with a TLS session attached.
+*/
+
+
+#ifndef TLSLISTENER_HPP
+#define TLSLISTENER_HPP
+
+
+#include "SocketListener.hpp"
+#include "TLS.hpp"
+
+#include <memory>
+
+
+namespace ryuuk
+{
+
+    class TLSListener
+    {
+    public:
+
+        /**
+        * Load the certificate and key in `settings`, then bind
+        * a socket on `port` and listen on it.
+        *
+        * @return true if a socket was bound to `port`
+        *
+        * @throw std::runtime_error if the certificate or key can't be loaded
+        */
+        bool listen(int port, int backlog, const TLSContext::Settings& settings);
+
+        /**
+        * Accept a client connection. The handshake is left to
+        * whoever serves the connection, see SocketStream::handshake().
+        *
+        * @return The connection, invalid on failure
+        */
+        SocketStream accept();
+
+        bool valid() { return m_listener.valid(); }
+
+    private:
+
+        SocketListener m_listener;
+        std::unique_ptr<TLSContext> m_context;
+    };
+
+}
+
+#endif // TLSLISTENER_HPP
@@ -0,0 +1,105 @@
+/*
+ *  Ryuuk
+ * -------
+ *  Ryuuk is an upcoming webserver written by Shinigamis
+ *
+ * Template - Pages parsed once into literal text and placeholders, rendered in one pass
+ *
+ */
+
+#ifndef TEMPLATE_HPP
+#define TEMPLATE_HPP
+
+#include <initializer_list>
+#include <map>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace ryuuk
+{
+    // Append `text` with the characters that are special in HTML (text and attribute values) replaced by references
+    void appendHtmlEscaped(std::string& out, std::string_view text);
+
+    // Append `text` percent-encoded for use in a URL path, only unreserved characters and '/' are kept as they are
+    void appendUrlEncoded(std::string& out, std::string_view text);
+
+    /**
+    * A template like "<h2>Index of $DIR</h2>". Placeholders are written as
+    * $NAME or ${NAME}, which inserts the value HTML-escaped, ${NAME|url} which
+    * inserts it percent-encoded and ${NAME|raw} which inserts it as it is.
+    * A '$' that doesn't start a placeholder is literal text.
+    */
+    class Template
+    {
+    public:
+        Template() = default;
+
+        /**
+        * Parse `source`.
+        *
+        * @param variables - the names placeholders may use, values are passed to render() in this order
+        *
+        * @throw std::invalid_argument if a placeholder is malformed or uses an unknown name or filter
+        */
+        Template(std::string_view source, std::initializer_list<std::string_view> variables);
+
+        // Parse the content of the file at `path`, throws std::runtime_error if it can't be read
+        static Template fromFile(const std::string& path, std::initializer_list<std::string_view> variables);
+
+        // Append the template to `out`, with `values` (in the order of the variables) substituted
+        void render(std::string& out, std::initializer_list<std::string_view> values) const;
+
+        // The parts before and after the first placeholder using `variable`, which is dropped
+        std::pair<Template, Template> splitAt(std::string_view variable) const;
+
+    private:
+        enum Filter
+        {
+            Html,
+            Url,
+            Raw,
+        };
+
+        struct Segment
+        {
+            std::size_t offset;     // Literal text in m_literals, if variable is -1
+            std::size_t length;
+            int variable = -1;
+            Filter filter = Html;
+        };
+
+        std::string m_literals;
+        std::vector<Segment> m_segments;
+        std::vector<std::string> m_variables;
+    };
+
+    // Pages we generate, built in unless a template file is configured for them
+    struct PageTemplates
+    {
+        struct Paths
+        {
+            std::string listing;        // Variables DIR and LIST, where the entries go
+            std::string listingEntry;   // Variable NAME, with a trailing slash for directories
+            std::string error;          // Variables CODE and REASON
+            std::map<int, std::string> errors;  // Pages of particular status codes, over `error`
+        };
+
+        // Parse the templates once, before any request is served. Templates that can't be loaded are left built in.
+        static void load(const Paths& paths);
+
+        static const PageTemplates& get();
+
+        // The page of the status `code`, `error` unless it has its own
+        const Template& errorPage(int code) const;
+
+        Template listingHead;       // The listing template, split at $LIST
+        Template listingTail;
+        Template listingEntry;
+        Template error;
+        std::map<int, Template> errors;
+    };
+}
+
+#endif // TEMPLATE_HPP
@@ -0,0 +1,146 @@
+/*
+ *  Ryuuk
+ * -------
+ *  Ryuuk is an upcoming webserver written by Shinigamis
+ *
+ * Trace - Timestamps of the phases of requests, written out as Chrome trace events
+ *
+ */
+
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include "AccessLog.hpp"
+#include "PerfCounters.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <x86intrin.h>
+#endif
+
+namespace ryuuk
+{
+    /**
+    * Requests are timestamped as they go through the worker, the parser, the
+    * ResponseCreator and the send loop, with the TSC where it ticks at a constant
+    * rate (calibrated against the monotonic clock), or the monotonic clock. Once a
+    * response is sent, a sample of the requests (1 in SampleRate) and every request
+    * slower than SlowThreshold is written to the trace file, in the JSON array
+    * format of Chrome's trace events, which chrome://tracing and Perfetto open.
+    * Slow requests are logged with their breakdown as well.
+    *
+    * The events of a request are queued without a lock, and written out by a thread
+    * of their own, so a slow request isn't made slower still by the trace file.
+    *
+    * Each request is an async event of its own, with its phases nested in it,
+    * since pipelined and multiplexed requests overlap on a connection's thread.
+    */
+    class Trace
+    {
+    public:
+        // The points a request goes through, in order. The phases are the time between them.
+        enum Mark
+        {
+            Start,          // Its first bytes were received
+            Received,       // It's complete
+            Parsed,         // Its request line and fields are
+            Sanitized,      // The path is normalized
+            Resolved,       // The file is looked up (stat)
+            Created,        // The response head is built
+            Sent,           // The kernel took the last byte
+            MarkCount
+        };
+
+        // The phase ending at each mark
+        static constexpr const char* PhaseNames[MarkCount] = {nullptr, "receive", "parse", "sanitize", "resolve",
+                                                              "headers", "send"};
+
+        // Of a request, 0 for the marks it didn't go through
+        struct Marks
+        {
+            std::uint64_t at[MarkCount] = {};
+            std::string target;         // As requested, only kept while tracing
+        };
+
+        struct Settings
+        {
+            std::string file = "ryuuk-trace.json";
+            unsigned sampleRate = 0;            // Trace 1 in this many requests, 0 for none
+            std::uint64_t slowThreshold = 0;    // Trace every request slower than this, in µs. 0 for none.
+        };
+
+        static Trace& get();
+
+        // Start a new trace file, or stop tracing if neither sampling nor a threshold is set
+        void configure(const Settings& settings);
+
+        // Whether requests are timestamped at all
+        static bool enabled() { return s_enabled; }
+
+        // Ticks of the TSC, or nanoseconds of the monotonic clock
+        static std::uint64_t now()
+        {
+#if defined(__x86_64__) || defined(__i386__)
+            if (s_tsc)
+                return __rdtsc();
+#endif
+            return monotonicNow();
+        }
+
+        // Write out the request, whose response was sent, if it's sampled or slow. Its phases get the
+        // events of `counters`, read at the same marks, if it was counted.
+        void finish(const Marks& marks, const accesslog::Record& record,
+                    const PerfCounters::Reading* counters = nullptr);
+
+        // Write out what's queued and end the trace file
+        void close();
+
+    private:
+        struct Batch;
+
+        Trace() = default;
+
+        static std::uint64_t monotonicNow();
+
+        // Measure the TSC against the monotonic clock, if it's usable
+        void calibrate();
+
+        // Microseconds since the monotonic clock's epoch, for a timestamp of now()
+        double toMicroseconds(std::uint64_t ticks) const;
+
+        // The writer thread, until the trace file is closed
+        void run();
+
+        // Take the queued events, in the order they were queued. Called with m_mutex held.
+        void take(std::string& events);
+
+        // Called with m_mutex held
+        void writeOut(const std::string& events);
+
+        static bool s_enabled;
+        static bool s_tsc;
+
+        Settings m_settings;
+        double m_nsPerTick = 1;
+        std::uint64_t m_baseTicks = 0;
+        std::uint64_t m_baseNs = 0;
+        std::uint64_t m_thresholdTicks = 0;
+        std::atomic<std::uint64_t> m_sequence{0};      // Of requests, to sample them and tell them apart
+
+        std::atomic<Batch*> m_queued{nullptr};          // Newest first, taken as a whole by the writer
+        std::atomic<std::size_t> m_queuedBytes{0};
+        std::atomic<std::uint64_t> m_dropped{0};        // Requests whose events the queue had no room for
+        std::atomic<bool> m_open{false};                // Whether there's a trace file to queue events for
+
+        std::mutex m_mutex;                             // Of the file, for the writer and configuration only
+        int m_file = -1;
+        bool m_running = false;                         // The writer
+        std::uint64_t m_reported = 0;                   // Drops the writer told about
+    };
+}
+
+#endif // TRACE_HPP
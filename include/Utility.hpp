@@ -3,8 +3,10 @@
 
 
 #include <string>
+#include <string_view>
 #include <algorithm>
 #include <iomanip>
+#include <ctime>
 
 namespace ryuuk
 {
@@ -38,18 +40,18 @@ namespace ryuuk
     FileType getResourceType(const std::string& location);
 
     /*
-    * Sanitize path (relative to current working directory)
-    * Path above the current directory results in a domain_error being raised
-    * Paths starting with or w/o a slash are treated the same
+    * Normalize the path of a request target (relative to current working directory), appending it to `out`
+    * Anything from a '?' or '#' on is dropped, %xx escapes are decoded (hex digits in either case)
+    * and dot segments removed, as are empty ones. Paths starting with or w/o a slash are treated the same
     * Trailing slash is kept if present.
-    * Also does URL-decoding, %xx is converted to \uxx character (xx in hex)
-    * Paths that can not be sanitized result in domain_error being raised
+    * Paths above the current directory, malformed escapes and encoded nulls result in domain_error being raised
     */
-    std::string sanitizePath(const std::string& path);
+    void normalizePath(std::string_view path, std::string& out);
 
     std::string conv(const std::string& s);
 
-    std::string replaceAll(const std::string& str, const std::string& key, const std::string& replacement);
+    // `t` as an IMF-fixdate, the format of HTTP dates: Sun, 06 Nov 1994 08:49:37 GMT
+    std::string httpDate(std::time_t t);
 }
 
 
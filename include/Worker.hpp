@@ -2,8 +2,39 @@
 #define WORKER_H
 #include "SocketStream.hpp"
 
+#include <cstdint>
+
 namespace ryuuk
 {
+    struct WorkerSettings
+    {
+        // Responses queued per connection before we stop reading pipelined requests
+        std::size_t pipelineDepth = 16;
+
+        // TCP_NOTSENT_LOWAT of connections, 0 leaves the system default
+        int notSentLowat = 16 * 1024;
+
+        // HTTP/2, with prior knowledge or negotiated by TLS, and the streams a connection may have open at once
+        bool http2 = true;
+        std::uint32_t maxStreams = 100;
+
+        // Connections served at once, those past it are answered 503 Service Unavailable. 0 for no limit.
+        std::size_t maxConnections = 0;
+    };
+
+    void configureWorkers(const WorkerSettings& settings);
+
+    /**
+    * Count a connection about to be handed to worker(), as soon as it's accepted.
+    *
+    * @return false if MaxConnections are served already, and the connection is to be refused
+    */
+    bool admit();
+
+    // Answer 503 to a plain HTTP connection that wasn't admitted and close it, without a thread of its own
+    void refuse(SocketStream&& socket);
+
+    // Serve an admitted connection until it's closed
     void worker(SocketStream&& socket);
 }
 
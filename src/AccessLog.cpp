@@ -0,0 +1,193 @@
+#include "AccessLog.hpp"
+#include "Log.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <thread>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace ryuuk
+{
+    using accesslog::Record;
+    using accesslog::SegmentHeader;
+
+    struct AccessLog::Segment
+    {
+        int fd;
+        char* map;
+        std::size_t mapSize;
+        std::uint64_t capacity;                     // Records
+        std::string path;
+        std::atomic<std::uint64_t> next{0};         // The next record to claim, may run past capacity
+        std::atomic<unsigned> writers{0};           // Appending right now
+    };
+
+    AccessLog& AccessLog::get()
+    {
+        static AccessLog instance;
+        return instance;
+    }
+
+    std::uint64_t AccessLog::monotonicNow()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    std::uint64_t AccessLog::wallclockNow()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    void AccessLog::configure(const Settings& settings)
+    {
+        close();
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_settings = settings;
+        if (m_settings.directory.empty())
+            return;
+        m_current.store(openSegment(), std::memory_order_release);
+    }
+
+    AccessLog::Segment* AccessLog::openSegment()
+    {
+        char stamp[32];
+        auto now = std::time(nullptr);
+        std::strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", std::gmtime(&now));
+        char sequence[16];
+        std::snprintf(sequence, sizeof(sequence), "-%04u", m_sequence++);
+        auto path = m_settings.directory + "/access-" + stamp + sequence + ".rlog";
+
+        const std::uint64_t capacity = std::max<std::uint64_t>(
+                (m_settings.segmentSize - sizeof(SegmentHeader)) / sizeof(Record), 1);
+        const std::size_t size = sizeof(SegmentHeader) + capacity * sizeof(Record);
+
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd < 0)
+        {
+            LOG(ERROR) << "Couldn't create access log segment " << path << ", errno: " << errno
+                       << ". Requests are no longer logged" << std::endl;
+            return nullptr;
+        }
+        // Allocated for real, so running out of space can't raise SIGBUS when a record is written
+        int error = posix_fallocate(fd, 0, size);
+        void* map = error ? MAP_FAILED : ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED)
+        {
+            LOG(ERROR) << "Couldn't allocate access log segment " << path << ", errno: " << (error ? error : errno)
+                       << ". Requests are no longer logged" << std::endl;
+            ::close(fd);
+            ::unlink(path.c_str());
+            return nullptr;
+        }
+
+        SegmentHeader header{};
+        std::memcpy(header.magic, accesslog::Magic, sizeof(header.magic));
+        header.version = accesslog::Version;
+        header.recordSize = sizeof(Record);
+        header.created = wallclockNow();
+        std::memcpy(map, &header, sizeof(header));
+
+        // Never freed: a thread may still look at it after it's replaced, before it sees it was
+        auto segment = new Segment;
+        segment->fd = fd;
+        segment->map = static_cast<char*>(map);
+        segment->mapSize = size;
+        segment->capacity = capacity;
+        segment->path = std::move(path);
+        LOG(INFO) << "Logging requests to " << segment->path << std::endl;
+        return segment;
+    }
+
+    void AccessLog::append(Record& record, const sockaddr_storage& address)
+    {
+        if (address.ss_family == AF_INET6)
+        {
+            auto& in6 = reinterpret_cast<const sockaddr_in6&>(address);
+            std::memcpy(record.address, &in6.sin6_addr, 16);
+            record.port = ntohs(in6.sin6_port);
+        }
+        else if (address.ss_family == AF_INET)
+        {
+            auto& in = reinterpret_cast<const sockaddr_in&>(address);
+            std::memset(record.address, 0, 10);
+            record.address[10] = record.address[11] = 0xff;
+            std::memcpy(record.address + 12, &in.sin_addr, 4);
+            record.port = ntohs(in.sin_port);
+        }
+        record.committed = 0;
+
+        while (true)
+        {
+            auto segment = m_current.load(std::memory_order_acquire);
+            if (!segment)
+                return;
+
+            // Announce ourselves before claiming a record, then make sure the segment wasn't replaced meanwhile:
+            // whoever replaced it waits for us before unmapping it
+            segment->writers.fetch_add(1, std::memory_order_seq_cst);
+            if (m_current.load(std::memory_order_seq_cst) != segment)
+            {
+                segment->writers.fetch_sub(1, std::memory_order_release);
+                continue;
+            }
+
+            auto index = segment->next.fetch_add(1, std::memory_order_relaxed);
+            if (index < segment->capacity)
+            {
+                auto slot = reinterpret_cast<Record*>(segment->map + sizeof(SegmentHeader)) + index;
+                std::memcpy(slot, &record, offsetof(Record, committed));
+                __atomic_store_n(&slot->committed, 1u, __ATOMIC_RELEASE);
+                segment->writers.fetch_sub(1, std::memory_order_release);
+                return;
+            }
+
+            segment->writers.fetch_sub(1, std::memory_order_release);
+            rotate(segment);
+        }
+    }
+
+    void AccessLog::rotate(Segment* full)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_current.load(std::memory_order_relaxed) != full)
+                return;     // Someone else did
+            m_current.store(openSegment(), std::memory_order_seq_cst);
+        }
+        finish(full);
+    }
+
+    void AccessLog::finish(Segment* segment)
+    {
+        // Let the writers which claimed records in it finish them
+        while (segment->writers.load(std::memory_order_acquire) != 0)
+            std::this_thread::yield();
+
+        auto used = std::min(segment->next.load(std::memory_order_relaxed), segment->capacity);
+        ::munmap(segment->map, segment->mapSize);
+        if (::ftruncate(segment->fd, sizeof(SegmentHeader) + used * sizeof(Record)) != 0)
+        {
+            LOG(ERROR) << "Couldn't truncate access log segment " << segment->path << ", errno: " << errno << std::endl;
+        }
+        ::close(segment->fd);
+        segment->map = nullptr;
+    }
+
+    void AccessLog::close()
+    {
+        Segment* segment;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            segment = m_current.exchange(nullptr, std::memory_order_seq_cst);
+        }
+        if (segment)
+            finish(segment);
+    }
+}
@@ -0,0 +1,263 @@
+#include "BufferPool.hpp"
+#include "Log.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+namespace ryuuk
+{
+    BufferPool::Buffer::Buffer(Buffer&& other) noexcept
+        : m_data(std::move(other.m_data))
+    {}
+
+    BufferPool::Buffer& BufferPool::Buffer::operator=(Buffer&& other) noexcept
+    {
+        if (this != &other)
+        {
+            if (m_data)
+                BufferPool::get().release(std::move(m_data));
+            m_data = std::move(other.m_data);
+        }
+        return *this;
+    }
+
+    BufferPool::Buffer::~Buffer()
+    {
+        if (m_data)
+            BufferPool::get().release(std::move(m_data));
+    }
+
+    BufferPool& BufferPool::get()
+    {
+        static BufferPool instance;
+        return instance;
+    }
+
+    void BufferPool::configure(std::size_t bufferSize, std::size_t memoryLimit)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_bufferSize = std::max<std::size_t>(bufferSize, 4096);
+        // At least one buffer, or transfers would wait forever
+        m_maxBuffers = std::max<std::size_t>(memoryLimit / m_bufferSize, 1);
+        m_free.clear();
+        m_allocated = 0;
+    }
+
+    BufferPool::Buffer BufferPool::acquire(int wake)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto woken = std::find(m_woken.begin(), m_woken.end(), wake);
+        bool kept = woken != m_woken.end();
+        if (kept)
+            m_woken.erase(woken);
+
+        // The spare buffers may all be kept for woken transfers, a buffer kept for this one is among them
+        if (!kept && spare() <= m_woken.size())
+        {
+            if (std::find(m_parked.begin(), m_parked.end(), wake) == m_parked.end())
+                m_parked.push_back(wake);
+            return {};
+        }
+        m_parked.erase(std::remove(m_parked.begin(), m_parked.end(), wake), m_parked.end());
+        return take();
+    }
+
+    void BufferPool::unpark(int wake)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_parked.erase(std::remove(m_parked.begin(), m_parked.end(), wake), m_parked.end());
+        // Pass on the buffer kept for it, if it was woken already
+        m_woken.erase(std::remove(m_woken.begin(), m_woken.end(), wake), m_woken.end());
+        wakeParked();
+    }
+
+    BufferPool::Buffer BufferPool::tryAcquire()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        // Read-ahead is a luxury, leave the buffers to transfers that have none
+        if (!m_parked.empty() || spare() <= m_woken.size())
+            return {};
+        return take();
+    }
+
+    BufferPool::Buffer BufferPool::take()
+    {
+        if (!m_free.empty())
+        {
+            auto data = std::move(m_free.back());
+            m_free.pop_back();
+            return Buffer(std::move(data));
+        }
+        ++m_allocated;
+        return Buffer(std::make_unique<char[]>(m_bufferSize));
+    }
+
+    void BufferPool::wakeParked()
+    {
+        while (!m_parked.empty() && spare() > m_woken.size())
+        {
+            int wake = m_parked.front();
+            m_parked.pop_front();
+            m_woken.push_back(wake);
+            const std::uint64_t one = 1;
+            if (::write(wake, &one, sizeof(one)) < 0)
+            {
+                LOG(ERROR) << "Couldn't wake a transfer waiting for a buffer, errno: " << errno << std::endl;
+            }
+        }
+    }
+
+    void BufferPool::release(std::unique_ptr<char[]> data)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_free.push_back(std::move(data));
+        wakeParked();
+    }
+
+    ReadAhead::ReadAhead(ReadAhead&& other) noexcept
+        : m_front(std::move(other.m_front))
+        , m_back(std::move(other.m_back))
+        , m_wake(other.m_wake)
+        , m_parked(other.m_parked)
+    {
+        other.m_wake = -1;
+        other.m_parked = false;
+    }
+
+    ReadAhead::~ReadAhead()
+    {
+        release();
+        if (m_wake >= 0)
+            ::close(m_wake);
+    }
+
+    bool ReadAhead::Block::contains(int fd, off_t offset) const
+    {
+        return buffer && this->fd == fd && this->offset <= offset && offset < this->offset + static_cast<off_t>(length);
+    }
+
+    std::string_view ReadAhead::data(int fd, off_t offset, off_t end, bool& failed)
+    {
+        failed = false;
+        if (!m_front.contains(fd, offset))
+        {
+            if (m_back.contains(fd, offset))
+                std::swap(m_front, m_back);
+            else
+            {
+                // Another stream's block is kept for its next frame, rather than what was read ahead of it or of us
+                if (m_front.length != 0 && m_front.fd != fd &&
+                    (m_back.length == 0 || m_back.fd == fd || m_back.fd == m_front.fd))
+                {
+                    if (!m_back.buffer)
+                        m_back.buffer = BufferPool::get().tryAcquire();
+                    if (m_back.buffer)
+                        std::swap(m_front, m_back);
+                }
+                if (!m_front.buffer)
+                {
+                    if (m_wake < 0)
+                        m_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+                    if (m_wake < 0)
+                    {
+                        LOG(ERROR) << "eventfd() : Couldn't wait for a buffer. errno: " << errno << std::endl;
+                        failed = true;
+                        return {};
+                    }
+                    std::uint64_t signalled;
+                    if (m_parked && ::read(m_wake, &signalled, sizeof(signalled)) < 0 && errno != EAGAIN)
+                    {
+                        LOG(DEBUG) << "Couldn't reset the wake-up of a transfer, errno: " << errno << std::endl;
+                    }
+                    m_front.buffer = BufferPool::get().acquire(m_wake);
+                    m_parked = !m_front.buffer;
+                }
+                if (!m_front.buffer)
+                    return {};
+                if (!fill(m_front, fd, offset, end))
+                {
+                    failed = true;
+                    return {};
+                }
+            }
+        }
+        // The block may have been read for a longer transfer of the same file
+        return {m_front.buffer.data() + (offset - m_front.offset),
+                static_cast<std::size_t>(std::min<off_t>(m_front.offset + m_front.length, end) - offset)};
+    }
+
+    void ReadAhead::prefetch()
+    {
+        off_t next = m_front.offset + m_front.length;
+        if (!m_front.buffer || next >= m_front.end || m_back.contains(m_front.fd, next))
+            return;
+
+        // The block of another stream is worth more than reading ahead, have the kernel do it instead
+        if (m_back.length != 0 && m_back.fd != m_front.fd)
+        {
+            posix_fadvise(m_front.fd, next, std::min<off_t>(BufferPool::get().bufferSize(), m_front.end - next),
+                          POSIX_FADV_WILLNEED);
+            return;
+        }
+        if (!m_back.buffer)
+            m_back.buffer = BufferPool::get().tryAcquire();
+        if (!m_back.buffer)
+            return;
+        if (!fill(m_back, m_front.fd, next, m_front.end))
+            m_back.length = 0;      // Reported once the transfer gets there
+
+        // Have the kernel read the range after that in the background, ready for the next fill
+        off_t after = m_back.offset + m_back.length;
+        if (after < m_back.end)
+            posix_fadvise(m_back.fd, after, std::min<off_t>(BufferPool::get().bufferSize(), m_back.end - after),
+                          POSIX_FADV_WILLNEED);
+    }
+
+    void ReadAhead::release()
+    {
+        if (m_parked)
+            BufferPool::get().unpark(m_wake);
+        m_parked = false;
+        m_front = Block{};
+        m_back = Block{};
+    }
+
+    void ReadAhead::release(int fd)
+    {
+        if (m_back.fd == fd)
+            m_back = Block{};
+        if (m_front.fd == fd)
+        {
+            m_front = std::move(m_back);
+            m_back = Block{};
+        }
+    }
+
+    bool ReadAhead::fill(Block& block, int fd, off_t offset, off_t end)
+    {
+        block.fd = fd;
+        block.offset = offset;
+        block.end = end;
+        block.length = 0;
+
+        auto size = std::min<off_t>(BufferPool::get().bufferSize(), end - offset);
+        while (static_cast<off_t>(block.length) < size)
+        {
+            auto got = ::pread(fd, block.buffer.data() + block.length, size - block.length, offset + block.length);
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got <= 0)
+            {
+                LOG(ERROR) << "pread() : Couldn't read file to send. errno: " << errno << std::endl;
+                block.length = 0;
+                return false;
+            }
+            block.length += got;
+        }
+        return true;
+    }
+}
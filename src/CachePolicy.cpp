@@ -0,0 +1,241 @@
+#include "CachePolicy.hpp"
+#include "Log.hpp"
+#include "Utility.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <ctime>
+#include <stdexcept>
+#include <fnmatch.h>
+
+namespace ryuuk
+{
+    namespace
+    {
+        std::string lowercase(std::string_view text)
+        {
+            std::string lower{text};
+            for (auto& c : lower)
+                c = std::tolower(static_cast<unsigned char>(c));
+            return lower;
+        }
+
+        std::string_view trim(std::string_view text)
+        {
+            while (!text.empty() && std::isspace(static_cast<unsigned char>(text.front())))
+                text.remove_prefix(1);
+            while (!text.empty() && std::isspace(static_cast<unsigned char>(text.back())))
+                text.remove_suffix(1);
+            return text;
+        }
+
+        bool isGlob(std::string_view pattern)
+        {
+            return pattern.find_first_of("*?[") != std::string_view::npos;
+        }
+
+        // Validate the comma separated `directives`, setting `maxAge` from them. Returns the header line.
+        std::string compileDirectives(std::string_view directives, long& maxAge)
+        {
+            // Directives with a number of seconds, and those without an argument
+            const std::string_view Timed[] = {"max-age", "s-maxage", "stale-while-revalidate", "stale-if-error"};
+            const std::string_view Plain[] = {"immutable", "no-store", "no-cache", "public", "private",
+                                              "must-revalidate", "proxy-revalidate", "no-transform"};
+
+            std::string header = "Cache-Control: ";
+            bool first = true, immutable = false, noStore = false;
+            maxAge = -1;
+            while (!directives.empty())
+            {
+                auto comma = directives.find(',');
+                auto directive = lowercase(trim(directives.substr(0, comma)));
+                directives.remove_prefix(comma == std::string_view::npos ? directives.size() : comma + 1);
+                if (directive.empty())
+                    continue;
+
+                auto equals = directive.find('=');
+                std::string_view name = std::string_view{directive}.substr(0, equals);
+                bool known = false;
+                if (equals != std::string::npos)
+                {
+                    for (auto timed : Timed)
+                        known = known || name == timed;
+                    auto seconds = directive.substr(equals + 1);
+                    if (!known || seconds.empty() || seconds.find_first_not_of("0123456789") != std::string::npos)
+                        throw std::invalid_argument("Invalid cache directive " + directive);
+                    if (name == "max-age")
+                    {
+                        long value;
+                        auto [end, error] = std::from_chars(seconds.data(), seconds.data() + seconds.size(), value);
+                        if (error != std::errc() || end != seconds.data() + seconds.size())
+                            throw std::invalid_argument("Invalid cache directive " + directive);
+                        // Caches take larger delta-seconds as 2^31 (RFC 9111), which keeps Expires from overflowing
+                        maxAge = std::min(value, 2147483648L);
+                    }
+                }
+                else
+                {
+                    for (auto plain : Plain)
+                        known = known || name == plain;
+                    if (!known)
+                        throw std::invalid_argument("Invalid cache directive " + directive);
+                    immutable = immutable || name == "immutable";
+                    noStore = noStore || name == "no-store";
+                }
+
+                header += (first ? "" : ", ") + directive;
+                first = false;
+            }
+
+            if (first)
+                throw std::invalid_argument("No cache directives");
+            if (immutable && maxAge < 0)
+            {
+                LOG(INFO) << "immutable without a max-age has no effect" << std::endl;
+            }
+            // Nothing gets stored, so there's nothing to expire either
+            if (noStore)
+                maxAge = -1;
+            return header + "\r\n";
+        }
+    }
+
+    CachePolicy& CachePolicy::get()
+    {
+        static CachePolicy instance;
+        return instance;
+    }
+
+    void CachePolicy::configure(const std::vector<Rule>& rules)
+    {
+        m_policies.clear();
+        m_prefixes.clear();
+        m_globs.clear();
+        m_extensions.clear();
+        m_types.clear();
+        m_majorTypes.clear();
+
+        for (const auto& rule : rules)
+        {
+            Policy policy;
+            try
+            {
+                policy.header = compileDirectives(rule.directives, policy.maxAge);
+            }
+            catch (const std::invalid_argument& e)
+            {
+                LOG(ERROR) << e.what() << " for " << rule.pattern << ", ignoring the rule" << std::endl;
+                continue;
+            }
+
+            const auto index = m_policies.size();
+            std::string_view pattern = rule.pattern;
+            if (pattern.substr(0, 5) == "type:")
+            {
+                auto type = lowercase(trim(pattern.substr(5)));
+                auto slash = type.find('/');
+                if (type == "*" || type == "*/*")
+                    m_majorTypes.emplace("*", index);
+                else if (slash != std::string::npos && type.substr(slash + 1) == "*")
+                    m_majorTypes.emplace(type.substr(0, slash), index);
+                else
+                    m_types.emplace(type, index);
+            }
+            else if (isGlob(pattern))
+            {
+                // The most common kind by far, "*.css", is a lookup on the extension
+                auto extension = pattern.substr(2);
+                if (pattern.substr(0, 2) == "*." && !isGlob(extension) && extension.find_first_of("./") == std::string_view::npos)
+                    m_extensions.emplace(lowercase(extension), index);
+                else
+                    m_globs.emplace_back(rule.pattern, index);
+            }
+            else if (!pattern.empty() && pattern.front() == '/')
+                m_prefixes.emplace_back(rule.pattern, index);
+            else
+            {
+                LOG(ERROR) << "Invalid cache rule pattern " << rule.pattern << ", ignoring the rule" << std::endl;
+                continue;
+            }
+
+            LOG(DEBUG) << "Cache rule " << rule.pattern << ": " << policy.header.substr(0, policy.header.size() - 2) << std::endl;
+            m_policies.push_back(std::move(policy));
+        }
+    }
+
+    std::size_t CachePolicy::match(std::string_view path, std::string_view contentType) const
+    {
+        auto best = NoRule;
+        if (m_policies.empty())
+            return best;
+        auto consider = [&best](std::size_t index) { best = std::min(best, index); };
+
+        for (const auto& [prefix, index] : m_prefixes)
+        {
+            if (path.substr(0, prefix.size()) == prefix)
+            {
+                consider(index);
+                break;
+            }
+        }
+
+        auto name = path.substr(path.find_last_of('/') + 1);
+        if (!m_extensions.empty())
+        {
+            auto dot = name.find_last_of('.');
+            if (dot != std::string_view::npos)
+                if (auto found = m_extensions.find(lowercase(name.substr(dot + 1))); found != m_extensions.end())
+                    consider(found->second);
+        }
+
+        if (!m_globs.empty() && m_globs.front().second < best)
+        {
+            const std::string fullPath{path}, fileName{name};
+            for (const auto& [glob, index] : m_globs)
+            {
+                if (index >= best)
+                    break;
+                const auto& subject = glob.find('/') != std::string::npos ? fullPath : fileName;
+                if (fnmatch(glob.c_str(), subject.c_str(), 0) == 0)
+                    consider(index);
+            }
+        }
+
+        if (!m_types.empty() || !m_majorTypes.empty())
+        {
+            auto type = lowercase(trim(contentType.substr(0, contentType.find(';'))));
+            if (auto found = m_types.find(type); found != m_types.end())
+                consider(found->second);
+            if (auto found = m_majorTypes.find(type.substr(0, type.find('/'))); found != m_majorTypes.end())
+                consider(found->second);
+            if (auto found = m_majorTypes.find("*"); found != m_majorTypes.end())
+                consider(found->second);
+        }
+
+        return best;
+    }
+
+    void CachePolicy::append(std::string& out, std::string_view path, std::string_view contentType) const
+    {
+        auto index = match(path, contentType);
+        if (index == NoRule)
+            return;
+
+        const auto& policy = m_policies[index];
+        out += policy.header;
+        if (policy.maxAge < 0)
+            return;
+
+        // Only HTTP/1.0 caches look at it, but they're still around. The date changes once a second at most.
+        thread_local std::time_t cachedExpiry = -1;
+        thread_local std::string cachedDate;
+        auto expiry = std::time(nullptr) + policy.maxAge;
+        if (expiry != cachedExpiry)
+        {
+            cachedDate = "Expires: " + httpDate(expiry) + "\r\n";
+            cachedExpiry = expiry;
+        }
+        out += cachedDate;
+    }
+}
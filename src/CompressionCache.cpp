@@ -0,0 +1,286 @@
+#include "CompressionCache.hpp"
+#include "Log.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+#ifdef RYUUK_WITH_ZLIB
+    #include <zlib.h>
+#endif
+#ifdef RYUUK_WITH_BROTLI
+    #include <brotli/encode.h>
+#endif
+#ifdef RYUUK_WITH_ZSTD
+    #include <zstd.h>
+#endif
+
+namespace ryuuk
+{
+    namespace
+    {
+        // Upper bound on cached keys, so placeholders for failed or pending jobs can't pile up
+        const std::size_t MaxSlots = 64 * 1024;
+
+        bool compressInto(ContentEncoding encoding, std::string_view input, int level, std::string& output)
+        {
+            switch (encoding)
+            {
+#ifdef RYUUK_WITH_ZLIB
+                case Gzip:
+                {
+                    z_stream stream{};
+                    // 15 window bits, +16 for a gzip header and trailer instead of zlib's
+                    if (deflateInit2(&stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+                        return false;
+                    output.resize(deflateBound(&stream, input.size()));
+                    stream.next_in   = reinterpret_cast<Bytef*>(const_cast<char*>(input.data()));
+                    stream.avail_in  = input.size();
+                    stream.next_out  = reinterpret_cast<Bytef*>(&output[0]);
+                    stream.avail_out = output.size();
+                    int result = deflate(&stream, Z_FINISH);
+                    output.resize(stream.total_out);
+                    deflateEnd(&stream);
+                    return result == Z_STREAM_END;
+                }
+#endif
+#ifdef RYUUK_WITH_BROTLI
+                case Brotli:
+                {
+                    std::size_t size = BrotliEncoderMaxCompressedSize(input.size());
+                    output.resize(size);
+                    bool ok = BrotliEncoderCompress(level, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+                                                    input.size(), reinterpret_cast<const uint8_t*>(input.data()),
+                                                    &size, reinterpret_cast<uint8_t*>(&output[0]));
+                    output.resize(size);
+                    return ok;
+                }
+#endif
+#ifdef RYUUK_WITH_ZSTD
+                case Zstd:
+                {
+                    output.resize(ZSTD_compressBound(input.size()));
+                    auto size = ZSTD_compress(&output[0], output.size(), input.data(), input.size(), level);
+                    if (ZSTD_isError(size))
+                        return false;
+                    output.resize(size);
+                    return true;
+                }
+#endif
+                default:
+                    return false;
+            }
+        }
+
+        // Runnable threads per core above which we consider the CPU saturated
+        bool cpuSaturated()
+        {
+            double load;
+            static const unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+            return getloadavg(&load, 1) == 1 && load > cores;
+        }
+    }
+
+    CompressionCache& CompressionCache::get()
+    {
+        // Never destroyed, the (detached) compression threads may still be using it during exit
+        static CompressionCache* instance = new CompressionCache;
+        return *instance;
+    }
+
+    void CompressionCache::configure(const Settings& settings)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_settings = settings;
+        if (!m_settings.enabled)
+            return;
+
+        m_settings.threads = std::max(1u, m_settings.threads);
+        for (; m_runningThreads < m_settings.threads; ++m_runningThreads)
+            std::thread(&CompressionCache::run, this).detach();
+    }
+
+    bool CompressionCache::supported(ContentEncoding encoding)
+    {
+        switch (encoding)
+        {
+#ifdef RYUUK_WITH_ZLIB
+            case Gzip:      return true;
+#endif
+#ifdef RYUUK_WITH_BROTLI
+            case Brotli:    return true;
+#endif
+#ifdef RYUUK_WITH_ZSTD
+            case Zstd:      return true;
+#endif
+            default:        return false;
+        }
+    }
+
+    bool CompressionCache::compressible(std::string_view mimeType, std::uintmax_t size) const
+    {
+        if (!m_settings.enabled || size < m_settings.minSize || size > m_settings.maxSize)
+            return false;
+        for (const auto& prefix : m_settings.types)
+            if (mimeType.compare(0, prefix.size(), prefix) == 0)
+                return true;
+        return false;
+    }
+
+    std::string CompressionCache::makeKey(std::string_view path, const FileInfo& info, ContentEncoding encoding)
+    {
+        char validator[64];
+        std::snprintf(validator, sizeof(validator), "|%llx|%llx|%lld|", static_cast<unsigned long long>(info.inode),
+                      static_cast<unsigned long long>(info.size), static_cast<long long>(info.mtime));
+        std::string key{path};
+        key += validator;
+        key += encodingName(encoding);
+        return key;
+    }
+
+    int CompressionCache::levelFor(ContentEncoding encoding, bool saturated) const
+    {
+        // When there's no CPU to spare, settle for the fastest level rather than falling behind
+        if (saturated)
+            return 1;
+        switch (encoding)
+        {
+            case Gzip:      return m_settings.gzipLevel;
+            case Brotli:    return m_settings.brotliLevel;
+            case Zstd:      return m_settings.zstdLevel;
+            default:        return 0;
+        }
+    }
+
+    CompressionCache::Body CompressionCache::find(const std::string& key, bool& schedule)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        schedule = false;
+
+        auto it = m_slots.find(key);
+        if (it == m_slots.end())
+        {
+            m_lru.push_front(key);
+            Slot slot;
+            slot.pending = true;
+            slot.lruPosition = m_lru.begin();
+            m_slots.emplace(key, std::move(slot));
+            evict();
+            schedule = true;
+            return nullptr;
+        }
+
+        auto& slot = it->second;
+        m_lru.splice(m_lru.begin(), m_lru, slot.lruPosition);
+
+        // Compressed while we were busy, redo it properly now that we're idle
+        if (slot.body && slot.lowered && !slot.pending && m_jobs.empty())
+        {
+            slot.pending = true;
+            schedule = true;
+        }
+        return slot.body;
+    }
+
+    void CompressionCache::schedule(const std::string& key, ContentEncoding encoding, Source&& source)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_jobs.push_back({key, encoding, std::move(source)});
+        m_jobReady.notify_one();
+    }
+
+    CompressionCache::Body CompressionCache::compressNow(const std::string& key, ContentEncoding encoding,
+                                                         const Source& source)
+    {
+        Job job{key, encoding, source};
+        auto body = compress(job, levelFor(encoding, false));
+        store(key, body, false);
+        return body;
+    }
+
+    void CompressionCache::run()
+    {
+        while (true)
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_jobReady.wait(lock, [this]{ return !m_jobs.empty(); });
+            Job job = std::move(m_jobs.front());
+            m_jobs.pop_front();
+            bool backlog = m_jobs.size() > 4 * m_settings.threads;
+            lock.unlock();
+
+            bool saturated = backlog || cpuSaturated();
+            store(job.key, compress(job, levelFor(job.encoding, saturated)), saturated);
+        }
+    }
+
+    CompressionCache::Body CompressionCache::compress(const Job& job, int level)
+    {
+        std::string buffer;
+        std::string_view input;
+        if (const auto& file = job.source.file)
+        {
+            // Read through the shared mapping, which also survives the file being truncated meanwhile
+            buffer.resize(file->info.size);
+            auto mapping = file->mapping();
+            if (!buffer.empty() && (!mapping || !mapping->copy(&buffer[0], 0, buffer.size())))
+                return nullptr;
+            input = buffer;
+        }
+        else if (job.source.data)
+            input = *job.source.data;
+
+        auto output = std::make_shared<std::string>();
+        if (!compressInto(job.encoding, input, level, *output))
+        {
+            LOG(ERROR) << "Couldn't compress " << job.key << std::endl;
+            return nullptr;
+        }
+
+        LOG(DEBUG) << "Compressed " << job.key << " at level " << level << ": "
+                   << input.size() << " -> " << output->size() << " bytes" << std::endl;
+        return output;
+    }
+
+    void CompressionCache::store(const std::string& key, Body body, bool lowered)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_slots.find(key);
+        if (it == m_slots.end())
+        {
+            m_lru.push_front(key);
+            Slot slot;
+            slot.lruPosition = m_lru.begin();
+            it = m_slots.emplace(key, std::move(slot)).first;
+        }
+
+        auto& slot = it->second;
+        slot.pending = false;
+        if (!body)
+        {
+            // Keep serving what we had, if anything, but don't try this one again
+            slot.failed = true;
+            return;
+        }
+
+        if (slot.body)
+            m_cachedBytes -= slot.body->size();
+        m_cachedBytes += body->size();
+        slot.body = std::move(body);
+        slot.lowered = lowered;
+        evict();
+    }
+
+    void CompressionCache::evict()
+    {
+        while (!m_lru.empty() && (m_cachedBytes > m_settings.cacheSize || m_slots.size() > MaxSlots))
+        {
+            auto it = m_slots.find(m_lru.back());
+            if (it->second.body)
+                m_cachedBytes -= it->second.body->size();
+            m_slots.erase(it);
+            m_lru.pop_back();
+        }
+    }
+}
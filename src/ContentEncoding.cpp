@@ -0,0 +1,143 @@
+#include "ContentEncoding.hpp"
+
+#include <strings.h>
+
+namespace ryuuk
+{
+    namespace
+    {
+        std::string_view trim(std::string_view str)
+        {
+            while (!str.empty() && (str.front() == ' ' || str.front() == '\t'))
+                str.remove_prefix(1);
+            while (!str.empty() && (str.back() == ' ' || str.back() == '\t'))
+                str.remove_suffix(1);
+            return str;
+        }
+
+        bool equalsNoCase(std::string_view a, std::string_view b)
+        {
+            return a.size() == b.size() && strncasecmp(a.data(), b.data(), a.size()) == 0;
+        }
+
+        // qvalue = ( "0" [ "." 0*3DIGIT ] ) / ( "1" [ "." 0*3("0") ] ), anything else counts as 1
+        float parseQuality(std::string_view text)
+        {
+            if (text.empty() || (text[0] != '0' && text[0] != '1'))
+                return 1;
+
+            float quality = text[0] - '0';
+            if (text.size() > 1)
+            {
+                if (text[1] != '.')
+                    return 1;
+                float scale = 0.1f;
+                for (std::size_t i = 2; i < text.size() && i < 5; ++i, scale /= 10)
+                {
+                    if (text[i] < '0' || text[i] > '9')
+                        return 1;
+                    quality += (text[i] - '0') * scale;
+                }
+            }
+            return quality > 1 ? 1 : quality;
+        }
+    }
+
+    std::string_view encodingName(ContentEncoding encoding)
+    {
+        switch (encoding)
+        {
+            case Brotli:    return "br";
+            case Zstd:      return "zstd";
+            case Gzip:      return "gzip";
+            default:        return "identity";
+        }
+    }
+
+    std::string_view encodingSuffix(ContentEncoding encoding)
+    {
+        switch (encoding)
+        {
+            case Brotli:    return ".br";
+            case Zstd:      return ".zst";
+            case Gzip:      return ".gz";
+            default:        return {};
+        }
+    }
+
+    std::vector<QualityValue> parseQualityValues(std::string_view header)
+    {
+        std::vector<QualityValue> values;
+        while (!header.empty())
+        {
+            auto comma = header.find(',');
+            auto element = header.substr(0, comma);
+            header = comma == std::string_view::npos ? std::string_view{} : header.substr(comma + 1);
+
+            QualityValue value{trim(element.substr(0, element.find(';'))), 1};
+            if (value.value.empty())
+                continue;   // Empty list elements are allowed
+
+            // Look through the parameters for the weight
+            for (auto semicolon = element.find(';'); semicolon != std::string_view::npos; )
+            {
+                auto next = element.find(';', semicolon + 1);
+                auto parameter = trim(element.substr(semicolon + 1, next - semicolon - 1));
+                if (parameter.size() >= 2 && (parameter[0] == 'q' || parameter[0] == 'Q') && parameter[1] == '=')
+                    value.quality = parseQuality(trim(parameter.substr(2)));
+                semicolon = next;
+            }
+            values.push_back(value);
+        }
+        return values;
+    }
+
+    AcceptEncoding::AcceptEncoding(std::string_view header)
+    {
+        // An empty header means only identity is wanted. Codings not listed are only acceptable through "*".
+        m_quality = {0, 0, 0, 1};
+        std::array<bool, EncodingCount> listed{};
+        float wildcard = -1;
+
+        for (const auto& [value, quality] : parseQualityValues(header))
+        {
+            ContentEncoding encoding = EncodingCount;
+            if (equalsNoCase(value, "br"))
+                encoding = Brotli;
+            else if (equalsNoCase(value, "zstd"))
+                encoding = Zstd;
+            else if (equalsNoCase(value, "gzip") || equalsNoCase(value, "x-gzip"))
+                encoding = Gzip;
+            else if (equalsNoCase(value, "identity"))
+                encoding = Identity;
+            else if (value == "*")
+                wildcard = quality;
+
+            if (encoding != EncodingCount)
+            {
+                m_quality[encoding] = quality;
+                listed[encoding] = true;
+            }
+        }
+
+        if (wildcard >= 0)
+        {
+            for (int i = 0; i < EncodingCount; ++i)
+                if (!listed[i])
+                    m_quality[i] = wildcard;
+        }
+    }
+
+    ContentEncoding AcceptEncoding::choose(const std::array<bool, EncodingCount>& available) const
+    {
+        ContentEncoding best = EncodingCount;
+        for (int i = 0; i < EncodingCount; ++i)
+        {
+            // Ties go to the earlier (preferred) coding
+            if (available[i] && acceptable(ContentEncoding(i)) &&
+                (best == EncodingCount || m_quality[i] > m_quality[best]))
+                best = ContentEncoding(i);
+        }
+        return best;
+    }
+}
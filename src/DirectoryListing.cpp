@@ -0,0 +1,458 @@
+#include "DirectoryListing.hpp"
+#include "Log.hpp"
+#include "Template.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace ryuuk
+{
+    namespace
+    {
+        // Bytes handed to each getdents64(), enough for several hundred entries
+        const std::size_t ReaderBufferSize = 32 * 1024;
+
+        // Generate about this much of a listing per chunk
+        const std::size_t FlushSize = 32 * 1024;
+
+        // Names sorted in memory before they're spilled to a temporary file as a sorted run
+        const std::size_t RunBytes = 8 * 1024 * 1024;
+
+        // Room for the chunk-size line, filled in once the size is known. Leading zeros are allowed.
+        const std::size_t ChunkSizeLength = sizeof("00000000\r\n") - 1;
+
+        bool parseNumber(std::string_view text, std::uintmax_t& number)
+        {
+            if (text.empty() || !std::all_of(text.begin(), text.end(), [](char c){ return c >= '0' && c <= '9'; }))
+                return false;
+            number = std::strtoull(std::string{text}.c_str(), nullptr, 10);
+            return true;
+        }
+
+        void appendJsonString(std::string& out, std::string_view str)
+        {
+            out += '"';
+            for (unsigned char c : str)
+            {
+                if (c == '"' || c == '\\')
+                {
+                    out += '\\';
+                    out += c;
+                }
+                else if (c < 0x20)
+                {
+                    char escaped[8];
+                    std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                    out += escaped;
+                }
+                else
+                    out += c;
+            }
+            out += '"';
+        }
+    }
+
+    DirectoryReader::DirectoryReader(int directory)
+        // Reopened, as readers sharing a descriptor would share its position. No path is walked.
+        : m_fd(openat(directory, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC))
+        , m_buffer(new char[ReaderBufferSize])
+    {
+        if (m_fd < 0)
+        {
+            LOG(ERROR) << "Couldn't reopen directory descriptor " << directory << ", errno: " << errno << std::endl;
+        }
+    }
+
+    DirectoryReader::~DirectoryReader()
+    {
+        if (m_fd >= 0)
+            close(m_fd);
+    }
+
+    const std::vector<DirectoryReader::Entry>& DirectoryReader::nextBatch()
+    {
+        m_batch.clear();
+        if (m_fd < 0)
+            return m_batch;
+
+        ssize_t bytes;
+        while ((bytes = getdents64(m_fd, m_buffer.get(), ReaderBufferSize)) < 0 && errno == EINTR);
+        if (bytes < 0)
+            throw std::runtime_error("getdents64() failed with errno " + std::to_string(errno));
+
+        for (ssize_t offset = 0; offset < bytes; )
+        {
+            auto entry = reinterpret_cast<const dirent64*>(m_buffer.get() + offset);
+            offset += entry->d_reclen;
+
+            bool directory = entry->d_type == DT_DIR;
+            // Some file systems don't fill in d_type, and links are listed like what they point to
+            if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK)
+            {
+                struct stat statbuf;
+                directory = fstatat(m_fd, entry->d_name, &statbuf, 0) == 0 && S_ISDIR(statbuf.st_mode);
+            }
+            m_batch.push_back({entry->d_name, directory});
+        }
+        return m_batch;
+    }
+
+    ListingOptions ListingOptions::parse(std::string_view query)
+    {
+        ListingOptions options;
+        while (!query.empty())
+        {
+            auto ampersand = query.find('&');
+            auto parameter = query.substr(0, ampersand);
+            query = ampersand == std::string_view::npos ? std::string_view{} : query.substr(ampersand + 1);
+
+            auto equals = parameter.find('=');
+            auto name = parameter.substr(0, equals);
+            auto value = equals == std::string_view::npos ? std::string_view{} : parameter.substr(equals + 1);
+
+            // Anything we don't understand is ignored
+            if (name == "format")
+            {
+                if (value == "json")
+                    options.format = Json;
+                else if (value == "plain")
+                    options.format = Plain;
+                else
+                    options.format = Html;
+            }
+            else if (name == "sort")
+                options.sorted = value != "none";
+            else if (!(name == "offset" && parseNumber(value, options.offset)) &&
+                     !(name == "limit" && parseNumber(value, options.limit)))
+                continue;
+            options.custom = true;
+        }
+        return options;
+    }
+
+    std::string_view ListingOptions::contentType() const
+    {
+        switch (format)
+        {
+            case Json:  return "application/json";
+            case Plain: return "text/plain; charset=utf-8";
+            default:    return "text/html; charset=utf-8";
+        }
+    }
+
+    void appendListingHead(std::string& html, std::string_view location)
+    {
+        PageTemplates::get().listingHead.render(html, {location});
+    }
+
+    void appendListingEntry(std::string& html, std::string_view name, bool directory)
+    {
+        if (!directory)
+            return PageTemplates::get().listingEntry.render(html, {name});
+
+        static thread_local std::string withSlash;
+        withSlash.assign(name.data(), name.size());
+        withSlash += '/';
+        PageTemplates::get().listingEntry.render(html, {withSlash});
+    }
+
+    void appendListingTail(std::string& html, std::string_view location)
+    {
+        PageTemplates::get().listingTail.render(html, {location});
+    }
+
+    class ListingGenerator::Sorter
+    {
+    public:
+        ~Sorter()
+        {
+            for (auto& run : m_runs)
+                std::fclose(run.file);
+            std::free(m_line);
+        }
+
+        // Read all of `reader`, only the first `keep` names in order are of interest
+        void load(DirectoryReader& reader, std::uintmax_t keep)
+        {
+            std::vector<std::string> names;
+            std::size_t bytes = 0;
+            for (auto batch = &reader.nextBatch(); !batch->empty(); batch = &reader.nextBatch())
+            {
+                for (const auto& entry : *batch)
+                {
+                    // Compared with the slash, like the cached listing
+                    names.emplace_back(entry.name);
+                    if (entry.directory)
+                        names.back() += '/';
+                    bytes += names.back().size() + sizeof(std::string);
+                    if (bytes > RunBytes)
+                    {
+                        spill(names, keep);
+                        bytes = 0;
+                    }
+                }
+            }
+
+            if (m_runs.empty())
+            {
+                sortRun(names, keep);
+                m_names = std::move(names);
+                return;
+            }
+
+            if (!names.empty())
+                spill(names, keep);
+            LOG(DEBUG) << "Merging " << m_runs.size() << " sorted runs of a listing" << std::endl;
+            for (std::size_t i = 0; i < m_runs.size(); ++i)
+                if (readHead(i))
+                    pushHeap(i);
+        }
+
+        bool next(std::string_view& name, bool& directory)
+        {
+            if (m_runs.empty())
+            {
+                if (m_position == m_names.size())
+                    return false;
+                m_current = std::move(m_names[m_position++]);
+            }
+            else
+            {
+                if (m_heap.empty())
+                    return false;
+                std::pop_heap(m_heap.begin(), m_heap.end(), GreaterHead{m_runs});
+                auto run = m_heap.back();
+                m_heap.pop_back();
+                m_current = std::move(m_runs[run].head);
+                if (readHead(run))
+                    pushHeap(run);
+            }
+
+            name = m_current;
+            directory = !name.empty() && name.back() == '/';
+            if (directory)
+                name.remove_suffix(1);
+            return true;
+        }
+
+    private:
+        struct Run
+        {
+            std::FILE* file;
+            std::string head;       // Smallest name not yet merged
+        };
+
+        static void sortRun(std::vector<std::string>& names, std::uintmax_t keep)
+        {
+            // Names past `keep` in any run can't make it into the first `keep` overall
+            if (keep < names.size())
+            {
+                std::partial_sort(names.begin(), names.begin() + keep, names.end());
+                names.resize(keep);
+            }
+            else
+                std::sort(names.begin(), names.end());
+        }
+
+        void spill(std::vector<std::string>& names, std::uintmax_t keep)
+        {
+            sortRun(names, keep);
+
+            // Names can't contain NUL, which makes it a convenient separator
+            std::FILE* file = std::tmpfile();
+            if (!file)
+                throw std::runtime_error("Couldn't create a temporary file to sort a listing");
+            m_runs.push_back({file, {}});
+            for (const auto& name : names)
+                std::fwrite(name.c_str(), 1, name.size() + 1, file);
+            if (std::fflush(file) != 0)
+                throw std::runtime_error("Couldn't write a sorted run of a listing");
+            std::rewind(file);
+
+            names.clear();
+        }
+
+        bool readHead(std::size_t run)
+        {
+            auto length = getdelim(&m_line, &m_lineCapacity, '\0', m_runs[run].file);
+            if (length <= 0)
+                return false;
+            m_runs[run].head.assign(m_line, length - 1);
+            return true;
+        }
+
+        // Makes the heap of run indices a min-heap on their heads
+        struct GreaterHead
+        {
+            const std::vector<Run>& runs;
+            bool operator()(std::size_t a, std::size_t b) const { return runs[a].head > runs[b].head; }
+        };
+
+        void pushHeap(std::size_t run)
+        {
+            m_heap.push_back(run);
+            std::push_heap(m_heap.begin(), m_heap.end(), GreaterHead{m_runs});
+        }
+
+        std::vector<std::string> m_names;   // The only run, if it fit in memory
+        std::size_t m_position = 0;
+        std::vector<Run> m_runs;
+        std::vector<std::size_t> m_heap;
+        std::string m_current;
+        char* m_line = nullptr;
+        std::size_t m_lineCapacity = 0;
+    };
+
+    ListingGenerator::ListingGenerator(std::unique_ptr<DirectoryReader> reader, const std::string& location,
+                                       const ListingOptions& options, bool chunked)
+        : m_reader(std::move(reader))
+        , m_location(location)
+        , m_options(options)
+        , m_chunked(chunked)
+    {}
+
+    ListingGenerator::~ListingGenerator() = default;
+
+    bool ListingGenerator::nextEntry(std::string_view& name, bool& directory)
+    {
+        if (m_sorter)
+            return m_sorter->next(name, directory);
+
+        while (!m_batch || m_batchPosition == m_batch->size())
+        {
+            m_batch = &m_reader->nextBatch();
+            m_batchPosition = 0;
+            if (m_batch->empty())
+                return false;
+        }
+        const auto& entry = (*m_batch)[m_batchPosition++];
+        name = entry.name;
+        directory = entry.directory;
+        return true;
+    }
+
+    void ListingGenerator::appendEntry(std::string_view name, bool directory)
+    {
+        switch (m_options.format)
+        {
+            case ListingOptions::Html:
+                appendListingEntry(m_out, name, directory);
+                break;
+            case ListingOptions::Json:
+                if (m_sent != 0)
+                    m_out += ',';
+                appendJsonString(m_out, std::string{name} + (directory ? "/" : ""));
+                break;
+            case ListingOptions::Plain:
+                m_out += name;
+                if (directory)
+                    m_out += '/';
+                m_out += '\n';
+                break;
+        }
+    }
+
+    void ListingGenerator::beginBody()
+    {
+        m_out.clear();
+        if (m_chunked)
+            m_out.resize(ChunkSizeLength);
+    }
+
+    void ListingGenerator::endBody()
+    {
+        if (!m_chunked)
+            return;
+        // An empty chunk would mark the end of the body
+        if (m_out.size() == ChunkSizeLength)
+        {
+            m_out.clear();
+            return;
+        }
+        char sizeLine[ChunkSizeLength + 1];
+        std::snprintf(sizeLine, sizeof(sizeLine), "%08zx\r\n", m_out.size() - ChunkSizeLength);
+        m_out.replace(0, ChunkSizeLength, sizeLine, ChunkSizeLength);
+        m_out += "\r\n";
+    }
+
+    bool ListingGenerator::truncated()
+    {
+        std::string_view name;
+        bool directory;
+        return m_sent == m_options.limit && nextEntry(name, directory);
+    }
+
+    Chunk ListingGenerator::nextChunk()
+    {
+        if (m_done)
+            return {};
+
+        bool first = !m_batch && !m_sorter;
+        beginBody();
+        if (first)
+        {
+            if (m_options.sorted)
+            {
+                auto keep = m_options.offset + std::min(m_options.limit, UINTMAX_MAX - m_options.offset);
+                m_sorter = std::make_unique<Sorter>();
+                m_sorter->load(*m_reader, keep);
+            }
+            if (m_options.format == ListingOptions::Html)
+                appendListingHead(m_out, m_location);
+            else if (m_options.format == ListingOptions::Json)
+                m_out += '[';
+        }
+
+        bool finished = false;
+        while (m_out.size() < FlushSize)
+        {
+            std::string_view name;
+            bool directory;
+            if (m_sent == m_options.limit || !nextEntry(name, directory))
+            {
+                finished = true;
+                break;
+            }
+            // Only the HTML listing links the directory itself and its parent
+            if (m_options.format != ListingOptions::Html && (name == "." || name == ".."))
+                continue;
+            if (m_skipped < m_options.offset)
+            {
+                ++m_skipped;
+                continue;
+            }
+            appendEntry(name, directory);
+            ++m_sent;
+        }
+
+        if (finished)
+        {
+            m_done = true;
+            if (m_options.format == ListingOptions::Html)
+            {
+                // Link the next page in place of the entries left out
+                if (truncated())
+                {
+                    m_out += "<li><a href=\"?offset=" + std::to_string(m_options.offset + m_sent) +
+                             "&amp;limit=" + std::to_string(m_options.limit) +
+                             (m_options.sorted ? "&amp;sort=name" : "") + "\">&hellip;</a></li>\n";
+                }
+                appendListingTail(m_out, m_location);
+            }
+            else if (m_options.format == ListingOptions::Json)
+                m_out += "]\n";
+        }
+        endBody();
+        if (finished && m_chunked)
+            m_out += "0\r\n\r\n";
+
+        return {m_out};
+    }
+}
@@ -0,0 +1,171 @@
+#include "DocumentRoot.hpp"
+#include "Log.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <vector>
+#include <fcntl.h>
+#include <linux/openat2.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace ryuuk
+{
+    namespace
+    {
+        // Same limit as the kernel's on symbolic links followed in one lookup
+        constexpr int MaxLinks = 40;
+
+        int callOpenat2(int directory, const char* path, int flags, std::uint64_t resolve)
+        {
+            open_how how{};
+            how.flags = flags;
+            how.resolve = resolve;
+            return static_cast<int>(syscall(SYS_openat2, directory, path, &how, sizeof(how)));
+        }
+    }
+
+    DocumentRoot& DocumentRoot::get()
+    {
+        static DocumentRoot instance;
+        return instance;
+    }
+
+    DocumentRoot::DocumentRoot()
+        : m_fd(::open(".", O_PATH | O_DIRECTORY | O_CLOEXEC))
+    {}
+
+    DocumentRoot::~DocumentRoot()
+    {
+        if (m_fd >= 0)
+            ::close(m_fd);
+    }
+
+    bool DocumentRoot::open(const std::string& path)
+    {
+        int fd = ::open(path.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            LOG(ERROR) << "Couldn't open document root " << path << ", errno: " << errno << std::endl;
+            return false;
+        }
+        if (m_fd >= 0)
+            ::close(m_fd);
+        m_fd = fd;
+        return true;
+    }
+
+    const char* DocumentRoot::relative(const std::string& location)
+    {
+        // Skip "./" and slashes, but not names starting with a dot
+        std::size_t start = 0;
+        while (start < location.size())
+        {
+            if (location[start] == '/')
+                ++start;
+            else if (location[start] == '.' && (start + 1 == location.size() || location[start + 1] == '/'))
+                ++start;
+            else
+                break;
+        }
+        return start == location.size() ? "." : location.c_str() + start;
+    }
+
+    int DocumentRoot::openBeneath(const std::string& location, int flags) const
+    {
+        const char* path = relative(location);
+        flags |= O_CLOEXEC;
+        if (m_useOpenat2.load(std::memory_order_relaxed))
+        {
+            int fd = callOpenat2(m_fd, path, flags, RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS);
+            if (fd >= 0 || errno != ENOSYS)
+                return fd;
+            LOG(INFO) << "openat2() isn't available, request paths are walked one component at a time" << std::endl;
+            m_useOpenat2.store(false, std::memory_order_relaxed);
+        }
+        return walk(path, flags);
+    }
+
+    int DocumentRoot::walk(std::string_view path, int flags) const
+    {
+        // Descriptors of the directories walked into, the root excluded, so ".." can never leave it
+        std::vector<int> directories;
+        auto current = [&] { return directories.empty() ? m_fd : directories.back(); };
+        auto finish = [&](int result)
+        {
+            int error = errno;
+            for (int directory : directories)
+                ::close(directory);
+            errno = error;
+            return result;
+        };
+
+        std::string remaining{path}, name;
+        std::size_t position = 0;
+        int links = 0;
+        while (true)
+        {
+            position = std::min(remaining.find_first_not_of('/', position), remaining.size());
+            if (position == remaining.size())
+                return finish(::openat(current(), ".", flags));
+
+            auto end = std::min(remaining.find('/', position), remaining.size());
+            name.assign(remaining, position, end - position);
+            position = end;
+            const bool last = remaining.find_first_not_of('/', position) == std::string::npos;
+
+            if (name == ".")
+                continue;
+            if (name == "..")
+            {
+                if (directories.empty())
+                {
+                    errno = EXDEV;
+                    return finish(-1);
+                }
+                ::close(directories.back());
+                directories.pop_back();
+                continue;
+            }
+
+            // Links are never followed by the kernel, we do it below
+            int fd = last ? ::openat(current(), name.c_str(), flags | O_NOFOLLOW)
+                          : ::openat(current(), name.c_str(), O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (fd >= 0)
+            {
+                if (last)
+                    return finish(fd);
+                directories.push_back(fd);
+                continue;
+            }
+            if (errno != ELOOP && errno != ENOTDIR)
+                return finish(-1);
+
+            // Either a symbolic link, whose target takes its place in the path, or really not a directory
+            int error = errno;
+            char target[PATH_MAX];
+            auto length = ::readlinkat(current(), name.c_str(), target, sizeof(target));
+            if (length < 0)
+            {
+                errno = error;
+                return finish(-1);
+            }
+            if (++links > MaxLinks)
+            {
+                errno = ELOOP;
+                return finish(-1);
+            }
+            if (length > 0 && target[0] == '/')
+            {
+                errno = EXDEV;
+                return finish(-1);
+            }
+            auto rest = remaining.substr(position);
+            remaining.assign(target, length);
+            remaining += rest;
+            position = 0;
+        }
+    }
+}
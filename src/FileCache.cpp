@@ -0,0 +1,366 @@
+#include "FileCache.hpp"
+#include "Log.hpp"
+#include "DocumentRoot.hpp"
+#include "NamespaceIndex.hpp"
+
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <deque>
+#include <thread>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace ryuuk
+{
+    namespace
+    {
+        constexpr unsigned StatxMask = STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_INO | STATX_MTIME;
+
+        FileType typeFromMode(unsigned mode)
+        {
+            if (S_ISDIR(mode))
+                return Directory;
+            if (S_ISREG(mode))
+                return Regular;
+            return Other;
+        }
+
+        FileType typeFromErrno(int error)
+        {
+            // Same policy as getResourceType: whatever else the error is, assume it doesn't exist.
+            // Paths leading out of the document root are refused like unreadable files.
+            return error == EACCES || error == EXDEV ? PermissionDenied : NonExistent;
+        }
+
+        FileInfo toFileInfo(const struct statx& stx)
+        {
+            FileInfo info;
+            info.type   = typeFromMode(stx.stx_mode);
+            info.size   = stx.stx_size;
+            info.inode  = stx.stx_ino;
+            info.device = (static_cast<std::uint64_t>(stx.stx_dev_major) << 32) | stx.stx_dev_minor;
+            info.mtime  = stx.stx_mtime.tv_sec * 1000000000LL + stx.stx_mtime.tv_nsec;
+            return info;
+        }
+
+        // statx() `path` relative to `fd` (or `fd` itself if path is empty)
+        FileInfo statxInfo(int fd, const char* path)
+        {
+            struct statx stx;
+            int flags = *path == '\0' ? AT_EMPTY_PATH : AT_STATX_SYNC_AS_STAT;
+            if (statx(fd, path, flags, StatxMask, &stx) != 0)
+            {
+                FileInfo info;
+                info.type = typeFromErrno(errno);
+                return info;
+            }
+            return toFileInfo(stx);
+        }
+
+        // Open `path` beneath the document root and fill `info` from the descriptor, so both are guaranteed
+        // to describe the same file. Only regular files and directories keep their descriptor open.
+        int openWithInfo(const std::string& path, FileInfo& info)
+        {
+            // O_NONBLOCK keeps us from hanging on FIFOs, it has no effect on regular files
+            int fd = DocumentRoot::get().openBeneath(path, O_RDONLY | O_NONBLOCK);
+            if (fd < 0)
+            {
+                int error = errno;      // Before logging can change it
+                if (error == EXDEV)
+                {
+                    LOG(INFO) << "Refusing " << path << ", it leads out of the document root" << std::endl;
+                }
+                info = {};
+                info.type = typeFromErrno(error);
+                return -1;
+            }
+
+            info = statxInfo(fd, "");
+            if (info.type != Regular && info.type != Directory)
+            {
+                ::close(fd);
+                return -1;
+            }
+            return fd;
+        }
+
+        // Whether what the NamespaceIndex has is what we have
+        bool describes(const NamespaceIndex::Node& node, const FileInfo& info)
+        {
+            return node.type == info.type && node.size == info.size && node.inode == info.inode && node.mtime == info.mtime;
+        }
+
+        std::string hexTag(const char* prefix, std::uint64_t a, std::uint64_t b, std::uint64_t c, int parts)
+        {
+            char buffer[72];
+            if (parts == 1)
+                std::snprintf(buffer, sizeof(buffer), "\"%s%llx\"", prefix, static_cast<unsigned long long>(a));
+            else
+                std::snprintf(buffer, sizeof(buffer), "\"%s%llx-%llx-%llx\"", prefix, static_cast<unsigned long long>(a),
+                              static_cast<unsigned long long>(b), static_cast<unsigned long long>(c));
+            return buffer;
+        }
+
+        // 64-bit non-cryptographic hash, fed 8 bytes at a time. Good enough to tell versions of a file apart.
+        class ContentHash
+        {
+        public:
+            explicit ContentHash(std::uint64_t seed) : m_state(seed ^ 0x9E3779B97F4A7C15ULL) {}
+
+            // Every but the last call must pass a multiple of 8 bytes
+            void update(const char* data, std::size_t size)
+            {
+                std::size_t i = 0;
+                for (; i + 8 <= size; i += 8)
+                {
+                    std::uint64_t word;
+                    std::memcpy(&word, data + i, 8);
+                    mix(word);
+                }
+                if (i < size)
+                {
+                    std::uint64_t word = 0;
+                    std::memcpy(&word, data + i, size - i);
+                    mix(word);
+                }
+            }
+
+            std::uint64_t finish() const
+            {
+                std::uint64_t h = m_state;
+                h ^= h >> 33; h *= 0xff51afd7ed558ccdULL;
+                h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ULL;
+                h ^= h >> 33;
+                return h;
+            }
+
+        private:
+            void mix(std::uint64_t word)
+            {
+                m_state ^= word * 0x9E3779B97F4A7C15ULL;
+                m_state = ((m_state << 31) | (m_state >> 33)) * 0x94D049BB133111EBULL;
+            }
+
+            std::uint64_t m_state;
+        };
+
+        /*
+        * Background thread hashing the content of newly loaded files. Its state is never freed,
+        * so the (detached) thread can't outlive it during static destruction.
+        */
+        class ContentHasher
+        {
+        public:
+            static void enqueue(std::weak_ptr<const FileCache::Entry> entry,
+                                std::function<void(const FileCache::Entry&, std::uint64_t)> publish)
+            {
+                static ContentHasher* instance = new ContentHasher;
+                std::lock_guard<std::mutex> lock(instance->m_mutex);
+                instance->m_queue.emplace_back(std::move(entry), std::move(publish));
+                instance->m_ready.notify_one();
+            }
+
+        private:
+            ContentHasher()
+            {
+                std::thread(&ContentHasher::run, this).detach();
+            }
+
+            void run()
+            {
+                const std::size_t BufferSize = 64 * 1024;
+                auto buffer = std::make_unique<char[]>(BufferSize);
+                while (true)
+                {
+                    std::unique_lock<std::mutex> lock(m_mutex);
+                    m_ready.wait(lock, [this]{ return !m_queue.empty(); });
+                    auto [weak, publish] = std::move(m_queue.front());
+                    m_queue.pop_front();
+                    lock.unlock();
+
+                    auto entry = weak.lock();
+                    if (!entry)
+                        continue;   // Evicted or replaced before we got to it
+
+                    ContentHash hash(entry->info.size);
+                    std::uint64_t offset = 0;
+                    while (offset < entry->info.size)
+                    {
+                        auto got = ::pread(entry->fd, buffer.get(), BufferSize, offset);
+                        if (got < 0 && errno == EINTR)
+                            continue;
+                        if (got <= 0)
+                            break;
+                        hash.update(buffer.get(), got);
+                        offset += got;
+                    }
+
+                    // A file modified while we read it gets a new entry anyway, don't publish garbage for this one
+                    if (offset == entry->info.size && statxInfo(entry->fd, "").sameFile(entry->info))
+                        publish(*entry, hash.finish());
+                }
+            }
+
+            std::mutex m_mutex;
+            std::condition_variable m_ready;
+            std::deque<std::pair<std::weak_ptr<const FileCache::Entry>,
+                                 std::function<void(const FileCache::Entry&, std::uint64_t)>>> m_queue;
+        };
+    }
+
+    FileCache::Entry::~Entry()
+    {
+        if (fd >= 0)
+            ::close(fd);
+    }
+
+    std::shared_ptr<const FileMapping> FileCache::Entry::mapping() const
+    {
+        std::call_once(m_mapOnce, [this]{ m_mapping = FileMapping::create(fd, info.size); });
+        return m_mapping;
+    }
+
+    std::string FileCache::Entry::etag() const
+    {
+        if (m_hashed.load(std::memory_order_acquire))
+            return hexTag("c", m_contentHash, 0, 0, 1);
+        return m_metadataTag;
+    }
+
+    bool FileCache::Entry::matchesETag(std::string_view tag) const
+    {
+        if (tag == m_metadataTag)
+            return true;
+        return m_hashed.load(std::memory_order_acquire) && tag == hexTag("c", m_contentHash, 0, 0, 1);
+    }
+
+    FileCache& FileCache::get()
+    {
+        static FileCache instance;
+        return instance;
+    }
+
+    void FileCache::configure(std::size_t capacity, std::chrono::milliseconds ttl)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_capacity = capacity;
+        m_ttl = ttl;
+        m_slots.clear();
+        m_lru.clear();
+    }
+
+    FileCache::Handle FileCache::load(const std::string& location, const NamespaceIndex::Node* known)
+    {
+        auto entry = std::make_shared<Entry>();
+        entry->path = location;
+        entry->fd = openWithInfo(location, entry->info);
+
+        // The URL "./about" is resolved to "./about/index.html" if the index exists
+        // Otherwise, a directory listing is sent instead.
+        // Unless the NamespaceIndex already knows there's none
+        if (entry->info.type == Directory && (!known || known->type != Directory || known->hasIndex))
+        {
+            std::string index = location + (location.back() == '/' ? "index.html" : "/index.html");
+            FileInfo indexInfo;
+            int indexFd = openWithInfo(index, indexInfo);
+            if (indexInfo.type == Regular)
+            {
+                LOG(DEBUG) << "Append index.html to path" << std::endl;
+                ::close(entry->fd);
+                entry->path = std::move(index);
+                entry->info = indexInfo;
+                entry->fd = indexFd;
+            }
+            else if (indexInfo.type == PermissionDenied)
+            {
+                LOG(INFO) << "Index of " << location << " is not readable" << std::endl;
+                entry->info.type = PermissionDenied;
+                ::close(entry->fd);
+                entry->fd = -1;
+            }
+            // Otherwise, there's no (usable) index and it's a normal directory
+            else if (indexFd >= 0)
+                ::close(indexFd);
+        }
+
+        const auto& info = entry->info;
+        entry->m_metadataTag = hexTag("", info.inode, info.mtime, info.size, 3);
+        if (m_contentTags && info.type == Regular)
+        {
+            ContentHasher::enqueue(entry, [](const Entry& hashed, std::uint64_t hash)
+            {
+                hashed.m_contentHash = hash;
+                hashed.m_hashed.store(true, std::memory_order_release);
+            });
+        }
+
+        return entry;
+    }
+
+    bool FileCache::stillValid(const Entry& entry) const
+    {
+        NamespaceIndex::Node node;
+        if (NamespaceIndex::get().lookup(entry.path, node))
+            return describes(node, entry.info);
+
+        // A path walk from the root, which can't lead anywhere new without changing what's found there
+        return statxInfo(DocumentRoot::get().fd(), DocumentRoot::relative(entry.path)).sameFile(entry.info);
+    }
+
+    FileCache::Handle FileCache::resolve(const std::string& location)
+    {
+        // Paths known not to exist don't take a system call, nor a place in the cache
+        static const Handle missing = std::make_shared<const Entry>();
+        NamespaceIndex::Node node;
+        const bool indexed = NamespaceIndex::get().lookup(location, node);
+        if (indexed && node.type == NonExistent)
+            return missing;
+        const auto known = indexed ? &node : nullptr;
+
+        auto now = std::chrono::steady_clock::now();
+        Handle stale;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_capacity == 0)
+                return load(location, known);
+
+            if (auto it = m_slots.find(location); it != m_slots.end())
+            {
+                auto& slot = it->second;
+                m_lru.splice(m_lru.begin(), m_lru, slot.lruPosition);
+                // What the index knows is always current, there's no need to trust an entry for a while
+                if (!indexed && now - slot.validated < m_ttl)
+                    return slot.entry;
+                stale = slot.entry;
+            }
+        }
+
+        // File system calls are made without holding the lock
+        Handle fresh;
+        if (stale && (indexed && stale->path == location ? describes(node, stale->info) : stillValid(*stale)))
+            fresh = std::move(stale);
+        else
+            fresh = load(location, known);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (auto it = m_slots.find(location); it != m_slots.end())
+        {
+            it->second.entry = fresh;
+            it->second.validated = now;
+        }
+        else if (m_capacity > 0)
+        {
+            m_lru.push_front(location);
+            m_slots.emplace(location, Slot{fresh, now, m_lru.begin()});
+            while (m_slots.size() > m_capacity)
+            {
+                m_slots.erase(m_lru.back());
+                m_lru.pop_back();
+            }
+        }
+        return fresh;
+    }
+}
@@ -0,0 +1,84 @@
+#include "FileMapping.hpp"
+#include "Log.hpp"
+
+#include <atomic>
+#include <csetjmp>
+#include <csignal>
+#include <cstring>
+#include <sys/mman.h>
+
+namespace ryuuk
+{
+    namespace
+    {
+        // Set while the thread is inside FileMapping::copy
+        thread_local sigjmp_buf* faultGuard = nullptr;
+
+        void onBusError(int sig)
+        {
+            if (faultGuard)
+                siglongjmp(*faultGuard, 1);
+
+            // Not ours, die the way we would have without a handler
+            std::signal(sig, SIG_DFL);
+            std::raise(sig);
+        }
+    }
+
+    std::shared_ptr<const FileMapping> FileMapping::create(int fd, std::size_t size)
+    {
+        if (fd < 0 || size == 0)
+            return nullptr;
+
+        void* data = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            LOG(ERROR) << "mmap() failed for descriptor " << fd << ", errno: " << errno << std::endl;
+            return nullptr;
+        }
+
+        // These are hints, failures (e.g. no THP support for file mappings) don't matter
+        ::madvise(data, size, MADV_SEQUENTIAL);
+        ::madvise(data, size, MADV_WILLNEED);
+#ifdef MADV_HUGEPAGE
+        ::madvise(data, size, MADV_HUGEPAGE);
+#endif
+
+        return std::shared_ptr<const FileMapping>(new FileMapping(static_cast<const char*>(data), size));
+    }
+
+    FileMapping::~FileMapping()
+    {
+        ::munmap(const_cast<char*>(m_data), m_size);
+    }
+
+    bool FileMapping::copy(char* destination, std::size_t offset, std::size_t length) const
+    {
+        if (offset > m_size || length > m_size - offset)
+            return false;
+
+        sigjmp_buf guard;
+        if (sigsetjmp(guard, 1) != 0)
+        {
+            faultGuard = nullptr;
+            LOG(ERROR) << "SIGBUS while reading a mapped file, was it truncated?" << std::endl;
+            return false;
+        }
+
+        faultGuard = &guard;
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        std::memcpy(destination, m_data + offset, length);
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        faultGuard = nullptr;
+        return true;
+    }
+
+    void FileMapping::installSignalHandler()
+    {
+        struct sigaction sa;
+        std::memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = &onBusError;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGBUS, &sa, nullptr);
+    }
+}
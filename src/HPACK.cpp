@@ -0,0 +1,456 @@
+#include "HPACK.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <iterator>
+#include <tuple>
+
+namespace ryuuk
+{
+    namespace
+    {
+        // RFC 7541, appendix A
+        const std::pair<std::string_view, std::string_view> StaticTable[] =
+        {
+            {":authority", ""},
+            {":method", "GET"},
+            {":method", "POST"},
+            {":path", "/"},
+            {":path", "/index.html"},
+            {":scheme", "http"},
+            {":scheme", "https"},
+            {":status", "200"},
+            {":status", "204"},
+            {":status", "206"},
+            {":status", "304"},
+            {":status", "400"},
+            {":status", "404"},
+            {":status", "500"},
+            {"accept-charset", ""},
+            {"accept-encoding", "gzip, deflate"},
+            {"accept-language", ""},
+            {"accept-ranges", ""},
+            {"accept", ""},
+            {"access-control-allow-origin", ""},
+            {"age", ""},
+            {"allow", ""},
+            {"authorization", ""},
+            {"cache-control", ""},
+            {"content-disposition", ""},
+            {"content-encoding", ""},
+            {"content-language", ""},
+            {"content-length", ""},
+            {"content-location", ""},
+            {"content-range", ""},
+            {"content-type", ""},
+            {"cookie", ""},
+            {"date", ""},
+            {"etag", ""},
+            {"expect", ""},
+            {"expires", ""},
+            {"from", ""},
+            {"host", ""},
+            {"if-match", ""},
+            {"if-modified-since", ""},
+            {"if-none-match", ""},
+            {"if-range", ""},
+            {"if-unmodified-since", ""},
+            {"last-modified", ""},
+            {"link", ""},
+            {"location", ""},
+            {"max-forwards", ""},
+            {"proxy-authenticate", ""},
+            {"proxy-authorization", ""},
+            {"range", ""},
+            {"referer", ""},
+            {"refresh", ""},
+            {"retry-after", ""},
+            {"server", ""},
+            {"set-cookie", ""},
+            {"strict-transport-security", ""},
+            {"transfer-encoding", ""},
+            {"user-agent", ""},
+            {"vary", ""},
+            {"via", ""},
+            {"www-authenticate", ""},
+        };
+
+        // RFC 7541, appendix B: the code of each symbol, the last being EOS, and its length in bits
+        const std::pair<std::uint32_t, std::uint8_t> HuffmanCodes[257] =
+        {
+            {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28}, {0xfffffe4, 28}, {0xfffffe5, 28},
+            {0xfffffe6, 28}, {0xfffffe7, 28}, {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+            {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28}, {0xfffffed, 28}, {0xfffffee, 28},
+            {0xfffffef, 28}, {0xffffff0, 28}, {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+            {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28}, {0xffffff8, 28}, {0xffffff9, 28},
+            {0xffffffa, 28}, {0xffffffb, 28}, {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+            {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11}, {0x3fa, 10}, {0x3fb, 10},
+            {0xf9, 8}, {0x7fb, 11}, {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+            {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6}, {0x1a, 6}, {0x1b, 6},
+            {0x1c, 6}, {0x1d, 6}, {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+            {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10}, {0x1ffa, 13}, {0x21, 6},
+            {0x5d, 7}, {0x5e, 7}, {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+            {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7}, {0x67, 7}, {0x68, 7},
+            {0x69, 7}, {0x6a, 7}, {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+            {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7}, {0xfc, 8}, {0x73, 7},
+            {0xfd, 8}, {0x1ffb, 13}, {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+            {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5}, {0x24, 6}, {0x5, 5},
+            {0x25, 6}, {0x26, 6}, {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+            {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5}, {0x2b, 6}, {0x76, 7},
+            {0x2c, 6}, {0x8, 5}, {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+            {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15}, {0x7fc, 11}, {0x3ffd, 14},
+            {0x1ffd, 13}, {0xffffffc, 28}, {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+            {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23}, {0x3fffd6, 22}, {0x7fffda, 23},
+            {0x7fffdb, 23}, {0x7fffdc, 23}, {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+            {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23}, {0xffffee, 24}, {0x7fffe1, 23},
+            {0x7fffe2, 23}, {0x7fffe3, 23}, {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+            {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24}, {0x3fffda, 22}, {0x1fffdd, 21},
+            {0xfffe9, 20}, {0x3fffdb, 22}, {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+            {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24}, {0x1fffdf, 21}, {0x3fffdf, 22},
+            {0x7fffeb, 23}, {0x7fffec, 23}, {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+            {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23}, {0xfffea, 20}, {0x3fffe2, 22},
+            {0x3fffe3, 22}, {0x3fffe4, 22}, {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+            {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19}, {0x3fffe7, 22}, {0x7ffff2, 23},
+            {0x3fffe8, 22}, {0x1ffffec, 25}, {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+            {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25}, {0x7fff2, 19}, {0x1fffe3, 21},
+            {0x3ffffe6, 26}, {0x7ffffe0, 27}, {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+            {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26}, {0xffffffd, 28}, {0x7ffffe3, 27},
+            {0x7ffffe4, 27}, {0x7ffffe5, 27}, {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+            {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23}, {0x3fffea, 22}, {0x3fffeb, 22},
+            {0x1ffffee, 25}, {0x1ffffef, 25}, {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+            {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26}, {0x7ffffe7, 27}, {0x7ffffe8, 27},
+            {0x7ffffe9, 27}, {0x7ffffea, 27}, {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+            {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26}, {0x3fffffff, 30},
+        };
+
+        const std::size_t StaticEntries = std::size(StaticTable);
+        const std::size_t EntryOverhead = 32;
+
+        // The Huffman code as a binary tree, nodes[i][bit] is the next node, or -1 - symbol for a leaf
+        const std::vector<std::array<int, 2>>& huffmanTree()
+        {
+            static const auto nodes = []
+            {
+                std::vector<std::array<int, 2>> nodes(1, {0, 0});
+                for (int symbol = 0; symbol < 257; ++symbol)
+                {
+                    auto [code, length] = HuffmanCodes[symbol];
+                    int node = 0;
+                    for (int bit = length - 1; bit > 0; --bit)
+                    {
+                        int next = nodes[node][(code >> bit) & 1];
+                        if (next == 0)
+                        {
+                            // Not through a reference, push_back() may move the nodes
+                            next = nodes.size();
+                            nodes[node][(code >> bit) & 1] = next;
+                            nodes.push_back({0, 0});
+                        }
+                        node = next;
+                    }
+                    nodes[node][code & 1] = -1 - symbol;
+                }
+                return nodes;
+            }();
+            return nodes;
+        }
+
+        bool huffmanDecode(std::string_view input, std::string& out)
+        {
+            const auto& nodes = huffmanTree();
+            int node = 0;
+            int depth = 0;          // Bits read since the last symbol
+            bool ones = true;       // And whether they were all ones
+            for (unsigned char byte : input)
+            {
+                for (int bit = 7; bit >= 0; --bit)
+                {
+                    int set = (byte >> bit) & 1;
+                    int next = nodes[node][set];
+                    ones = ones && set;
+                    ++depth;
+                    if (next < 0)
+                    {
+                        if (next == -1 - 256)
+                            return false;   // EOS may not be encoded
+                        out += static_cast<char>(-1 - next);
+                        node = depth = 0;
+                        ones = true;
+                    }
+                    else
+                        node = next;
+                }
+            }
+            // Padding is the start of EOS, i.e. up to 7 one bits
+            return depth < 8 && ones;
+        }
+
+        std::size_t huffmanLength(std::string_view input)
+        {
+            std::size_t bits = 0;
+            for (unsigned char c : input)
+                bits += HuffmanCodes[c].second;
+            return (bits + 7) / 8;
+        }
+
+        void huffmanEncode(std::string& out, std::string_view input)
+        {
+            std::uint64_t pending = 0;
+            int bits = 0;
+            for (unsigned char c : input)
+            {
+                auto [code, length] = HuffmanCodes[c];
+                pending = (pending << length) | code;
+                bits += length;
+                while (bits >= 8)
+                {
+                    bits -= 8;
+                    out += static_cast<char>(pending >> bits);
+                }
+                pending &= (std::uint64_t(1) << bits) - 1;
+            }
+            if (bits > 0)
+                out += static_cast<char>((pending << (8 - bits)) | (0xff >> bits));
+        }
+
+        // An integer with a `prefixBits` bit prefix, the bits above it in the first byte set to `flags`
+        void encodeInteger(std::string& out, std::uint8_t flags, int prefixBits, std::size_t value)
+        {
+            const std::size_t max = (1u << prefixBits) - 1;
+            if (value < max)
+            {
+                out += static_cast<char>(flags | value);
+                return;
+            }
+            out += static_cast<char>(flags | max);
+            for (value -= max; value >= 128; value >>= 7)
+                out += static_cast<char>((value & 127) | 128);
+            out += static_cast<char>(value);
+        }
+
+        bool decodeInteger(const unsigned char*& p, const unsigned char* end, int prefixBits, std::size_t& value)
+        {
+            const std::size_t max = (1u << prefixBits) - 1;
+            value = *p++ & max;
+            if (value < max)
+                return true;
+            for (int shift = 0; p < end && shift < 28; shift += 7)
+            {
+                unsigned char byte = *p++;
+                value += std::size_t(byte & 127) << shift;
+                if (!(byte & 128))
+                    return true;
+            }
+            return false;   // Truncated, or too large to be anything sensible
+        }
+
+        void encodeString(std::string& out, std::string_view value)
+        {
+            auto compressed = huffmanLength(value);
+            if (compressed < value.size())
+            {
+                encodeInteger(out, 0x80, 7, compressed);
+                huffmanEncode(out, value);
+            }
+            else
+            {
+                encodeInteger(out, 0, 7, value.size());
+                out += value;
+            }
+        }
+
+        bool decodeString(const unsigned char*& p, const unsigned char* end, std::string& out)
+        {
+            if (p == end)
+                return false;
+            bool huffman = *p & 0x80;
+            std::size_t length;
+            if (!decodeInteger(p, end, 7, length) || length > static_cast<std::size_t>(end - p))
+                return false;
+            std::string_view data{reinterpret_cast<const char*>(p), length};
+            p += length;
+            if (huffman)
+                return huffmanDecode(data, out);
+            out.assign(data);
+            return true;
+        }
+
+        // Fields which change with nearly every response, not worth a place in the table
+        bool volatileField(std::string_view name)
+        {
+            return name == "date" || name == "expires" || name == "content-length" || name == "etag" || name == "last-modified" ||
+                   name == "content-range" || name == "location";
+        }
+    }
+
+    void HeaderTable::add(std::string name, std::string value)
+    {
+        auto size = name.size() + value.size() + EntryOverhead;
+        if (size > m_maxSize)
+        {
+            // Adding an entry larger than the table empties it
+            m_entries.clear();
+            m_size = 0;
+            return;
+        }
+        m_entries.emplace_front(std::move(name), std::move(value));
+        m_size += size;
+        evict();
+    }
+
+    void HeaderTable::setMaxSize(std::size_t maxSize)
+    {
+        m_maxSize = maxSize;
+        evict();
+    }
+
+    bool HeaderTable::at(std::size_t index, std::string_view& name, std::string_view& value) const
+    {
+        if (index == 0)
+            return false;
+        if (index <= StaticEntries)
+        {
+            std::tie(name, value) = StaticTable[index - 1];
+            return true;
+        }
+        index -= StaticEntries + 1;
+        if (index >= m_entries.size())
+            return false;
+        name = m_entries[index].first;
+        value = m_entries[index].second;
+        return true;
+    }
+
+    std::size_t HeaderTable::find(std::string_view name, std::string_view value, bool& exact) const
+    {
+        std::size_t nameMatch = 0;
+        exact = false;
+        for (std::size_t i = 0; i < StaticEntries; ++i)
+        {
+            if (StaticTable[i].first != name)
+                continue;
+            if (StaticTable[i].second == value)
+            {
+                exact = true;
+                return i + 1;
+            }
+            if (!nameMatch)
+                nameMatch = i + 1;
+        }
+        for (std::size_t i = 0; i < m_entries.size(); ++i)
+        {
+            if (m_entries[i].first != name)
+                continue;
+            if (m_entries[i].second == value)
+            {
+                exact = true;
+                return StaticEntries + 1 + i;
+            }
+            if (!nameMatch)
+                nameMatch = StaticEntries + 1 + i;
+        }
+        return nameMatch;
+    }
+
+    void HeaderTable::evict()
+    {
+        while (m_size > m_maxSize)
+        {
+            auto& oldest = m_entries.back();
+            m_size -= oldest.first.size() + oldest.second.size() + EntryOverhead;
+            m_entries.pop_back();
+        }
+    }
+
+    bool HPACKDecoder::decode(std::string_view block, HeaderList& headers)
+    {
+        auto p = reinterpret_cast<const unsigned char*>(block.data());
+        auto end = p + block.size();
+        bool fields = false;    // Table size updates must come before any field
+        while (p < end)
+        {
+            unsigned char first = *p;
+            std::size_t index;
+            if (first & 0x80)
+            {
+                // Indexed field
+                std::string_view name, value;
+                if (!decodeInteger(p, end, 7, index) || !m_table.at(index, name, value))
+                    return false;
+                headers.emplace_back(name, value);
+            }
+            else if ((first & 0xe0) == 0x20)
+            {
+                if (fields || !decodeInteger(p, end, 5, index) || index > m_limit)
+                    return false;
+                m_table.setMaxSize(index);
+                continue;
+            }
+            else
+            {
+                // Literal field, to be indexed (01), not to be (0000) or never to be (0001)
+                bool indexed = (first & 0xc0) == 0x40;
+                if (!decodeInteger(p, end, indexed ? 6 : 4, index))
+                    return false;
+                std::string name, value;
+                std::string_view indexedName, unused;
+                if (index == 0)
+                {
+                    if (!decodeString(p, end, name))
+                        return false;
+                }
+                else if (m_table.at(index, indexedName, unused))
+                    name.assign(indexedName);
+                else
+                    return false;
+                if (!decodeString(p, end, value))
+                    return false;
+
+                headers.emplace_back(name, value);
+                if (indexed)
+                    m_table.add(std::move(name), std::move(value));
+            }
+            fields = true;
+        }
+        return true;
+    }
+
+    void HPACKEncoder::begin(std::string& out)
+    {
+        if (m_sizeChanged)
+        {
+            encodeInteger(out, 0x20, 5, m_table.maxSize());
+            m_sizeChanged = false;
+        }
+    }
+
+    void HPACKEncoder::encode(std::string& out, std::string_view name, std::string_view value)
+    {
+        bool exact;
+        auto index = m_table.find(name, value, exact);
+        if (exact)
+        {
+            encodeInteger(out, 0x80, 7, index);
+            return;
+        }
+
+        bool indexed = !volatileField(name);
+        encodeInteger(out, indexed ? 0x40 : 0, indexed ? 6 : 4, index);
+        if (index == 0)
+            encodeString(out, name);
+        encodeString(out, value);
+        if (indexed)
+            m_table.add(std::string{name}, std::string{value});
+    }
+
+    void HPACKEncoder::setMaxTableSize(std::size_t size)
+    {
+        size = std::min<std::size_t>(size, 4096);
+        if (size != m_table.maxSize())
+        {
+            m_table.setMaxSize(size);
+            m_sizeChanged = true;
+        }
+    }
+}
@@ -7,44 +7,13 @@
 #include "Utility.hpp"
 #include "HTTP.hpp"
 #include "ResponseCreator.hpp"
+#include "FileCache.hpp"
+#include "Metrics.hpp"
 
 namespace ryuuk
 {
 
-    std::vector<std::string> parseFieldValues(const std::string& value)
-    {
-        std::vector<std::string> vals{};
-        std::string valueCopy{value};
-
-        std::size_t pos = 0;
-        while( (pos = valueCopy.find(',', pos)) != std::string::npos )
-        {
-            auto v = valueCopy.substr(0, pos);
-
-            std::size_t i;
-
-            // Remove the quality factor value
-            if ( (i = v.find(';')) == std::string::npos)
-                vals.push_back(ltrim(v));
-            else
-                vals.push_back(ltrim(v.substr(0, i)));
-
-            valueCopy = valueCopy.substr(pos+1);
-            pos++;
-        }
-
-        auto v = valueCopy.substr(0, pos);
-        std::size_t i;
-        if ( (i = v.find(';')) == std::string::npos)
-            vals.push_back(ltrim(v));
-        else
-            vals.push_back(ltrim(v.substr(0, i)));
-
-        return vals;
-    }
-
-
-    HTTP::Result HTTP::buildResponse(const std::string& request)
+    HTTP::Result HTTP::buildResponse(const std::string& request, Response& response, unsigned int connectionFlags)
     {
         Result result;
         // Perliminary test to see if we have the entire header before regex-ing it.
@@ -60,6 +29,7 @@ namespace ryuuk
             result.keepAlive = true;  // So we keep going after this attempt
             return result;
         }
+        response.markReceived();
 
 
         /*
@@ -86,8 +56,6 @@ namespace ryuuk
             R"(^([A-Z]+)[ \t]+(.+)[ \t]+HTTP/(\d\.\d)(\r?\n)((?:.|[\r\nu2029u2028])*\4)*\4)"
         );
 
-        ResponseCreator responseCreator;
-
         std::smatch matches;
         if (std::regex_search(request, matches, request_pattern))
         {
@@ -102,7 +70,9 @@ namespace ryuuk
             // Some simple searching
             result.keepAlive = true;
             // Pattern: field-name ":" white-space field-value [CR] LF
-            const std::regex fieldPattern("^([a-zA-Z\\-]+):\\s+([a-zA-Z0-9\\-\\.\\/\\(\\),\\+:; \\=\\*]+)(\r?\n)");
+            // (field-values are any visible characters, entity-tags for example come in quotes)
+            const std::regex fieldPattern("^([a-zA-Z0-9\\-]+):[ \t]*([^\r\n]*)(\r?\n)");
+            RequestFields fields;
             auto search = headers;
             while (std::regex_search(search, matches, fieldPattern))
             {
@@ -122,95 +92,132 @@ namespace ryuuk
                     }
                 }
                 else if (name == "Accept-Encoding")
-                {
-                    std::smatch mm;
-                    if (std::regex_search(value, mm, std::regex{"(?:identity|\\*);q=0"}))
-                    {
-                        LOG(ERROR) << "Identity encoding not acceptable" << std::endl;
-                        // TODO send 406 Not Acceptable
-                    }
-                }
+                    fields.acceptEncoding = value;
+                else if (name == "Range")
+                    fields.range = value;
+                else if (name == "If-Range")
+                    fields.ifRange = value;
+                else if (name == "If-Match")
+                    fields.ifMatch = value;
+                else if (name == "If-None-Match")
+                    fields.ifNoneMatch = value;
+                else if (name == "If-Modified-Since")
+                    fields.ifModifiedSince = value;
+                else if (name == "If-Unmodified-Since")
+                    fields.ifUnmodifiedSince = value;
+                else if (name == "Referer")
+                    fields.referer = value;
+                else if (name == "User-Agent")
+                    fields.userAgent = value;
                 else
                     LOG(INFO) << "Header field ignored (" << name << ": " << value << ")" << std::endl;
 
                 search = matches.suffix().str();
             }
 
-
-
-            unsigned int flags = (method == "HEAD" ? ResponseCreator::NoPayload : ResponseCreator::None)
-                              | (result.keepAlive ? ResponseCreator::KeepConnection : ResponseCreator::None);
+            unsigned int flags = connectionFlags | (result.keepAlive ? ResponseCreator::KeepConnection
+                                                                     : ResponseCreator::None);
+            response.record().version = version == "1.0" ? 10 : 11;
             if (version == "1.0")
             {
                 result.keepAlive = false;
                 flags |= ResponseCreator::HTTPLegacy;
             }
 
-            if (method != "GET" && method != "HEAD")
-            {
-                responseCreator.create(ResponseCreator::MethodNotAllowed, {}, flags);
-            }
-            else try
-            {
-                auto orig_loc = location;
-                auto loc = sanitizePath(location); // can throw std::domain_error
-                location = "./" + (loc != "/" ? loc : "");
-
-                FileType type = getResourceType(location);
-                // The URL "./about" is resolved to "./about/index.html" if the index exists
-                // Otherwise, a directory listing is sent instead.
-                if (type == Directory)
-                {
-                    // Check If an index.html file is present in the path,
-                    type = getResourceType(location + "/index.html");
-                    if (type == Regular)
-                    {
-                        location += "/index.html";
-                        LOG(DEBUG) << "Append index.html to path" << std::endl;
-                    }
-                    // If no index.html is present in the path, it's a normal directory
-                    else if (type == NonExistent)
-                        type = Directory;
-                    else
-                        LOG(ERROR) << "Here's ya edge case, what do ?" << std::endl; // TODO what do ?
-                }
-
-                switch (type)
-                {
-                    case Regular:
-                        result.response = responseCreator.create(ResponseCreator::OK, location, flags);
-                        break;
-                    case Directory:
-                        // If the path doesn't have a slash, redirect by adding it, this makes relative links work properly
-                        // TODO FIXME instead of sending orig_loc, send urlEncode(location.substr(1))
-                        if (location.back() != '/')
-                            result.response = responseCreator.create(ResponseCreator::MovedPermanently,
-                                                                     orig_loc + '/', flags);
-                        else
-                            result.response = responseCreator.create(ResponseCreator::OK, location, ResponseCreator::SendDirectory | flags);
-                        break;
-                    case PermissionDenied:
-                        result.response = responseCreator.create(ResponseCreator::Forbidden, {}, flags);
-                        break;
-                    case NonExistent:
-                        result.response = responseCreator.create(ResponseCreator::NotFound, {}, flags);
-                        break;
-                    case Other:
-                        result.response = responseCreator.create(ResponseCreator::InternalError, {}, flags);
-                        break;
-                }
-            }
-            catch (const std::domain_error& e)
-            {
-                LOG(INFO) << "Attempt to retrieve resource outside current directory" << std::endl;
-                responseCreator.create(ResponseCreator::Forbidden, {}, flags);
-            }
+            respond(method, std::move(location), std::move(fields), flags, response);
         }
         else
         {
-            responseCreator.create(ResponseCreator::BadRequest);
+            response.markParsed();
+            Metrics::local().parseErrors.add();
+            ResponseCreator(response).create(ResponseCreator::BadRequest);
+            response.markCreated();
         }
 
         return result;
    }
+
+    void HTTP::respond(const std::string& method, std::string location, RequestFields fields,
+                       unsigned int flags, Response& response)
+    {
+        response.markParsed();
+        auto& record = response.record();
+        record.method = accesslog::methodFromName(method);
+        // The rest is only the access log's, Metrics and the Trace make do with the method and status
+        if (AccessLog::get().enabled())
+        {
+            record.pathId = accesslog::hashPath(location);
+            record.store(record.path, record.pathLength, location);
+            record.store(record.referer, record.refererLength, fields.referer);
+            record.store(record.userAgent, record.userAgentLength, fields.userAgent);
+        }
+        if (Trace::enabled())
+            response.trace().target = location;
+
+        ResponseCreator responseCreator(response);
+
+        // The query is only used by directory listings for now
+        if (auto question = location.find('?'); question != std::string::npos)
+        {
+            fields.query = location.substr(question + 1);
+            location.resize(question);
+        }
+        const std::string query = fields.query;
+
+        responseCreator.setRequestFields(std::move(fields));
+
+        if (method == "HEAD")
+            flags |= ResponseCreator::NoPayload;
+
+        if (method != "GET" && method != "HEAD")
+        {
+            responseCreator.create(ResponseCreator::MethodNotAllowed, {}, flags);
+        }
+        else if (Metrics::get().servesPath(location))
+        {
+            responseCreator.create(std::make_shared<const std::string>(Metrics::get().render()),
+                                   Metrics::ContentType, flags);
+        }
+        else try
+        {
+            std::string path = "./";
+            normalizePath(location, path); // can throw std::domain_error
+            response.mark(Trace::Sanitized);
+
+            // Directories with an index are resolved to it by the cache
+            auto file = FileCache::get().resolve(path);
+            response.mark(Trace::Resolved);
+
+            switch (file->info.type)
+            {
+                case Regular:
+                    responseCreator.create(std::move(file), flags);
+                    break;
+                case Directory:
+                    // If the path doesn't have a slash, redirect by adding it, this makes relative links work properly
+                    // TODO FIXME instead of sending location, send urlEncode(path.substr(1))
+                    if (path.back() != '/')
+                        responseCreator.create(ResponseCreator::MovedPermanently,
+                                               location + '/' + (query.empty() ? "" : "?" + query), flags);
+                    else
+                        responseCreator.create(std::move(file), ResponseCreator::SendDirectory | flags);
+                    break;
+                case PermissionDenied:
+                    responseCreator.create(ResponseCreator::Forbidden, {}, flags);
+                    break;
+                case NonExistent:
+                    responseCreator.create(ResponseCreator::NotFound, {}, flags);
+                    break;
+                case Other:
+                    responseCreator.create(ResponseCreator::InternalError, {}, flags);
+                    break;
+            }
+        }
+        catch (const std::domain_error& e)
+        {
+            LOG(INFO) << "Attempt to retrieve resource outside current directory" << std::endl;
+            responseCreator.create(ResponseCreator::Forbidden, {}, flags);
+        }
+        response.markCreated();
+    }
 }
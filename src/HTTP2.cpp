@@ -0,0 +1,797 @@
+#include "HTTP2.hpp"
+#include "HTTP.hpp"
+#include "Log.hpp"
+#include "Metrics.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <poll.h>
+#include <stdexcept>
+
+namespace ryuuk
+{
+    namespace
+    {
+        enum FrameType : std::uint8_t
+        {
+            Data            = 0x0,
+            Headers         = 0x1,
+            Priority        = 0x2,
+            ResetStream     = 0x3,
+            Settings        = 0x4,
+            PushPromise     = 0x5,
+            Ping            = 0x6,
+            GoAway          = 0x7,
+            WindowUpdate    = 0x8,
+            Continuation    = 0x9,
+        };
+
+        enum FrameFlag : std::uint8_t
+        {
+            EndStream       = 0x1,
+            Ack             = 0x1,
+            EndHeaders      = 0x4,
+            Padded          = 0x8,
+            PriorityFlag    = 0x20,
+        };
+
+        enum ErrorCode : std::uint32_t
+        {
+            NoError             = 0x0,
+            ProtocolError       = 0x1,
+            InternalError       = 0x2,
+            FlowControlError    = 0x3,
+            FrameSizeError      = 0x6,
+            RefusedStream       = 0x7,
+            CompressionError    = 0x9,
+            EnhanceYourCalm     = 0xb,
+        };
+
+        enum SettingId : std::uint16_t
+        {
+            HeaderTableSize         = 0x1,
+            MaxConcurrentStreams    = 0x3,
+            InitialWindowSize       = 0x4,
+            MaxFrameSize            = 0x5,
+            MaxHeaderListSize       = 0x6,
+        };
+
+        const std::size_t FrameHeaderSize = 9;
+        const std::uint32_t ReceiveFrameSize = 16384;   // We don't raise SETTINGS_MAX_FRAME_SIZE from the default
+        const std::int64_t MaxWindow = 0x7fffffff;
+        const std::size_t MaxHeaderBlock = 64 * 1024;
+        const std::size_t MaxInput = 1024 * 1024;       // Unprocessed input, a client sending more isn't reading
+        const std::size_t OutputBatch = 64 * 1024;      // Frames written to the socket at once
+
+        // Header fields specific to an HTTP/1.1 connection, which HTTP/2 forbids
+        const std::string_view ConnectionFields[] = {"connection", "keep-alive", "transfer-encoding",
+                                                     "proxy-connection", "upgrade"};
+
+        std::uint32_t read32(const char* p)
+        {
+            auto u = reinterpret_cast<const unsigned char*>(p);
+            return std::uint32_t(u[0]) << 24 | std::uint32_t(u[1]) << 16 | std::uint32_t(u[2]) << 8 | u[3];
+        }
+
+        void append32(std::string& out, std::uint32_t value)
+        {
+            const char bytes[] = {char(value >> 24), char(value >> 16), char(value >> 8), char(value)};
+            out.append(bytes, 4);
+        }
+
+        void appendFrameHeader(std::string& out, std::size_t length, std::uint8_t type, std::uint8_t flags,
+                               std::uint32_t streamId)
+        {
+            const char bytes[] = {char(length >> 16), char(length >> 8), char(length), char(type), char(flags)};
+            out.append(bytes, 5);
+            append32(out, streamId);
+        }
+
+        // The payload of a HEADERS or DATA frame, without its padding. False if the padding is malformed.
+        bool stripPadding(std::uint8_t flags, std::string_view& payload)
+        {
+            if (!(flags & Padded))
+                return true;
+            if (payload.empty())
+                return false;
+            std::size_t padding = static_cast<unsigned char>(payload[0]);
+            if (padding >= payload.size())
+                return false;
+            payload = payload.substr(1, payload.size() - 1 - padding);
+            return true;
+        }
+    }
+
+    HTTP2Connection::HTTP2Connection(SocketStream& socket, std::uint32_t maxStreams)
+        : m_socket(socket)
+        , m_maxStreams(std::max<std::uint32_t>(maxStreams, 1))
+    {}
+
+    HTTP2Connection::~HTTP2Connection() = default;
+
+    void HTTP2Connection::serve(std::string received)
+    {
+        m_input = std::move(received);
+        LOG(DEBUG) << "Serving HTTP/2 on socket " << m_socket.getSocketFd() << std::endl;
+
+        // The server's preface is its SETTINGS
+        std::string settings;
+        for (auto [id, value] : {std::pair<std::uint16_t, std::uint32_t>{MaxConcurrentStreams, m_maxStreams},
+                                 {MaxHeaderListSize, MaxHeaderBlock}})
+        {
+            settings += char(id >> 8);
+            settings += char(id);
+            append32(settings, value);
+        }
+        queueFrame(Settings, 0, 0, settings);
+
+        try
+        {
+            while (true)
+            {
+                if (!processInput())
+                {
+                    LOG(DEBUG) << "Expected the HTTP/2 preface on socket " << m_socket.getSocketFd() << std::endl;
+                    return;
+                }
+                if (!flush())
+                    return;
+
+                bool pending = outputPending();
+                if ((m_closing || (m_goingAway && m_streams.empty())) && !pending)
+                    return;
+
+                Metrics::local().setActive(!m_streams.empty() || pending);
+                // A file payload may be waiting for a buffer to copy it through rather than for the socket
+                pollfd pfd[2] = {{m_socket.getSocketFd(), 0, 0}, {m_socket.bufferWait(), POLLIN, 0}};
+                if (!m_closing)
+                    pfd[0].events |= POLLIN;
+                if (pending && pfd[1].fd < 0)
+                    pfd[0].events |= POLLOUT;
+                if ((pfd[0].events & POLLIN) && m_socket.pending())
+                    pfd[0].revents = POLLIN;
+                else if (poll(pfd, 2, -1) < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    LOG(ERROR) << "poll() error with socket " << m_socket.getSocketFd() << " and errno " << errno << std::endl;
+                    return;
+                }
+                if (pfd[0].revents & (POLLERR | POLLNVAL))
+                    return;
+                if (!(pfd[0].revents & (POLLIN | POLLHUP)) || !(pfd[0].events & POLLIN))
+                    continue;
+
+                auto [result, reply] = m_socket.receive();
+                switch (result)
+                {
+                    case ReceiveResult::Success:
+                        Metrics::local().bytesIn.add(reply.size());
+                        m_input += reply;
+                        if (m_input.size() > MaxInput)
+                            connectionError(EnhanceYourCalm);
+                        break;
+                    case ReceiveResult::WouldBlock:
+                        break;
+                    case ReceiveResult::Disconnected:
+                        LOG(DEBUG) << "Removing socket " << m_socket.getSocketFd() << std::endl;
+                        return;
+                    case ReceiveResult::Error:
+                        LOG(ERROR) << "Receive error with socket " << m_socket.getSocketFd() << " and errno " << errno << std::endl;
+                        return;
+                }
+            }
+        }
+        catch (const std::runtime_error& e)
+        {
+            LOG(DEBUG) << e.what() << std::endl;
+        }
+    }
+
+    bool HTTP2Connection::processInput()
+    {
+        if (!m_prefaceReceived)
+        {
+            auto compared = std::min(m_input.size(), Preface.size());
+            if (std::string_view(m_input).substr(0, compared) != Preface.substr(0, compared))
+                return false;
+            if (compared < Preface.size())
+                return true;
+            m_input.erase(0, Preface.size());
+            m_prefaceReceived = true;
+        }
+
+        std::size_t position = 0;
+        while (!m_closing && m_input.size() - position >= FrameHeaderSize)
+        {
+            const char* header = m_input.data() + position;
+            std::size_t length = read32(header) >> 8;
+            auto type = static_cast<std::uint8_t>(header[3]);
+            auto flags = static_cast<std::uint8_t>(header[4]);
+            std::uint32_t streamId = read32(header + 5) & 0x7fffffff;
+
+            if (length > ReceiveFrameSize)
+            {
+                connectionError(FrameSizeError);
+                break;
+            }
+            if (m_input.size() - position - FrameHeaderSize < length)
+                break;
+            position += FrameHeaderSize + length;
+            handleFrame(type, flags, streamId, {header + FrameHeaderSize, length});
+        }
+        m_input.erase(0, position);
+        return true;
+    }
+
+    void HTTP2Connection::handleFrame(std::uint8_t type, std::uint8_t flags, std::uint32_t streamId,
+                                      std::string_view payload)
+    {
+        // Nothing may come between a HEADERS frame and the CONTINUATION frames completing it
+        if (m_headerStream != 0 && (type != Continuation || streamId != m_headerStream))
+        {
+            connectionError(ProtocolError);
+            return;
+        }
+
+        switch (type)
+        {
+            case Data:
+            {
+                if (streamId == 0)
+                {
+                    connectionError(ProtocolError);
+                    return;
+                }
+                // Request bodies aren't used, but their window is given back so clients aren't stuck sending them
+                if (!payload.empty())
+                {
+                    std::string increment;
+                    append32(increment, payload.size());
+                    queueFrame(WindowUpdate, 0, 0, increment);
+                    if (m_streams.count(streamId))
+                        queueFrame(WindowUpdate, 0, streamId, increment);
+                }
+                if (!stripPadding(flags, payload))
+                    connectionError(ProtocolError);
+                break;
+            }
+
+            case Headers:
+            {
+                if (streamId == 0 || streamId % 2 == 0)
+                {
+                    connectionError(ProtocolError);
+                    return;
+                }
+                if (!stripPadding(flags, payload))
+                {
+                    connectionError(ProtocolError);
+                    return;
+                }
+                if (flags & PriorityFlag)
+                {
+                    if (payload.size() < 5)
+                    {
+                        connectionError(FrameSizeError);
+                        return;
+                    }
+                    payload.remove_prefix(5);   // Priorities are left to our own round-robin
+                }
+                m_headerBlock.assign(payload);
+                m_headerEndStream = flags & EndStream;
+                if (flags & EndHeaders)
+                    handleHeaderBlock(streamId, m_headerEndStream);
+                else
+                    m_headerStream = streamId;
+                break;
+            }
+
+            case Continuation:
+            {
+                if (streamId == 0 || streamId != m_headerStream)
+                {
+                    connectionError(ProtocolError);
+                    return;
+                }
+                m_headerBlock += payload;
+                if (m_headerBlock.size() > MaxHeaderBlock)
+                {
+                    connectionError(EnhanceYourCalm);
+                    return;
+                }
+                if (flags & EndHeaders)
+                {
+                    m_headerStream = 0;
+                    handleHeaderBlock(streamId, m_headerEndStream);
+                }
+                break;
+            }
+
+            case ResetStream:
+                if (streamId == 0 || payload.size() != 4)
+                {
+                    connectionError(streamId == 0 ? ProtocolError : FrameSizeError);
+                    return;
+                }
+                LOG(DEBUG) << "Stream " << streamId << " reset by the client, error " << read32(payload.data()) << std::endl;
+                retire(streamId);
+                break;
+
+            case Settings:
+                if (streamId != 0)
+                {
+                    connectionError(ProtocolError);
+                    return;
+                }
+                if (flags & Ack)
+                {
+                    if (!payload.empty())
+                        connectionError(FrameSizeError);
+                    return;
+                }
+                handleSettings(payload);
+                break;
+
+            case Ping:
+                if (streamId != 0 || payload.size() != 8)
+                {
+                    connectionError(streamId != 0 ? ProtocolError : FrameSizeError);
+                    return;
+                }
+                if (!(flags & Ack))
+                    queueFrame(Ping, Ack, 0, payload);
+                break;
+
+            case GoAway:
+                if (streamId != 0)
+                {
+                    connectionError(ProtocolError);
+                    return;
+                }
+                LOG(DEBUG) << "Client going away from socket " << m_socket.getSocketFd() << std::endl;
+                m_goingAway = true;
+                break;
+
+            case WindowUpdate:
+                if (payload.size() != 4)
+                {
+                    connectionError(FrameSizeError);
+                    return;
+                }
+                handleWindowUpdate(streamId, read32(payload.data()) & 0x7fffffff);
+                break;
+
+            case PushPromise:
+                // Only servers push
+                connectionError(ProtocolError);
+                break;
+
+            case Priority:
+            default:
+                // Unknown frames are ignored
+                break;
+        }
+    }
+
+    void HTTP2Connection::handleSettings(std::string_view payload)
+    {
+        if (payload.size() % 6 != 0)
+        {
+            connectionError(FrameSizeError);
+            return;
+        }
+
+        for (; !payload.empty(); payload.remove_prefix(6))
+        {
+            std::uint16_t id = static_cast<unsigned char>(payload[0]) << 8 | static_cast<unsigned char>(payload[1]);
+            std::uint32_t value = read32(payload.data() + 2);
+            switch (id)
+            {
+                case HeaderTableSize:
+                    m_encoder.setMaxTableSize(value);
+                    break;
+                case InitialWindowSize:
+                {
+                    if (value > MaxWindow)
+                    {
+                        connectionError(FlowControlError);
+                        return;
+                    }
+                    // Applies to the windows of open streams as well, as a change relative to the old value
+                    std::int64_t delta = std::int64_t(value) - m_initialWindow;
+                    m_initialWindow = value;
+                    for (auto& [id, stream] : m_streams)
+                    {
+                        stream->window += delta;
+                        if (stream->window > MaxWindow)
+                        {
+                            connectionError(FlowControlError);
+                            return;
+                        }
+                        schedule(*stream);
+                    }
+                    break;
+                }
+                case MaxFrameSize:
+                    if (value < 16384 || value > 16777215)
+                    {
+                        connectionError(ProtocolError);
+                        return;
+                    }
+                    m_maxFrameSize = value;
+                    break;
+                default:
+                    break;
+            }
+        }
+        queueFrame(Settings, Ack, 0, {});
+    }
+
+    void HTTP2Connection::handleWindowUpdate(std::uint32_t streamId, std::uint32_t increment)
+    {
+        if (streamId == 0)
+        {
+            if (increment == 0 || m_sendWindow + increment > MaxWindow)
+            {
+                connectionError(increment == 0 ? ProtocolError : FlowControlError);
+                return;
+            }
+            m_sendWindow += increment;
+            return;
+        }
+
+        auto found = m_streams.find(streamId);
+        if (found == m_streams.end())
+            return;     // Closed already
+        auto& stream = *found->second;
+        if (increment == 0 || stream.window + increment > MaxWindow)
+        {
+            resetStream(streamId, increment == 0 ? ProtocolError : FlowControlError);
+            return;
+        }
+        stream.window += increment;
+        schedule(stream);
+    }
+
+    void HTTP2Connection::handleHeaderBlock(std::uint32_t streamId, bool endStream)
+    {
+        HeaderList headers;
+        bool decoded = m_decoder.decode(m_headerBlock, headers);
+        m_headerBlock.clear();
+        if (!decoded)
+        {
+            connectionError(CompressionError);
+            return;
+        }
+
+        // Trailers of a request, or a stream we're done with. Either way, there's nothing to answer.
+        if (streamId <= m_lastStream)
+            return;
+        m_lastStream = streamId;
+        if (m_goingAway)
+            return;
+        if (m_streams.size() >= m_maxStreams)
+        {
+            resetStream(streamId, RefusedStream);
+            return;
+        }
+        if (!endStream)
+        {
+            LOG(DEBUG) << "Ignoring the body of stream " << streamId << std::endl;
+        }
+
+        std::string method, path;
+        RequestFields fields;
+        for (auto& [name, value] : headers)
+        {
+            std::string* field = nullptr;
+            if (name == ":method")
+                field = &method;
+            else if (name == ":path")
+                field = &path;
+            else if (name == "accept-encoding")
+                field = &fields.acceptEncoding;
+            else if (name == "range")
+                field = &fields.range;
+            else if (name == "if-range")
+                field = &fields.ifRange;
+            else if (name == "if-match")
+                field = &fields.ifMatch;
+            else if (name == "if-none-match")
+                field = &fields.ifNoneMatch;
+            else if (name == "if-modified-since")
+                field = &fields.ifModifiedSince;
+            else if (name == "if-unmodified-since")
+                field = &fields.ifUnmodifiedSince;
+            else if (name == "referer")
+                field = &fields.referer;
+            else if (name == "user-agent")
+                field = &fields.userAgent;
+
+            // Fields split across several lines are joined as HTTP/1.1 would
+            if (field)
+                *field += (field->empty() ? "" : ", ") + value;
+        }
+        if (method.empty() || path.empty())
+        {
+            Metrics::local().parseErrors.add();
+            resetStream(streamId, ProtocolError);
+            return;
+        }
+        LOG(INFO) << "Request line : " << method << " " << path << " HTTP/2, stream " << streamId << std::endl;
+
+        if (m_answered)
+            Metrics::local().reused.add();
+        m_answered = true;
+
+        auto stream = std::make_unique<Stream>();
+        stream->response.markReceived();
+        stream->response.record().version = 20;
+        stream->id = streamId;
+        stream->window = m_initialWindow;
+        HTTP http;
+        http.respond(method, std::move(path), std::move(fields), ResponseCreator::Multiplexed, stream->response);
+        startResponse(std::move(stream));
+    }
+
+    void HTTP2Connection::startResponse(std::unique_ptr<Stream> owned)
+    {
+        auto& stream = *owned;
+        m_streams[stream.id] = std::move(owned);
+
+        bool more;
+        std::string_view head;
+        std::string joined;     // Prebuilt responses continue their head in the tail
+        try
+        {
+            // The head is written up front, it's all in the first chunk
+            stream.chunk = stream.response.nextChunk();
+            std::string_view message = stream.chunk.data;
+            auto end = message.find("\r\n\r\n");
+            if (end == std::string_view::npos && !stream.chunk.tail.empty())
+            {
+                joined.append(stream.chunk.data).append(stream.chunk.tail);
+                message = joined;
+                end = message.find("\r\n\r\n");
+            }
+            if (end == std::string_view::npos)
+                throw std::runtime_error("Response without a complete head");
+            head = message.substr(0, end + 2);
+
+            auto body = end + 4;
+            if (body <= stream.chunk.data.size())
+                stream.chunk.data.remove_prefix(body);
+            else
+            {
+                stream.chunk.tail.remove_prefix(body - stream.chunk.data.size());
+                stream.chunk.data = {};
+            }
+            more = advance(stream);
+        }
+        catch (const std::runtime_error& e)
+        {
+            LOG(ERROR) << "Couldn't respond on stream " << stream.id << ": " << e.what() << std::endl;
+            resetStream(stream.id, InternalError);
+            return;
+        }
+
+        // "HTTP/1.1 200 OK\r\n", then the fields with their names lowercased
+        std::string block;
+        m_encoder.begin(block);
+        auto lineEnd = head.find("\r\n");
+        m_encoder.encode(block, ":status", head.substr(9, 3));
+        std::string name;
+        for (head.remove_prefix(lineEnd + 2); !head.empty(); head.remove_prefix(lineEnd + 2))
+        {
+            lineEnd = head.find("\r\n");
+            auto line = head.substr(0, lineEnd);
+            auto colon = line.find(':');
+            if (colon == std::string_view::npos)
+                continue;
+            name.assign(line.substr(0, colon));
+            std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return std::tolower(c); });
+            if (std::find(std::begin(ConnectionFields), std::end(ConnectionFields), name) != std::end(ConnectionFields))
+                continue;
+            auto value = line.substr(colon + 1);
+            value.remove_prefix(std::min(value.find_first_not_of(' '), value.size()));
+            m_encoder.encode(block, name, value);
+        }
+
+        // HEADERS, continued by as many CONTINUATION frames as the block needs
+        stream.sent += block.size();
+        std::string_view remaining = block;
+        std::uint8_t type = Headers;
+        std::uint8_t flags = more ? 0 : EndStream;
+        do
+        {
+            auto fragment = remaining.substr(0, m_maxFrameSize);
+            remaining.remove_prefix(fragment.size());
+            queueFrame(type, flags | (remaining.empty() ? EndHeaders : 0), stream.id, fragment);
+            type = Continuation;
+            flags = 0;
+        } while (!remaining.empty());
+
+        if (more)
+            schedule(stream);
+        else
+            retire(stream.id);
+    }
+
+    bool HTTP2Connection::advance(Stream& stream)
+    {
+        while (true)
+        {
+            // The tail is framed like data once the data before it is out
+            if (stream.chunk.data.empty())
+                std::swap(stream.chunk.data, stream.chunk.tail);
+            if (!stream.chunk.empty())
+                return true;
+            stream.chunk = stream.response.nextChunk();
+            if (stream.chunk.empty())
+                return false;
+        }
+    }
+
+    void HTTP2Connection::writeData(Stream& stream)
+    {
+        std::size_t limit = std::min<std::int64_t>({m_maxFrameSize, stream.window, m_sendWindow});
+        std::size_t flagsAt = m_output.size() + 4;
+        std::size_t length;
+        if (!stream.chunk.data.empty())
+        {
+            length = std::min(limit, stream.chunk.data.size());
+            appendFrameHeader(m_output, length, Data, 0, stream.id);
+            m_output.append(stream.chunk.data.data(), length);
+            stream.chunk.data.remove_prefix(length);
+        }
+        else
+        {
+            // The payload comes straight out of the file after the frame header
+            length = std::min(limit, stream.chunk.length);
+            appendFrameHeader(m_output, length, Data, 0, stream.id);
+            m_file = {stream.chunk.fd, stream.chunk.offset, length,
+                      stream.chunk.offset + static_cast<off_t>(stream.chunk.length)};
+            stream.chunk.offset += length;
+            stream.chunk.length -= length;
+        }
+        stream.window -= length;
+        m_sendWindow -= length;
+        stream.sent += length;
+
+        bool more;
+        try
+        {
+            more = advance(stream);
+        }
+        catch (const std::runtime_error& e)
+        {
+            LOG(ERROR) << "Couldn't continue stream " << stream.id << ": " << e.what() << std::endl;
+            resetStream(stream.id, InternalError);
+            return;
+        }
+        if (!more)
+        {
+            m_output[flagsAt] = EndStream;
+            retire(stream.id);
+        }
+    }
+
+    void HTTP2Connection::schedule(Stream& stream)
+    {
+        if (!stream.ready && stream.window > 0 && m_streams.count(stream.id))
+        {
+            stream.ready = true;
+            m_ready.push_back(stream.id);
+        }
+    }
+
+    void HTTP2Connection::retire(std::uint32_t streamId)
+    {
+        auto found = m_streams.find(streamId);
+        if (found == m_streams.end())
+            return;
+        m_retired.push_back(std::move(found->second));
+        m_streams.erase(found);
+    }
+
+    void HTTP2Connection::resetStream(std::uint32_t streamId, std::uint32_t error)
+    {
+        std::string payload;
+        append32(payload, error);
+        queueFrame(ResetStream, 0, streamId, payload);
+        retire(streamId);
+    }
+
+    void HTTP2Connection::connectionError(std::uint32_t error)
+    {
+        LOG(DEBUG) << "HTTP/2 connection error " << error << " on socket " << m_socket.getSocketFd() << std::endl;
+        Metrics::local().parseErrors.add();
+        std::string payload;
+        append32(payload, m_lastStream);
+        append32(payload, error);
+        queueFrame(GoAway, 0, 0, payload);
+        m_closing = true;
+        while (!m_streams.empty())
+            retire(m_streams.begin()->first);
+    }
+
+    void HTTP2Connection::queueFrame(std::uint8_t type, std::uint8_t flags, std::uint32_t streamId,
+                                     std::string_view payload)
+    {
+        appendFrameHeader(m_control, payload.size(), type, flags, streamId);
+        m_control += payload;
+    }
+
+    void HTTP2Connection::fillOutput()
+    {
+        m_output.clear();
+        m_outputSent = 0;
+        // Nothing queued refers to them anymore, they've been sent
+        for (auto& stream : m_retired)
+        {
+            // Reset with part of its file unsent, whose buffered blocks mustn't outlive the descriptor
+            if (stream->chunk.length != 0)
+                m_socket.releaseFile(stream->chunk.fd);
+            stream->response.markSent(stream->sent, m_socket.clientAddress());
+        }
+        m_retired.clear();
+        m_output.swap(m_control);
+
+        // One frame per stream in turn, until a file payload has to go out after the frames written
+        while (m_output.size() < OutputBatch && m_file.length == 0 && m_sendWindow > 0 && !m_ready.empty())
+        {
+            auto found = m_streams.find(m_ready.front());
+            m_ready.pop_front();
+            if (found == m_streams.end())
+                continue;
+            auto& stream = *found->second;
+            stream.ready = false;
+            if (stream.window <= 0)
+                continue;   // Until a WINDOW_UPDATE
+            auto id = stream.id;
+            writeData(stream);
+            if (auto still = m_streams.find(id); still != m_streams.end())
+                schedule(*still->second);
+        }
+    }
+
+    bool HTTP2Connection::flush()
+    {
+        while (true)
+        {
+            if (m_outputSent < m_output.size())
+            {
+                auto sent = m_socket.sendSome(std::string_view(m_output).substr(m_outputSent), m_file.length != 0);
+                if (sent < 0)
+                    return false;
+                m_outputSent += sent;
+                Metrics::local().bytesOut.add(sent);
+                if (m_outputSent < m_output.size())
+                    return true;
+            }
+            if (m_file.length != 0)
+            {
+                auto sent = m_socket.sendFileSome(m_file.fd, m_file.offset, m_file.length, m_file.end);
+                if (sent < 0)
+                    return false;
+                Metrics::local().bytesOut.add(sent);
+                m_file.offset += sent;
+                m_file.length -= sent;
+                if (m_file.length != 0)
+                    return true;
+            }
+
+            fillOutput();
+            if (m_output.empty() && m_file.length == 0)
+                return true;
+        }
+    }
+
+    bool HTTP2Connection::outputPending() const
+    {
+        return m_outputSent < m_output.size() || m_file.length != 0 || !m_control.empty() ||
+               (!m_ready.empty() && m_sendWindow > 0);
+    }
+}
@@ -0,0 +1,123 @@
+#include "ListingCache.hpp"
+#include "DirectoryListing.hpp"
+#include "Log.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+#include <vector>
+
+namespace ryuuk
+{
+    namespace
+    {
+        // Directories modified more recently than this aren't cached: an entry could be added within
+        // the same mtime tick after we've read the directory, and we'd never notice.
+        const std::chrono::seconds RacyInterval{1};
+
+        bool recentlyModified(const FileInfo& info)
+        {
+            auto now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::system_clock::now().time_since_epoch()).count();
+            return now - info.mtime < std::chrono::nanoseconds(RacyInterval).count();
+        }
+    }
+
+    ListingCache& ListingCache::get()
+    {
+        static ListingCache instance;
+        return instance;
+    }
+
+    void ListingCache::configure(std::size_t capacity, std::size_t maxEntries)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_capacity = capacity;
+        m_maxEntries = maxEntries;
+        m_slots.clear();
+        m_lru.clear();
+    }
+
+    ListingCache::Body ListingCache::listing(const FileCache::Handle& directory, const std::string& location,
+                                             bool& tooLarge)
+    {
+        tooLarge = false;
+        std::size_t maxEntries;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (auto it = m_slots.find(location); it != m_slots.end())
+            {
+                auto& slot = it->second;
+                if (slot.info.sameFile(directory->info))
+                {
+                    m_lru.splice(m_lru.begin(), m_lru, slot.lruPosition);
+                    tooLarge = !slot.body;
+                    return slot.body;
+                }
+                m_lru.erase(slot.lruPosition);
+                m_slots.erase(it);
+            }
+            maxEntries = m_maxEntries;
+        }
+
+        // Rendered without holding the lock, concurrent misses just render it twice.
+        // Directories that are too large are remembered as such, so they're only read when streamed.
+        auto body = render(directory->fd, location, maxEntries, tooLarge);
+        if ((!body && !tooLarge) || recentlyModified(directory->info))
+            return body;
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_capacity == 0 || m_slots.count(location))
+            return body;
+
+        m_lru.push_front(location);
+        m_slots.emplace(location, Slot{body, directory->info, m_lru.begin()});
+        while (m_slots.size() > m_capacity)
+        {
+            m_slots.erase(m_lru.back());
+            m_lru.pop_back();
+        }
+        return body;
+    }
+
+    ListingCache::Body ListingCache::render(int directory, const std::string& path, std::size_t maxEntries,
+                                            bool& tooLarge)
+    {
+        DirectoryReader reader(directory);
+        if (!reader.isOpen())
+            return nullptr;
+
+        std::vector<std::string> listing;
+        try
+        {
+            for (auto batch = &reader.nextBatch(); !batch->empty(); batch = &reader.nextBatch())
+            {
+                if (listing.size() + batch->size() > maxEntries)
+                {
+                    tooLarge = true;
+                    return nullptr;
+                }
+                for (const auto& entry : *batch)
+                    listing.push_back(std::string{entry.name} + (entry.directory ? "/" : ""));
+            }
+        }
+        catch (const std::runtime_error& e)
+        {
+            LOG(ERROR) << "Couldn't read directory " << path << ": " << e.what() << std::endl;
+            return nullptr;
+        }
+
+        std::sort(listing.begin(), listing.end());
+        std::string html;
+        appendListingHead(html, path);
+        for (auto&& item : listing)
+        {
+            bool directory = item.back() == '/';
+            appendListingEntry(html, std::string_view{item}.substr(0, item.size() - directory), directory);
+        }
+        appendListingTail(html, path);
+
+        LOG(DEBUG) << "Rendered listing of " << path << " with " << listing.size() << " entries" << std::endl;
+        return std::make_shared<const std::string>(std::move(html));
+    }
+}
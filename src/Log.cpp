@@ -1,47 +1,187 @@
 #include "Log.hpp"
 
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+
 namespace ryuuk
 {
-    std::unique_ptr<Log> Log::m_instance = nullptr;
+    namespace
+    {
+        // How long the writer sleeps when it found nothing to write
+        const std::chrono::milliseconds IdleInterval{10};
+
+        struct RecordHeader
+        {
+            const char* file;       // A string literal, __FILENAME__, or null for raw text
+            std::uint32_t length;   // Of the text following the header
+            std::int32_t line;
+            std::int32_t level;
+        };
+
+        // A streambuf appending to a string, which the records of a thread are formatted into
+        class StringBuf : public std::streambuf
+        {
+        public:
+            std::string text;
+
+        private:
+            int overflow(int c) override
+            {
+                if (c != EOF)
+                    text.push_back(static_cast<char>(c));
+                return c;
+            }
+
+            std::streamsize xsputn(const char* s, std::streamsize n) override
+            {
+                text.append(s, n);
+                return n;
+            }
+        };
+
+        struct ThreadBuffer
+        {
+            ThreadBuffer() : out(&buf) {}
+            StringBuf buf;
+            std::ostream out;
+        };
+
+        ThreadBuffer& threadBuffer()
+        {
+            thread_local ThreadBuffer buffer;
+            return buffer;
+        }
+
+        std::size_t powerOf2AtLeast(std::size_t n)
+        {
+            std::size_t size = 1;
+            while (size < n)
+                size *= 2;
+            return size;
+        }
+
+        void writeAll(int fd, const char* data, std::size_t length)
+        {
+            while (length != 0)
+            {
+                auto written = ::write(fd, data, length);
+                if (written < 0 && errno == EINTR)
+                    continue;
+                if (written <= 0)
+                    return;
+                data += written;
+                length -= written;
+            }
+        }
+    }
 
-    LockedStream::LockedStream(std::ostream& out, std::mutex& mutex) : m_out(out),
-                                                                      m_mutex(mutex)
+    // A single-producer single-consumer byte queue: the owning thread writes at `head`, the writer reads at `tail`
+    struct Log::Ring
     {
-        m_mutex.lock();
+        explicit Ring(std::size_t capacity)
+            : data(capacity)
+            , mask(capacity - 1)
+        {}
+
+        void copyIn(std::uint64_t position, const void* source, std::size_t length)
+        {
+            auto offset = position & mask;
+            auto first = std::min(length, data.size() - offset);
+            std::memcpy(&data[offset], source, first);
+            std::memcpy(&data[0], static_cast<const char*>(source) + first, length - first);
+        }
+
+        void copyOut(std::uint64_t position, void* destination, std::size_t length) const
+        {
+            auto offset = position & mask;
+            auto first = std::min(length, data.size() - offset);
+            std::memcpy(destination, &data[offset], first);
+            std::memcpy(static_cast<char*>(destination) + first, &data[0], length - first);
+        }
+
+        std::vector<char> data;
+        const std::uint64_t mask;
+        Ring* next = nullptr;                       // Set before the ring is listed, then never changed
+        std::atomic<bool> owned{true};              // By a live thread
+
+        alignas(64) std::atomic<std::uint64_t> head{0};
+        std::uint64_t cachedTail = 0;               // The owner's last look at tail
+        std::atomic<std::uint64_t> dropped{0};
+
+        alignas(64) std::atomic<std::uint64_t> tail{0};
+        std::uint64_t reported = 0;                 // Dropped records the writer told about
+    };
+
+    LogRecord::LogRecord(Level level, const char* file, int line)
+        : m_out(threadBuffer().out)
+        , m_start(threadBuffer().buf.text.size())
+        , m_level(level)
+        , m_file(file)
+        , m_line(line)
+    {
+        // Don't let a previous record's manipulators carry over
+        m_out.flags(std::ios_base::dec | std::ios_base::skipws);
     }
 
-    LockedStream::~LockedStream()
+    LogRecord::~LogRecord()
     {
-        m_mutex.unlock();
+        auto& text = threadBuffer().buf.text;
+        if (text.size() == m_start || text.back() != '\n')
+            text.push_back('\n');
+        Log::get().push(m_level, m_file, m_line, text.data() + m_start, text.size() - m_start);
+        text.resize(m_start);
     }
 
-    LockedStream& LockedStream::operator<<(std::ostream& (*manip)(std::ostream&))
+    LogRecord& LogRecord::operator<<(std::ostream& (*manip)(std::ostream&))
     {
         m_out << manip;
         return *this;
     }
 
-    Log::~Log()
+    Log::Log()
+        : m_logLevel(INFO)
     {
-        //m_logStream->flush();
+        std::thread(&Log::run, this).detach();
     }
 
     Log& Log::get()
     {
-        if (!m_instance)
-            m_instance.reset(new Log);
-        return *m_instance;
+        // Never freed, so the (detached) writer can't outlive it during static destruction
+        static Log* instance = new Log;
+        return *instance;
     }
 
-    LockedStream Log::getStream()
+    void Log::configure(const Settings& settings)
     {
-//         return *m_logStream;
-        return LockedStream{*m_logStream, m_mutex};
+        m_block.store(settings.block, std::memory_order_relaxed);
+        // Rings already handed out keep their size
+        m_ringSize.store(powerOf2AtLeast(std::max<std::size_t>(settings.ringSize, 1024)), std::memory_order_relaxed);
+
+        std::lock_guard<std::mutex> lock(m_sinkMutex);
+        m_rotateSize = settings.rotateSize;
+        m_rotateKeep = settings.rotateKeep;
     }
 
-    void Log::setLogStream(std::ostream& stream)
+    bool Log::open(const std::string& path)
     {
-        m_logStream = &stream;
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+            return false;
+
+        std::lock_guard<std::mutex> lock(m_sinkMutex);
+        if (m_file >= 0)
+            ::close(m_file);
+        m_file = fd;
+        m_path = path;
+        m_fileSize = 0;
+        return true;
     }
 
     Log& Log::setLevel(Level level)
@@ -55,36 +195,162 @@ namespace ryuuk
         return m_logLevel;
     }
 
+    LogRecord Log::getStream()
+    {
+        return LogRecord{INFO, nullptr, 0};
+    }
+
+    Log::Ring& Log::threadRing()
+    {
+        // The ring goes back to the others when the thread exits, for the next thread to take over
+        struct Owner
+        {
+            Ring* ring = nullptr;
+            ~Owner()
+            {
+                if (ring)
+                    ring->owned.store(false, std::memory_order_release);
+            }
+        };
+        thread_local Owner owner;
+        if (owner.ring)
+            return *owner.ring;
 
+        for (auto ring = m_rings.load(std::memory_order_acquire); ring; ring = ring->next)
+        {
+            bool owned = false;
+            if (ring->owned.compare_exchange_strong(owned, true, std::memory_order_acq_rel))
+                return *(owner.ring = ring);
+        }
+
+        auto ring = new Ring(m_ringSize.load(std::memory_order_relaxed));
+        ring->next = m_rings.load(std::memory_order_relaxed);
+        while (!m_rings.compare_exchange_weak(ring->next, ring, std::memory_order_release, std::memory_order_relaxed))
+            ;
+        return *(owner.ring = ring);
+    }
 
-    TeeBuf::TeeBuf(std::streambuf * sb1, std::streambuf * sb2) :
-        m_sb1(sb1),
-        m_sb2(sb2)
-    {}
-    int TeeBuf::overflow(int c)
+    void Log::push(Level level, const char* file, int line, const char* text, std::size_t length)
     {
-        if (c == EOF)
+        auto& ring = threadRing();
+        length = std::min(length, ring.data.size() - sizeof(RecordHeader));
+        const std::uint64_t size = sizeof(RecordHeader) + length;
+
+        auto head = ring.head.load(std::memory_order_relaxed);
+        while (head + size - ring.cachedTail > ring.data.size())
+        {
+            ring.cachedTail = ring.tail.load(std::memory_order_acquire);
+            if (head + size - ring.cachedTail <= ring.data.size())
+                break;
+            if (!m_block.load(std::memory_order_relaxed))
+            {
+                ring.dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            std::this_thread::sleep_for(IdleInterval / 10);
+        }
+
+        RecordHeader header{file, static_cast<std::uint32_t>(length), line, level};
+        ring.copyIn(head, &header, sizeof(header));
+        ring.copyIn(head + sizeof(header), text, length);
+        ring.head.store(head + size, std::memory_order_release);
+    }
+
+    void Log::drain(Ring& ring, std::string& batch)
+    {
+        auto tail = ring.tail.load(std::memory_order_relaxed);
+        const auto head = ring.head.load(std::memory_order_acquire);
+        while (tail != head)
+        {
+            RecordHeader header;
+            ring.copyOut(tail, &header, sizeof(header));
+            if (header.file)
+            {
+                batch += toLevelString(static_cast<Level>(header.level));
+                batch += '[';
+                batch += header.file;
+                batch += ':';
+                batch += std::to_string(header.line);
+                batch += "] ";
+            }
+            auto start = batch.size();
+            batch.resize(start + header.length);
+            ring.copyOut(tail + sizeof(header), &batch[start], header.length);
+            tail += sizeof(header) + header.length;
+        }
+        ring.tail.store(tail, std::memory_order_release);
+
+        auto dropped = ring.dropped.load(std::memory_order_relaxed);
+        if (dropped != ring.reported)
         {
-            return !EOF;
+            batch += toLevelString(ERROR) + "[" __FILENAME__ "] " + std::to_string(dropped - ring.reported) +
+                     " log records dropped, the log couldn't keep up. Try a larger RingSize or Policy = block\n";
+            ring.reported = dropped;
         }
-        else
+    }
+
+    void Log::write(const std::string& batch)
+    {
+        std::lock_guard<std::mutex> lock(m_sinkMutex);
+        if (m_file < 0)
         {
-            int const r1 = m_sb1->sputc(c);
-            int const r2 = m_sb2->sputc(c);
-            return r1 == EOF || r2 == EOF ? EOF : c;
+            writeAll(STDERR_FILENO, batch.data(), batch.size());
+            return;
         }
+
+        writeAll(STDOUT_FILENO, batch.data(), batch.size());
+        writeAll(m_file, batch.data(), batch.size());
+        m_fileSize += batch.size();
+        if (m_rotateSize != 0 && m_fileSize >= m_rotateSize)
+            rotate();
     }
 
-    int TeeBuf::sync()
+    void Log::rotate()
     {
-        int const r1 = m_sb1->pubsync();
-        int const r2 = m_sb2->pubsync();
-        return r1 == 0 && r2 == 0 ? 0 : -1;
+        // file.N-1 -> file.N, ..., file -> file.1, then start a new file
+        if (m_rotateKeep == 0)
+            ::unlink(m_path.c_str());
+        for (unsigned i = m_rotateKeep; i > 0; --i)
+        {
+            auto from = i == 1 ? m_path : m_path + "." + std::to_string(i - 1);
+            std::rename(from.c_str(), (m_path + "." + std::to_string(i)).c_str());
+        }
+
+        int fd = ::open(m_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+        {
+            // Carry on in the rotated file rather than lose the log
+            const char message[] = "[ERROR][Log.cpp] Couldn't start a new log file after rotating it\n";
+            writeAll(STDERR_FILENO, message, sizeof(message) - 1);
+            return;
+        }
+        ::close(m_file);
+        m_file = fd;
+        m_fileSize = 0;
     }
 
-    TeeStream::TeeStream(std::ostream& o1, std::ostream& o2) :
-        std::ostream(&m_tbuf),
-        m_tbuf(o1.rdbuf(), o2.rdbuf())
-    {}
+    void Log::run()
+    {
+        std::string batch;
+        while (true)
+        {
+            batch.clear();
+            for (auto ring = m_rings.load(std::memory_order_acquire); ring; ring = ring->next)
+                drain(*ring, batch);
+            if (!batch.empty())
+                write(batch);
+            m_cycles.fetch_add(1, std::memory_order_release);
+
+            if (batch.empty())
+                std::this_thread::sleep_for(IdleInterval);
+        }
+    }
 
+    void Log::flush()
+    {
+        // The round going on may have missed records, the next one after it won't
+        auto target = m_cycles.load(std::memory_order_acquire) + 2;
+        while (m_cycles.load(std::memory_order_acquire) < target)
+            std::this_thread::sleep_for(IdleInterval / 10);
+    }
 }
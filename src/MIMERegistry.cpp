@@ -1,21 +1,187 @@
 #include "MIMERegistry.hpp"
+#include "Log.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <numeric>
+#include <sstream>
 
 namespace ryuuk
 {
     using namespace std::literals::string_view_literals;
     using namespace std::literals::string_literals;
 
-    std::unordered_map<std::string, std::string> MIMERegistry::mimeTypes {{""s, "application/octet-stream"s}};
+    namespace
+    {
+        constexpr std::uint32_t NoEntry = static_cast<std::uint32_t>(-1);
+
+        // Give up on a bucket after this many seeds and retry with a larger table
+        constexpr std::uint32_t MaxSeed = 1 << 16;
+
+        constexpr char toLower(char c)
+        {
+            return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+        }
+
+        std::string lowercase(std::string_view text)
+        {
+            std::string lower(text.size(), '\0');
+            std::transform(text.begin(), text.end(), lower.begin(), toLower);
+            return lower;
+        }
+
+        std::size_t powerOf2AtLeast(std::size_t n)
+        {
+            std::size_t size = 1;
+            while (size < n)
+                size *= 2;
+            return size;
+        }
+
+        // The type is what's between "Content-Type: " and "\r\n"
+        MIMERegistry::Type fromHeader(std::string_view header)
+        {
+            return {header.substr(14, header.size() - 16), header};
+        }
+
+        const MIMERegistry::Type Unknown = fromHeader("Content-Type: application/octet-stream\r\n");
+    }
+
+    std::unordered_map<std::string, std::string> MIMERegistry::pending;
+    std::vector<MIMERegistry::Entry> MIMERegistry::entries;
+    std::vector<std::uint32_t> MIMERegistry::seeds{0};
+    std::vector<std::uint32_t> MIMERegistry::slots{NoEntry};
+    bool MIMERegistry::frozen = false;
 
     void MIMERegistry::registerMIME(const std::string& extension, const std::string& mime)
     {
-        mimeTypes.emplace(extension, mime);
+        if (frozen)
+        {
+            LOG(ERROR) << "MIME type of " << extension << " registered after the table was built, ignored" << std::endl;
+            return;
+        }
+        pending.insert_or_assign(lowercase(extension), mime);
+    }
+
+    bool MIMERegistry::import(const std::string& path)
+    {
+        std::ifstream file(path);
+        if (!file)
+            return false;
+
+        std::size_t added = 0;
+        std::string line, type, extension;
+        while (std::getline(file, line))
+        {
+            std::istringstream fields(line.substr(0, line.find('#')));
+            if (!(fields >> type))
+                continue;
+            while (fields >> extension)
+                added += pending.emplace(lowercase(extension), type).second;
+        }
+        LOG(INFO) << "Imported " << added << " MIME types from " << path << std::endl;
+        return true;
     }
 
-    std::string MIMERegistry::fromExtension(const std::string& extension)
+    std::uint64_t MIMERegistry::hash(std::string_view key, std::uint64_t seed)
     {
-        auto it = mimeTypes.find(std::string{extension});
-        return it != mimeTypes.end() ? it->second : "application/octet-stream"s;
+        // FNV-1a over the lowercase key, then a murmur finalizer so that each seed scatters differently
+        std::uint64_t h = 0xcbf29ce484222325ull ^ (seed * 0x9e3779b97f4a7c15ull);
+        for (char c : key)
+        {
+            h ^= static_cast<unsigned char>(toLower(c));
+            h *= 0x100000001b3ull;
+        }
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        return h;
+    }
+
+    void MIMERegistry::freeze()
+    {
+        entries.clear();
+        entries.reserve(pending.size());
+        for (auto& [extension, type] : pending)
+            if (!extension.empty())
+                entries.push_back({extension, "Content-Type: " + type + "\r\n"});
+        pending.clear();
+        frozen = true;
+
+        // Hash and displace: extensions are split in buckets of ~4, then for each bucket, largest first,
+        // we look for a seed which hashes all of its extensions to free slots
+        const std::size_t bucketCount = powerOf2AtLeast(std::max<std::size_t>(entries.size() / 4, 1));
+        std::vector<std::vector<std::uint32_t>> buckets(bucketCount);
+        for (std::uint32_t i = 0; i < entries.size(); ++i)
+            buckets[hash(entries[i].extension, 0) & (bucketCount - 1)].push_back(i);
+
+        std::vector<std::uint32_t> order(bucketCount);
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&](std::uint32_t a, std::uint32_t b)
+        {
+            return buckets[a].size() > buckets[b].size();
+        });
+
+        std::size_t slotCount = powerOf2AtLeast(std::max<std::size_t>(2 * entries.size(), 1));
+        std::vector<std::size_t> placed;
+        for (;; slotCount *= 2)
+        {
+            seeds.assign(bucketCount, 0);
+            slots.assign(slotCount, NoEntry);
+            bool done = true;
+            for (auto bucket : order)
+            {
+                const auto& members = buckets[bucket];
+                if (members.empty())
+                    break;
+
+                std::uint32_t seed = 1;
+                for (; seed < MaxSeed; ++seed)
+                {
+                    placed.clear();
+                    for (auto member : members)
+                    {
+                        auto slot = hash(entries[member].extension, seed) & (slotCount - 1);
+                        if (slots[slot] != NoEntry || std::find(placed.begin(), placed.end(), slot) != placed.end())
+                            break;
+                        placed.push_back(slot);
+                    }
+                    if (placed.size() == members.size())
+                        break;
+                }
+                if (seed == MaxSeed)
+                {
+                    done = false;
+                    break;
+                }
+
+                seeds[bucket] = seed;
+                for (std::size_t i = 0; i < members.size(); ++i)
+                    slots[placed[i]] = members[i];
+            }
+            if (done)
+                break;
+        }
+
+        LOG(INFO) << "Built the MIME table, " << entries.size() << " extensions in " << slots.size() << " slots" << std::endl;
+    }
+
+    MIMERegistry::Type MIMERegistry::fromExtension(std::string_view extension)
+    {
+        auto seed = seeds[hash(extension, 0) & (seeds.size() - 1)];
+        if (seed == 0)
+            return Unknown;
+        auto index = slots[hash(extension, seed) & (slots.size() - 1)];
+        if (index == NoEntry)
+            return Unknown;
+
+        // Any extension hashes to some slot, it's only ours if it's the same
+        const auto& entry = entries[index];
+        if (entry.extension.size() != extension.size() ||
+            !std::equal(extension.begin(), extension.end(), entry.extension.begin(),
+                        [](char a, char b) { return toLower(a) == b; }))
+            return Unknown;
+        return fromHeader(entry.header);
     }
 
 }
@@ -0,0 +1,298 @@
+#include "Metrics.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdio>
+#include <memory>
+#include <utility>
+
+namespace ryuuk
+{
+    using metrics::Histogram;
+
+    namespace
+    {
+        // Upper bounds of the buckets a phase histogram is exposed with, in microseconds and as labels
+        const std::pair<std::uint64_t, const char*> ExposedBuckets[] = {
+            {100, "0.0001"}, {250, "0.00025"}, {500, "0.0005"},
+            {1000, "0.001"}, {2500, "0.0025"}, {5000, "0.005"},
+            {10000, "0.01"}, {25000, "0.025"}, {50000, "0.05"},
+            {100000, "0.1"}, {250000, "0.25"}, {500000, "0.5"},
+            {1000000, "1"}, {2500000, "2.5"}, {5000000, "5"}, {10000000, "10"},
+        };
+
+        const std::pair<double, const char*> Quantiles[] = {{0.5, "0.5"}, {0.9, "0.9"}, {0.99, "0.99"}, {0.999, "0.999"}};
+
+        const char* PhaseNames[] = {"parse", "resolve", "send"};
+
+        std::string seconds(std::uint64_t microseconds)
+        {
+            char text[32];
+            std::snprintf(text, sizeof(text), "%.6f", microseconds / 1e6);
+            return text;
+        }
+
+        void describe(std::string& out, const char* name, const char* type, const char* help)
+        {
+            ((((out += "# HELP ") += name) += ' ') += help) += '\n';
+            ((((out += "# TYPE ") += name) += ' ') += type) += '\n';
+        }
+
+        void sample(std::string& out, const char* name, const std::string& labels, const std::string& value)
+        {
+            out += name;
+            if (!labels.empty())
+                ((out += '{') += labels) += '}';
+            ((out += ' ') += value) += '\n';
+        }
+
+        // The sum of the blocks of all threads
+        struct Totals
+        {
+            std::uint64_t requests[metrics::MethodCount][metrics::StatusCount] = {};
+            std::uint64_t bytesIn = 0;
+            std::uint64_t bytesOut = 0;
+            std::uint64_t connectionsOpened = 0;
+            std::uint64_t connectionsClosed = 0;
+            std::uint64_t active = 0;
+            std::uint64_t reused = 0;
+            std::uint64_t parseErrors = 0;
+            std::array<std::uint64_t, Histogram::Buckets> phases[metrics::PhaseCount] = {};
+            std::uint64_t phaseSums[metrics::PhaseCount] = {};
+            std::uint64_t countedRequests = 0;
+            std::uint64_t events[Trace::MarkCount][PerfCounters::EventCount] = {};
+        };
+
+        std::string ratio(std::uint64_t numerator, std::uint64_t denominator)
+        {
+            if (denominator == 0)
+                return "NaN";
+            char text[32];
+            std::snprintf(text, sizeof(text), "%.3f", double(numerator) / double(denominator));
+            return text;
+        }
+    }
+
+    void Metrics::Local::observe(const accesslog::Record& record)
+    {
+        auto method = record.method < metrics::MethodCount ? record.method : 0;
+        requests[method][metrics::statusIndex(record.status)].add();
+        phases[metrics::Parse].record(record.parse);
+        phases[metrics::Resolve].record(record.respond);
+        phases[metrics::Send].record(record.send);
+    }
+
+    void Metrics::Local::count(const PerfCounters::Reading (&counters)[Trace::MarkCount])
+    {
+        // A phase whose mark wasn't reached is part of the next one, as in the Trace
+        int previous = -1;
+        for (int mark = 0; mark < Trace::MarkCount; ++mark)
+        {
+            if (!counters[mark].taken)
+                continue;
+            if (previous >= 0)
+                for (int e = 0; e < PerfCounters::EventCount; ++e)
+                    events[mark][e].add(counters[mark].count[e] - counters[previous].count[e]);
+            previous = mark;
+        }
+        countedRequests.add();
+    }
+
+    Metrics& Metrics::get()
+    {
+        static Metrics instance;
+        return instance;
+    }
+
+    Metrics::Local& Metrics::local()
+    {
+        // The block goes back to the others when the thread exits, for the next thread to take over
+        struct Owner
+        {
+            Local* block = nullptr;
+            ~Owner()
+            {
+                if (block)
+                {
+                    block->setActive(false);
+                    block->owned.store(false, std::memory_order_release);
+                }
+            }
+        };
+        thread_local Owner owner;
+        if (owner.block)
+            return *owner.block;
+
+        auto& blocks = get().m_blocks;
+        for (auto block = blocks.load(std::memory_order_acquire); block; block = block->next)
+        {
+            bool owned = false;
+            if (block->owned.compare_exchange_strong(owned, true, std::memory_order_acq_rel))
+                return *(owner.block = block);
+        }
+
+        auto block = new Local;
+        block->next = blocks.load(std::memory_order_relaxed);
+        while (!blocks.compare_exchange_weak(block->next, block, std::memory_order_release, std::memory_order_relaxed))
+            ;
+        return *(owner.block = block);
+    }
+
+    void Metrics::configure(const Settings& settings)
+    {
+        m_settings = settings;
+        PerfCounters::configure(settings.perfSampleRate);
+    }
+
+    std::string Metrics::render() const
+    {
+        auto totals = std::make_unique<Totals>();
+        for (auto block = m_blocks.load(std::memory_order_acquire); block; block = block->next)
+        {
+            for (std::size_t m = 0; m < metrics::MethodCount; ++m)
+                for (std::size_t s = 0; s < metrics::StatusCount; ++s)
+                    totals->requests[m][s] += block->requests[m][s].get();
+            totals->bytesIn += block->bytesIn.get();
+            totals->bytesOut += block->bytesOut.get();
+            totals->connectionsOpened += block->connectionsOpened.get();
+            totals->connectionsClosed += block->connectionsClosed.get();
+            totals->active += block->active.get();
+            totals->reused += block->reused.get();
+            totals->parseErrors += block->parseErrors.get();
+            for (std::size_t p = 0; p < metrics::PhaseCount; ++p)
+            {
+                for (std::size_t b = 0; b < Histogram::Buckets; ++b)
+                    totals->phases[p][b] += block->phases[p].counts[b].get();
+                totals->phaseSums[p] += block->phases[p].sum.get();
+            }
+            totals->countedRequests += block->countedRequests.get();
+            for (std::size_t m = 0; m < Trace::MarkCount; ++m)
+                for (std::size_t e = 0; e < PerfCounters::EventCount; ++e)
+                    totals->events[m][e] += block->events[m][e].get();
+        }
+
+        std::string out;
+        out.reserve(16 * 1024);
+
+        describe(out, "ryuuk_http_requests_total", "counter", "Responses sent, by request method and status code.");
+        for (std::size_t m = 0; m < metrics::MethodCount; ++m)
+        {
+            for (std::size_t s = 0; s < metrics::StatusCount; ++s)
+            {
+                if (totals->requests[m][s] == 0)
+                    continue;
+                std::string labels = "method=\"";
+                labels += m == accesslog::Other ? "other" : accesslog::MethodNames[m];
+                labels += "\",code=\"";
+                labels += s < std::size(metrics::StatusCodes) ? std::to_string(metrics::StatusCodes[s]) : "other";
+                labels += '"';
+                sample(out, "ryuuk_http_requests_total", labels, std::to_string(totals->requests[m][s]));
+            }
+        }
+
+        describe(out, "ryuuk_received_bytes_total", "counter", "Bytes received on client connections, after TLS.");
+        sample(out, "ryuuk_received_bytes_total", {}, std::to_string(totals->bytesIn));
+        describe(out, "ryuuk_sent_bytes_total", "counter", "Bytes sent on client connections, before TLS.");
+        sample(out, "ryuuk_sent_bytes_total", {}, std::to_string(totals->bytesOut));
+
+        // Read apart from the others, a connection may have opened in between
+        auto open = totals->connectionsOpened - std::min(totals->connectionsClosed, totals->connectionsOpened);
+        describe(out, "ryuuk_connections", "gauge", "Client connections open, handling requests or idle between them.");
+        sample(out, "ryuuk_connections", "state=\"active\"", std::to_string(totals->active));
+        sample(out, "ryuuk_connections", "state=\"idle\"", std::to_string(open - std::min(totals->active, open)));
+        describe(out, "ryuuk_connections_total", "counter", "Client connections accepted.");
+        sample(out, "ryuuk_connections_total", {}, std::to_string(totals->connectionsOpened));
+        describe(out, "ryuuk_connection_reuses_total", "counter",
+                 "Requests on a connection which answered one already, kept alive or multiplexed.");
+        sample(out, "ryuuk_connection_reuses_total", {}, std::to_string(totals->reused));
+        describe(out, "ryuuk_parse_errors_total", "counter",
+                 "Malformed requests, and HTTP/2 connections closed for an error of the client.");
+        sample(out, "ryuuk_parse_errors_total", {}, std::to_string(totals->parseErrors));
+
+        // Buckets are counted towards an exposed bound when all their values are under it
+        describe(out, "ryuuk_request_phase_seconds", "histogram",
+                 "Time spent on requests: parsing it, resolving and creating the response, and sending it.");
+        for (std::size_t p = 0; p < metrics::PhaseCount; ++p)
+        {
+            const std::string phase = std::string("phase=\"") + PhaseNames[p] + '"';
+            const auto& counts = totals->phases[p];
+            std::uint64_t cumulative = 0;
+            std::size_t b = 0;
+            for (auto [bound, label] : ExposedBuckets)
+            {
+                for (; b < Histogram::Buckets && Histogram::highestOf(b) <= bound; ++b)
+                    cumulative += counts[b];
+                sample(out, "ryuuk_request_phase_seconds_bucket", phase + ",le=\"" + label + '"',
+                       std::to_string(cumulative));
+            }
+            for (; b < Histogram::Buckets; ++b)
+                cumulative += counts[b];
+            sample(out, "ryuuk_request_phase_seconds_bucket", phase + ",le=\"+Inf\"", std::to_string(cumulative));
+            sample(out, "ryuuk_request_phase_seconds_sum", phase, seconds(totals->phaseSums[p]));
+            sample(out, "ryuuk_request_phase_seconds_count", phase, std::to_string(cumulative));
+        }
+
+        describe(out, "ryuuk_request_phase_quantile_seconds", "gauge",
+                 "Quantiles of the time spent on request phases since the start, to within 1/16th of their value.");
+        for (std::size_t p = 0; p < metrics::PhaseCount; ++p)
+        {
+            const std::string phase = std::string("phase=\"") + PhaseNames[p] + '"';
+            const auto& counts = totals->phases[p];
+            std::uint64_t count = 0;
+            for (auto n : counts)
+                count += n;
+
+            for (auto [quantile, label] : Quantiles)
+            {
+                std::string value = "NaN";
+                const auto rank = std::max<std::uint64_t>(static_cast<std::uint64_t>(std::ceil(quantile * count)), 1);
+                std::uint64_t cumulative = 0;
+                for (std::size_t b = 0; count != 0 && b < Histogram::Buckets; ++b)
+                {
+                    cumulative += counts[b];
+                    if (cumulative >= rank)
+                    {
+                        value = seconds(Histogram::highestOf(b));
+                        break;
+                    }
+                }
+                sample(out, "ryuuk_request_phase_quantile_seconds", phase + ",quantile=\"" + label + '"', value);
+            }
+        }
+
+        if (!PerfCounters::enabled())
+            return out;
+
+        // Of the phases of the Trace, but the first: the request's first bytes are received before it's counted
+        auto labels = [](std::size_t mark, std::size_t event)
+        {
+            return std::string("phase=\"") + Trace::PhaseNames[mark] + "\",event=\"" + PerfCounters::EventNames[event] + '"';
+        };
+        describe(out, "ryuuk_perf_counted_requests_total", "counter",
+                 "Requests whose hardware events were counted, a sample of them.");
+        sample(out, "ryuuk_perf_counted_requests_total", {}, std::to_string(totals->countedRequests));
+        describe(out, "ryuuk_perf_events_total", "counter",
+                 "Hardware events in user space during the phases of counted requests.");
+        for (std::size_t m = Trace::Parsed; m < Trace::MarkCount; ++m)
+            for (std::size_t e = 0; e < PerfCounters::EventCount; ++e)
+                if (PerfCounters::counts(PerfCounters::Event(e)))
+                    sample(out, "ryuuk_perf_events_total", labels(m, e), std::to_string(totals->events[m][e]));
+        describe(out, "ryuuk_perf_events_per_request", "gauge",
+                 "Hardware events in user space per counted request, by phase, since the start.");
+        for (std::size_t m = Trace::Parsed; m < Trace::MarkCount; ++m)
+            for (std::size_t e = 0; e < PerfCounters::EventCount; ++e)
+                if (PerfCounters::counts(PerfCounters::Event(e)))
+                    sample(out, "ryuuk_perf_events_per_request", labels(m, e),
+                           ratio(totals->events[m][e], totals->countedRequests));
+
+        if (!PerfCounters::counts(PerfCounters::Cycles) || !PerfCounters::counts(PerfCounters::Instructions))
+            return out;
+        describe(out, "ryuuk_perf_instructions_per_cycle", "gauge",
+                 "Instructions retired per cycle during the phases of counted requests, since the start.");
+        for (std::size_t m = Trace::Parsed; m < Trace::MarkCount; ++m)
+            sample(out, "ryuuk_perf_instructions_per_cycle", std::string("phase=\"") + Trace::PhaseNames[m] + '"',
+                   ratio(totals->events[m][PerfCounters::Instructions], totals->events[m][PerfCounters::Cycles]));
+        return out;
+    }
+}
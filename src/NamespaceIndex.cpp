@@ -0,0 +1,343 @@
+#include "NamespaceIndex.hpp"
+#include "DirectoryListing.hpp"
+#include "DocumentRoot.hpp"
+#include "Log.hpp"
+
+#include <chrono>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace ryuuk
+{
+    namespace
+    {
+        // Changes are batched until there has been none for Quiet, or for at most Deferral since the first
+        const std::chrono::milliseconds Quiet{200};
+        const std::chrono::milliseconds Deferral{2000};
+
+        constexpr std::uint32_t WatchMask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY |
+                                            IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF |
+                                            IN_ONLYDIR;
+
+        // "./a/b/" as a key of the tree: "a/b"
+        void toKey(std::string_view location, std::string& key)
+        {
+            std::size_t start = 0;
+            while (start < location.size() &&
+                   (location[start] == '/' ||
+                    (location[start] == '.' && (start + 1 == location.size() || location[start + 1] == '/'))))
+                ++start;
+            location.remove_prefix(start);
+            while (!location.empty() && location.back() == '/')
+                location.remove_suffix(1);
+            key.assign(location);
+        }
+
+        // Rough size of a tree in memory, as libstdc++ lays out unordered_map and strings
+        std::size_t memoryUsage(const std::unordered_map<std::string, NamespaceIndex::Node>& tree)
+        {
+            std::size_t bytes = tree.bucket_count() * sizeof(void*);
+            for (const auto& [path, node] : tree)
+            {
+                // Each element has a next pointer and its cached hash besides the pair
+                bytes += sizeof(std::pair<const std::string, NamespaceIndex::Node>) + 2 * sizeof(void*);
+                if (path.capacity() > 15)
+                    bytes += path.capacity() + 1;
+            }
+            return bytes;
+        }
+    }
+
+    NamespaceIndex& NamespaceIndex::get()
+    {
+        // Never freed, so the (detached) thread can't outlive it during static destruction
+        static NamespaceIndex* instance = new NamespaceIndex;
+        return *instance;
+    }
+
+    void NamespaceIndex::configure(bool enabled, std::size_t maxEntries)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_enabled = enabled;
+        m_maxEntries = maxEntries;
+        if (!enabled)
+            std::atomic_store(&m_snapshot, std::shared_ptr<const Snapshot>{});
+        else if (!m_running)
+        {
+            m_running = true;
+            std::thread(&NamespaceIndex::run, this).detach();
+        }
+    }
+
+    void NamespaceIndex::publish(std::shared_ptr<const Tree> tree, const std::unordered_set<std::string>& dirty)
+    {
+        auto snapshot = std::make_shared<Snapshot>();
+        snapshot->tree = std::move(tree);
+        snapshot->dirty = dirty;
+
+        // Under the lock so a snapshot can't be published after configure() has withdrawn it
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_enabled)
+            std::atomic_store(&m_snapshot, std::shared_ptr<const Snapshot>{std::move(snapshot)});
+    }
+
+    bool NamespaceIndex::pending(const Snapshot& snapshot, std::string_view path)
+    {
+        const auto& dirty = snapshot.dirty;
+        if (dirty.empty())
+            return false;
+        // The directory itself and each of its ancestors
+        thread_local std::string prefix;
+        for (std::size_t end = 0; ; ++end)
+        {
+            end = std::min(path.find('/', end), path.size());
+            prefix.assign(path.substr(0, end));
+            if (dirty.count(prefix) || dirty.count(""))
+                return true;
+            if (end == path.size())
+                return false;
+        }
+    }
+
+    bool NamespaceIndex::lookup(std::string_view location, Node& node) const
+    {
+        thread_local std::string key;
+        toKey(location, key);
+
+        // Whatever the background thread publishes meanwhile, this one stays alive until we return
+        auto snapshot = std::atomic_load(&m_snapshot);
+        if (!snapshot || pending(*snapshot, key))
+            return false;
+
+        const auto& tree = *snapshot->tree;
+        if (auto it = tree.find(key); it != tree.end())
+        {
+            node = it->second;
+            return !node.link;
+        }
+
+        // It isn't there, unless the closest ancestor that is there hides it: a link or a directory we couldn't read
+        while (!key.empty())
+        {
+            auto slash = key.rfind('/');
+            key.resize(slash == std::string::npos ? 0 : slash);
+            if (auto it = tree.find(key); it != tree.end())
+            {
+                if (it->second.link || !it->second.complete)
+                    return false;
+                node = Node{};
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::unique_ptr<NamespaceIndex::Tree> NamespaceIndex::build(int notify, std::unordered_map<int, std::string>& watches)
+    {
+        std::size_t maxEntries;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            maxEntries = m_maxEntries;
+        }
+
+        auto tree = std::make_unique<Tree>();
+        (*tree)[""] = Node{Directory};
+        std::vector<std::string> directories{""};     // To be read
+        while (!directories.empty())
+        {
+            auto path = std::move(directories.back());
+            directories.pop_back();
+
+            bool complete = false, hasIndex = false;
+            int fd = DocumentRoot::get().openBeneath(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+            if (fd >= 0)
+            {
+                // Watched through the descriptor, so it's the directory we're reading even if it's moved meanwhile
+                int watch = inotify_add_watch(notify, ("/proc/self/fd/" + std::to_string(fd)).c_str(), WatchMask);
+                if (watch < 0)
+                    LOG(ERROR) << "Couldn't watch " << (path.empty() ? "." : path) << " for changes, errno: " << errno
+                               << ". Raise fs.inotify.max_user_watches for larger trees" << std::endl;
+                else
+                    watches[watch] = path;
+
+                struct statx stx;
+                if (statx(fd, "", AT_EMPTY_PATH, STATX_BASIC_STATS, &stx) == 0)
+                {
+                    auto& self = (*tree)[path];
+                    self.size  = stx.stx_size;
+                    self.inode = stx.stx_ino;
+                    self.mtime = stx.stx_mtime.tv_sec * 1000000000LL + stx.stx_mtime.tv_nsec;
+                }
+
+                DirectoryReader reader(fd);
+                try
+                {
+                    // Entries of directories we can't keep current aren't indexed, they're left to the file system
+                    complete = watch >= 0 && reader.isOpen();
+                    for (auto batch = &reader.nextBatch(); complete && !batch->empty(); batch = &reader.nextBatch())
+                    {
+                        for (const auto& entry : *batch)
+                        {
+                            if (entry.name == "." || entry.name == "..")
+                                continue;
+                            if (tree->size() >= maxEntries)
+                            {
+                                ::close(fd);
+                                return nullptr;
+                            }
+
+                            Node node;
+                            std::string name{entry.name};
+                            if (statx(fd, name.c_str(), AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS, &stx) != 0)
+                            {
+                                // Gone since it was listed, a pending change will catch up with it
+                                continue;
+                            }
+                            node.link  = S_ISLNK(stx.stx_mode);
+                            node.type  = S_ISDIR(stx.stx_mode) ? Directory : S_ISREG(stx.stx_mode) ? Regular : Other;
+                            node.size  = stx.stx_size;
+                            node.inode = stx.stx_ino;
+                            node.mtime = stx.stx_mtime.tv_sec * 1000000000LL + stx.stx_mtime.tv_nsec;
+                            hasIndex = hasIndex || (name == "index.html" && node.type == Regular);
+
+                            auto child = path.empty() ? name : path + "/" + name;
+                            if (node.type == Directory && !node.link)
+                                directories.push_back(child);
+                            tree->emplace(std::move(child), node);
+                        }
+                    }
+                }
+                catch (const std::runtime_error& e)
+                {
+                    LOG(ERROR) << "Couldn't index " << (path.empty() ? "." : path) << ": " << e.what() << std::endl;
+                    complete = false;
+                }
+                ::close(fd);
+            }
+
+            auto& self = (*tree)[path];
+            self.complete = complete;
+            self.hasIndex = hasIndex;
+        }
+        return tree;
+    }
+
+    void NamespaceIndex::run()
+    {
+        int notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (notify < 0)
+        {
+            LOG(ERROR) << "inotify_init1() failed with errno " << errno << ", the document root won't be indexed" << std::endl;
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_running = false;
+            return;
+        }
+
+        std::unordered_map<int, std::string> watches;     // Directory of each watch descriptor
+        alignas(inotify_event) char buffer[64 * 1024];
+
+        // Mark the directories of the queued events as changed, returns false if there were none
+        auto readEvents = [&](std::unordered_set<std::string>& dirty)
+        {
+            bool any = false;
+            ssize_t bytes;
+            while ((bytes = ::read(notify, buffer, sizeof(buffer))) > 0)
+            {
+                for (char* position = buffer; position < buffer + bytes; )
+                {
+                    auto event = reinterpret_cast<const inotify_event*>(position);
+                    position += sizeof(inotify_event) + event->len;
+                    any = true;
+
+                    auto watch = watches.find(event->wd);
+                    if (event->mask & IN_IGNORED)
+                    {
+                        if (watch != watches.end())
+                            watches.erase(watch);
+                    }
+                    else if (event->mask & IN_Q_OVERFLOW || watch == watches.end())
+                        dirty.insert("");   // We don't know what changed, so everything did
+                    else
+                        dirty.insert(watch->second);
+                }
+            }
+            return any;
+        };
+
+        // Owned by this thread, lookups see them as they were last published
+        std::shared_ptr<const Tree> current;
+        std::unordered_set<std::string> dirty;
+        bool rebuild = true;
+        auto firstChange = std::chrono::steady_clock::now();
+        while (true)
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (!m_enabled)
+                    break;
+            }
+
+            if (rebuild)
+            {
+                rebuild = false;
+                auto start = std::chrono::steady_clock::now();
+                // Watches of directories that still exist are handed out again, with the same descriptor
+                auto tree = build(notify, watches);
+                if (!tree)
+                {
+                    LOG(ERROR) << "The document root has more paths than IndexTreeMaxEntries, it won't be indexed" << std::endl;
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    std::atomic_store(&m_snapshot, std::shared_ptr<const Snapshot>{});
+                    m_enabled = false;
+                    break;
+                }
+
+                auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+                auto bytes = memoryUsage(*tree);
+                LOG(INFO) << "Indexed " << tree->size() << " paths of the document root in " << elapsed.count() << " ms, "
+                          << bytes / 1024 << " KB in memory, " << bytes / tree->size() << " bytes per path" << std::endl;
+
+                // What changed while we were reading the tree may or may not be in it
+                dirty.clear();
+                readEvents(dirty);
+                if (!dirty.empty())
+                    firstChange = std::chrono::steady_clock::now();
+                // Readers of the old tree keep it until they're done with it
+                current = std::move(tree);
+                publish(current, dirty);
+            }
+
+            bool waiting = !dirty.empty();
+            pollfd ready{notify, POLLIN, 0};
+            auto timeout = waiting ? static_cast<int>(Quiet.count()) : -1;
+            if (::poll(&ready, 1, timeout) > 0)
+            {
+                std::unordered_set<std::string> changed;
+                if (readEvents(changed) && !changed.empty())
+                {
+                    if (dirty.empty())
+                        firstChange = std::chrono::steady_clock::now();
+                    auto count = dirty.size();
+                    dirty.merge(changed);
+                    // The tree is shared with the snapshot it replaces, only the changes are copied
+                    if (dirty.size() != count)
+                        publish(current, dirty);
+                }
+                // Don't wait for a quiet moment forever
+                rebuild = waiting && std::chrono::steady_clock::now() - firstChange > Deferral;
+            }
+            else
+                rebuild = waiting;
+        }
+
+        ::close(notify);
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_running = false;
+    }
+}
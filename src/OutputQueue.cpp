@@ -0,0 +1,79 @@
+#include "OutputQueue.hpp"
+#include "Log.hpp"
+#include "Metrics.hpp"
+
+#include <algorithm>
+
+namespace ryuuk
+{
+    OutputQueue::OutputQueue(std::size_t capacity)
+        : m_responses(std::max<std::size_t>(capacity, 1))
+    {}
+
+    Response& OutputQueue::prepare()
+    {
+        auto& response = m_responses[(m_first + m_count) % m_responses.size()];
+        response.reset();
+        return response;
+    }
+
+    void OutputQueue::push()
+    {
+        ++m_count;
+    }
+
+    bool OutputQueue::flush(SocketStream& socket)
+    {
+        while (m_count != 0)
+        {
+            auto& response = m_responses[m_first];
+            if (!m_sending)
+            {
+                m_chunk = response.nextChunk();
+                if (m_chunk.empty())
+                {
+                    response.markSent(m_sent, socket.clientAddress());
+                    m_sent = 0;
+
+                    // Let go of the file while the connection idles, the buffers are kept
+                    response.reset();
+                    m_first = (m_first + 1) % m_responses.size();
+                    --m_count;
+                    continue;
+                }
+                m_sending = true;
+            }
+
+            if (!m_chunk.data.empty() || !m_chunk.tail.empty())
+            {
+                // Cork the headers with the file slice following them, so they can share a segment
+                auto sent = socket.sendSome(m_chunk.data, m_chunk.tail, m_chunk.more || m_chunk.length != 0);
+                if (sent < 0)
+                    return false;
+                m_sent += sent;
+                Metrics::local().bytesOut.add(sent);
+                auto fromData = std::min<std::size_t>(sent, m_chunk.data.size());
+                m_chunk.data.remove_prefix(fromData);
+                m_chunk.tail.remove_prefix(sent - fromData);
+                if (!m_chunk.data.empty() || !m_chunk.tail.empty())
+                    return true;
+            }
+
+            if (m_chunk.length != 0)
+            {
+                auto sent = socket.sendFileSome(m_chunk.fd, m_chunk.offset, m_chunk.length);
+                if (sent < 0)
+                    return false;
+                m_sent += sent;
+                Metrics::local().bytesOut.add(sent);
+                m_chunk.offset += sent;
+                m_chunk.length -= sent;
+                if (m_chunk.length != 0)
+                    return true;
+            }
+
+            m_sending = false;
+        }
+        return true;
+    }
+}
@@ -0,0 +1,136 @@
+#include "PerfCounters.hpp"
+#include "Log.hpp"
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace ryuuk
+{
+    namespace
+    {
+        const std::pair<std::uint32_t, std::uint64_t> EventTypes[PerfCounters::EventCount] = {
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+        };
+
+        // Of all threads, to sample 1 in s_sampleRate requests however short lived the connections are
+        std::atomic<std::uint64_t> requests{0};
+
+        // The counters of a thread, in one group led by the first one that opened
+        struct Group
+        {
+            int fds[PerfCounters::EventCount];
+            PerfCounters::Event events[PerfCounters::EventCount];      // Of the counters, in the order they're read
+            int opened = 0;
+            bool tried = false;
+            int error = 0;                                             // Of the first counter that didn't open
+
+            bool open()
+            {
+                tried = true;
+                for (int e = 0; e < PerfCounters::EventCount; ++e)
+                {
+                    perf_event_attr attr{};
+                    attr.size = sizeof(attr);
+                    attr.type = EventTypes[e].first;
+                    attr.config = EventTypes[e].second;
+                    attr.read_format = PERF_FORMAT_GROUP;
+                    attr.exclude_kernel = 1;
+                    attr.exclude_hv = 1;
+                    int fd = ::syscall(SYS_perf_event_open, &attr, 0, -1, opened ? fds[0] : -1, PERF_FLAG_FD_CLOEXEC);
+                    if (fd < 0)
+                    {
+                        error = error ? error : errno;
+                        continue;
+                    }
+                    fds[opened] = fd;
+                    events[opened++] = PerfCounters::Event(e);
+                }
+                return opened != 0;
+            }
+
+            void close()
+            {
+                for (int i = 0; i < opened; ++i)
+                    ::close(fds[i]);
+                opened = 0;
+            }
+
+            ~Group() { close(); }
+        };
+
+        thread_local Group group;
+    }
+
+    bool PerfCounters::s_enabled = false;
+    unsigned PerfCounters::s_sampleRate = 0;
+    unsigned PerfCounters::s_events = 0;
+
+    void PerfCounters::configure(unsigned sampleRate)
+    {
+        s_enabled = false;
+        s_sampleRate = sampleRate;
+        s_events = 0;
+        if (sampleRate == 0)
+            return;
+
+        // Threads open counters of their own, this only tells whether they can
+        Group probe;
+        if (!probe.open())
+        {
+            LOG(INFO) << "Hardware counters are unavailable (" << std::strerror(probe.error)
+                      << "), requests aren't counted" << std::endl;
+            return;
+        }
+
+        std::string counted;
+        for (int i = 0; i < probe.opened; ++i)
+        {
+            (counted += counted.empty() ? "" : ", ") += EventNames[probe.events[i]];
+            s_events |= 1u << probe.events[i];
+        }
+        LOG(INFO) << "Counting " << counted << " of 1 in " << sampleRate << " requests" << std::endl;
+        if (probe.opened != EventCount)
+        {
+            LOG(INFO) << "Some hardware counters are unavailable (" << std::strerror(probe.error)
+                      << "), their events aren't counted" << std::endl;
+        }
+        s_enabled = true;
+    }
+
+    bool PerfCounters::sample()
+    {
+        if (!s_enabled || requests.fetch_add(1, std::memory_order_relaxed) % s_sampleRate != 0)
+            return false;
+
+        if (!group.tried && !group.open())
+        {
+            LOG(DEBUG) << "Couldn't open the hardware counters of a thread, errno: " << group.error << std::endl;
+        }
+        return group.opened != 0;
+    }
+
+    bool PerfCounters::read(Reading& reading)
+    {
+        // The number of counters, then their values
+        std::uint64_t values[1 + EventCount];
+        if (group.opened == 0)
+            return false;
+        auto length = ::read(group.fds[0], values, sizeof(values));
+        if (length < static_cast<ssize_t>(sizeof(std::uint64_t) * (1 + group.opened)))
+            return false;
+
+        for (int i = 0; i < group.opened; ++i)
+            reading.count[group.events[i]] = values[1 + i];
+        reading.taken = true;
+        return true;
+    }
+}
@@ -2,23 +2,31 @@
 #include "Log.hpp"
 #include "Utility.hpp"
 #include "MIMERegistry.hpp"
+#include "ListingCache.hpp"
+#include "DirectoryListing.hpp"
+#include "Template.hpp"
+#include "CachePolicy.hpp"
+#include "Metrics.hpp"
 
+#include <algorithm>
+#include <array>
+#include <cstdio>
 #include <exception>
-#include <fstream>
+#include <random>
 #include <vector>
 #include <ctime>
 #include <sys/types.h>
 #include <dirent.h>
+#include <unistd.h>
 #include <string>
-#include <filesystem>
 
 namespace
 {
-    std::string file_extension(std::string_view location)
+    std::string_view file_extension(std::string_view location)
     {
         auto ext = location.substr(location.find_last_of('/'));
         if (auto pos = ext.find_last_of('.'); pos != std::string_view::npos)
-            return std::string{ext.substr(pos + 1)};
+            return ext.substr(pos + 1);
         return {};
     }
 }
@@ -26,84 +34,218 @@ namespace
 namespace ryuuk
 {
     using namespace std::literals::string_literals;
-    namespace fs = std::filesystem;
 
     const std::unordered_map<ResponseCreator::StatusCode, std::string, std::hash<int>> ResponseCreator::responsePhrase = {
                     {OK,                "OK"},
+                    {PartialContent,    "Partial Content"},
                     {MovedPermanently,  "Moved Permanently"},
+                    {NotModified,       "Not Modified"},
                     {BadRequest,        "Bad Request"},
                     {Forbidden,         "Forbidden"},
                     {NotFound,          "Not Found"},
                     {MethodNotAllowed,  "Method Not Allowed"},
-                    {InternalError,     "Internal Server Error"}
+                    {NotAcceptable,     "Not Acceptable"},
+                    {PreconditionFailed, "Precondition Failed"},
+                    {RangeNotSatisfiable, "Range Not Satisfiable"},
+                    {InternalError,     "Internal Server Error"},
+                    {ServiceUnavailable, "Service Unavailable"}
     };
 
     const std::string ResponseCreator::serverName = "ryuuk/0.2";
 
-    std::string_view SimpleResponse::nextChunk()
+    ResponseCreator::Settings ResponseCreator::settings;
+
+    std::unordered_map<int, ResponseCreator::Prebuilt> ResponseCreator::prebuilt;
+
+    void ResponseCreator::configure(const Settings& newSettings)
     {
-        if (!end)
+        settings = newSettings;
+    }
+
+    void ResponseCreator::prerender()
+    {
+        const auto& pages = PageTemplates::get();
+        prebuilt.clear();
+        for (const auto& [code, phrase] : responsePhrase)
         {
-            end = true;
-            return m_responseString;
+            // Redirects and errors, the others have headers and bodies of their own
+            if (code < MovedPermanently || code == NotModified)
+                continue;
+
+            std::string html;
+            pages.errorPage(code).render(html, {std::to_string(code), phrase});
+
+            std::string head;
+            if (code == MethodNotAllowed)
+                head += "Allow: GET, HEAD\r\n";
+            else if (code == ServiceUnavailable)
+                head += "Retry-After: 5\r\n";
+            head += "Content-Type: text/html\r\n"
+                    "Content-Length: " + std::to_string(html.size()) + "\r\n\r\n";
+            prebuilt[code] = {std::make_shared<const std::string>(head + html),
+                              std::make_shared<const std::string>(head)};
         }
-        return {};
+        LOG(INFO) << "Prerendered " << prebuilt.size() << " error and redirect responses" << std::endl;
     }
 
-    FileResponse::FileResponse(std::string&& httpPrefix, const std::string& location)
-        : m_file(location)
-        , m_data(std::move(httpPrefix))
-        , m_responseSize(fs::file_size(fs::path{location}) + m_data.size())
-    {}
+    void Response::reset()
+    {
+        m_kind = Text;
+        m_text.clear();
+        m_file.reset();
+        m_slices.clear();
+        m_mapping.reset();
+        m_body.reset();
+        m_generator.reset();
+        m_next = 0;
+    }
 
-    const static std::size_t ChunkMaxSize = 128 * 1024 * 1024; // 64 MB
+    void Response::addFileSlice(const FileCache::Handle& file, off_t offset, std::size_t length)
+    {
+        m_kind = FileSlices;
+        m_file = file;
+        m_slices.push_back({m_text.size(), offset, length});
+    }
 
-    std::string_view FileResponse::nextChunk()
+    void Response::setMapping(std::shared_ptr<const FileMapping> mapping)
     {
-        switch(m_state)
+        m_kind = Mapped;
+        m_mapping = std::move(mapping);
+    }
+
+    void Response::setBody(std::shared_ptr<const std::string> body)
+    {
+        m_kind = Body;
+        m_body = std::move(body);
+    }
+
+    void Response::setGenerator(std::unique_ptr<ChunkGenerator> generator)
+    {
+        m_kind = Generated;
+        m_generator = std::move(generator);
+    }
+
+    namespace
+    {
+        std::uint32_t microseconds(std::uint64_t nanoseconds)
         {
-            case State::Uninitialized:
-            {
-                std::size_t offset = m_data.size();
-                m_data.resize(std::min(ChunkMaxSize, m_responseSize));
-                try {
-                    m_file.read(&m_data[offset], m_data.size() - offset);
-                    m_transferred += m_data.size();
-                } catch (const std::ios_base::failure& e) {
-                    return {};
-                    m_state = State::Finished;
+            return static_cast<std::uint32_t>(std::min<std::uint64_t>(nanoseconds / 1000, UINT32_MAX));
+        }
+    }
+
+    void Response::markReceived()
+    {
+        m_record = {};
+        if (AccessLog::get().enabled())
+            m_record.time = AccessLog::wallclockNow();
+        m_received = m_phase = AccessLog::monotonicNow();
+        if (Trace::enabled())
+        {
+            std::fill(std::begin(m_trace.at), std::end(m_trace.at), 0);
+            m_trace.target.clear();
+        }
+        m_counted = PerfCounters::sample();
+        for (auto& reading : m_counters)
+            reading.taken = false;
+        mark(Trace::Received);
+    }
+
+    void Response::markParsed()
+    {
+        auto now = AccessLog::monotonicNow();
+        m_record.parse = microseconds(now - m_phase);
+        m_phase = now;
+        mark(Trace::Parsed);
+    }
+
+    void Response::markCreated()
+    {
+        auto now = AccessLog::monotonicNow();
+        m_record.respond = microseconds(now - m_phase);
+        m_phase = now;
+        mark(Trace::Created);
+    }
+
+    void Response::markSent(std::uint64_t bytes, const sockaddr_storage& client)
+    {
+        m_record.send = microseconds(AccessLog::monotonicNow() - m_phase);
+        m_record.bytesSent = bytes;
+        mark(Trace::Sent);
+        if (AccessLog::get().enabled())
+            AccessLog::get().append(m_record, client);
+        Metrics::local().observe(m_record);
+        if (m_counted)
+            Metrics::local().count(m_counters);
+        if (Trace::enabled())
+            Trace::get().finish(m_trace, m_record, m_counted ? m_counters : nullptr);
+    }
+
+    // Copy this much of a mapped file next to the headers so small files go out in a single send
+    const static std::size_t MappedHeadSize = 64 * 1024;
+
+    Chunk Response::nextChunk()
+    {
+        std::string_view text = m_text;
+        switch (m_kind)
+        {
+            case Text:
+                if (m_next++ == 0)
+                    return {text};
+                return {};
+
+            case FileSlices:
+                if (m_next < m_slices.size())
+                {
+                    std::size_t begin = m_next == 0 ? 0 : m_slices[m_next - 1].textEnd;
+                    const auto& slice = m_slices[m_next++];
+                    return {text.substr(begin, slice.textEnd - begin), m_file->fd, slice.offset, slice.length};
                 }
+                // Then whatever text follows the last slice, the closing delimiter of a multipart body
+                if (m_next++ == m_slices.size())
+                    return {text.substr(m_slices.back().textEnd)};
+                return {};
 
-                m_state = State::Transferring;
-                break;
-            }
-            case State::Transferring:
-                try {
-                    m_file.read(&m_data[0], m_data.size());
-                } catch (const std::ios_base::failure& e) {
-                    return {};
-                    m_state = State::Finished;
+            case Mapped:
+            {
+                auto data = m_mapping->data();
+                if (m_next == 0)
+                {
+                    std::size_t headerSize = m_text.size();
+                    m_next = std::min(MappedHeadSize, data.size());
+                    m_text.resize(headerSize + m_next);
+                    if (!m_mapping->copy(&m_text[headerSize], 0, m_next))
+                    {
+                        m_next = data.size();
+                        throw std::runtime_error("mapped file truncated");
+                    }
+                    return {m_text};
                 }
 
-                if (m_file.eof())
-                    m_data.resize(m_responseSize - m_transferred);
+                // The rest is sent straight from the mapping, by the kernel: only plain sockets and kTLS get
+                // mappings. Should the file be truncated meanwhile, it fails the send with EFAULT instead of
+                // raising SIGBUS as a copy in user space would.
+                auto chunk = data.substr(m_next);
+                m_next = data.size();
+                return {chunk};
+            }
 
-                m_transferred += m_data.size();
-                break;
-            case State::Finished:
+            case Body:
+                if (m_next++ == 0)
+                    return {text, -1, 0, 0, false, *m_body};
                 return {};
-        }
 
-        if (m_state != State::Finished && m_transferred == m_responseSize)
-            m_state = State::Finished;
-        return m_data;
+            case Generated:
+                if (m_next++ == 0)
+                    return {text, -1, 0, 0, true};
+                return m_generator->nextChunk();
+        }
+        return {};
     }
 
-    std::string getDate()
+    std::string httpDate(std::time_t t)
     {
         std::string date_str;
         date_str.resize(40);    // I'm confident, the string will take exactly 30, but just to be sure...
-        auto t = std::time(nullptr);
         // Date format example: Wed, 10 May 2017 06:49:35 GMT
         auto res = std::strftime(&date_str[0], date_str.size(), "%a, %d %b %Y %H:%M:%S GMT", std::gmtime(&t));
         if (res == 0)
@@ -111,151 +253,591 @@ namespace ryuuk
             LOG(ERROR) << "Error in generating date string" << std::endl;
         }
         date_str.resize(res);  // res is bytes written minus the null, thus we also remove the ending null
-        LOG(DEBUG) << "Date: " << date_str << std::endl;
         return date_str;
     }
 
-    std::unique_ptr<Response> ResponseCreator::create(StatusCode code, const std::string& location,
-                                                      unsigned int flags)
+    // Parse an IMF-fixdate (Sun, 06 Nov 1994 08:49:37 GMT), the only format we ever send
+    bool parseHttpDate(const std::string& date, std::time_t& time)
+    {
+        std::tm tm{};
+        const char* end = strptime(date.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        if (end == nullptr || *end != '\0')
+            return false;
+        time = timegm(&tm);
+        return true;
+    }
+
+    // The current date, formatted once a second by each thread
+    const std::string& getDate()
+    {
+        thread_local std::time_t cachedTime = -1;
+        thread_local std::string cachedDate;
+        auto now = std::time(nullptr);
+        if (now != cachedTime)
+        {
+            cachedTime = now;
+            cachedDate = httpDate(now);
+        }
+        return cachedDate;
+    }
+
+    ResponseCreator::ResponseCreator(Response& response)
+        : m_response(response)
+        , m_responseString(response.text())
+    {
+        m_response.reset();
+    }
+
+    void ResponseCreator::create(StatusCode code, const std::string& location, unsigned int flags)
     {
         bool directory      = ((flags & SendDirectory) == SendDirectory),
              nopayload      = ((flags & NoPayload)     == NoPayload),
-             keepConnection = ((flags & KeepConnection)== KeepConnection),
-             httpLegacy     = ((flags & HTTPLegacy)    == HTTPLegacy);
+             httpLegacy     = ((flags & HTTPLegacy)    == HTTPLegacy),
+             multiplexed    = ((flags & Multiplexed)   == Multiplexed),
+             userSpaceSend  = ((flags & UserSpaceSend) == UserSpaceSend);
+        // Kept apart from m_file, which may become a precompressed sibling
+        m_path.assign(location);
 
-        // Status line
-        m_responseString = "HTTP/" + (httpLegacy ? "1.0 "s : "1.1 "s) +
-                            std::to_string(code) + " " + responsePhrase.at(code) + "\r\n"
-                           "Server: " + serverName + "\r\n"
-                           "Date: " + getDate() + "\r\n";
-        if (!httpLegacy)
-            m_responseString += "Connection: " + (keepConnection ? "keep-alive"s : "close"s) + "\r\n";
+        if (code == OK)
+        {
+            if (!m_file)
+                m_file = FileCache::get().resolve(location);
+            if (!directory && m_file->info.type == Regular)
+                code = negotiateEncoding();
+            // Before the preconditions, so a 304 has the validators the 200 would have
+            else if (directory)
+                negotiateListing(location);
+            if (code == OK)
+                code = evaluatePreconditions();
+            // Range is only defined for GET
+            if (code == OK && !directory && !nopayload && !m_body)
+                code = selectRanges();
+        }
 
-        LOG(INFO) << "Response: " << code << std::endl;
+        writeStatusLine(code, flags);
 
         // Dispatch on the status code and directory flag
         switch (code)
         {
             case OK:
+                // HTTP/2 copies DATA frames, and TLS without kTLS encrypts, out of a mapping in user space,
+                // where a truncated file raises SIGBUS
                 if (!directory)
-                {
-                    sendResource(location, nopayload);
-                    if (!nopayload)
-                        return std::make_unique<FileResponse>(std::move(m_responseString), location);
-                }
+                    sendResource(nopayload, !multiplexed && !userSpaceSend);
                 else
-                    sendDirectoryListing(location, nopayload);
+                    sendDirectoryListing(location, nopayload, !httpLegacy && !multiplexed);
+                break;
+            case PartialContent:
+                sendResource(nopayload, !multiplexed && !userSpaceSend);
+                break;
+            case RangeNotSatisfiable:
+                m_responseString += "Content-Range: bytes */" + std::to_string(m_file->info.size) + "\r\n";
+                sendGenericError(code, nopayload);
                 break;
             case MovedPermanently:
-                permanentRedirect(location);
+                permanentRedirect(location, nopayload);
+                break;
+            case NotModified:
+                // Same validators as a 200 would have, but no payload. The file isn't touched.
+                appendValidators();
+                appendCachePolicy();
+                appendVary();
+                m_responseString += "\r\n";
                 break;
             case BadRequest:
             case Forbidden:
             case NotFound:
             case MethodNotAllowed:
+            case NotAcceptable:
+            case PreconditionFailed:
             case InternalError:
+            case ServiceUnavailable:
                 sendGenericError(code, nopayload);
                 break;
             default:
                 // An exception will be thrown when trying to access the responsePhrase map before we ever get to this line
                 throw std::invalid_argument("Status code " + std::to_string(code) + " not implemented.");
         }
+    }
 
-        return std::make_unique<SimpleResponse>(std::move(m_responseString));
+    void ResponseCreator::create(FileCache::Handle file, unsigned int flags)
+    {
+        m_file = std::move(file);
+        create(OK, m_file->path, flags);
     }
 
-    void ResponseCreator::sendResource(const std::string& location, bool nopayload)
+    void ResponseCreator::create(std::shared_ptr<const std::string> body, std::string_view contentType,
+                                 unsigned int flags)
     {
-        if (auto path = fs::path{location}; fs::is_regular_file(path))
+        writeStatusLine(OK, flags);
+        m_responseString += "Cache-Control: no-store\r\nContent-Type: ";
+        m_responseString += contentType;
+        m_responseString += "\r\nContent-Length: " + std::to_string(body->size()) + "\r\n\r\n";
+        if (!(flags & NoPayload))
+            m_response.setBody(std::move(body));
+    }
+
+    void ResponseCreator::writeStatusLine(StatusCode code, unsigned int flags)
+    {
+        bool keepConnection = ((flags & KeepConnection)== KeepConnection),
+             httpLegacy     = ((flags & HTTPLegacy)    == HTTPLegacy),
+             multiplexed    = ((flags & Multiplexed)   == Multiplexed);
+
+        // Written into the text's buffer, which is reused
+        m_responseString.assign(httpLegacy ? "HTTP/1.0 " : "HTTP/1.1 ");
+        m_responseString += std::to_string(code);
+        m_responseString += ' ';
+        m_responseString += responsePhrase.at(code);
+        m_responseString += "\r\nServer: ";
+        m_responseString += serverName;
+        m_responseString += "\r\nDate: ";
+        m_responseString += getDate();
+        m_responseString += "\r\n";
+        if (!httpLegacy && !multiplexed)
+            m_responseString += keepConnection ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+
+        LOG(INFO) << "Response: " << code << std::endl;
+        m_response.record().status = code;
+    }
+
+    ResponseCreator::StatusCode ResponseCreator::negotiateEncoding()
+    {
+        // The type is always that of the original, "app.js.br" is still javascript
+        auto type = MIMERegistry::fromExtension(file_extension(m_file->path));
+        m_contentType = type.name;
+        m_contentTypeHeader = type.header;
+
+        AcceptEncoding accept{m_request.acceptEncoding};
+        std::array<bool, EncodingCount> available{};
+        std::array<FileCache::Handle, EncodingCount> variants;
+        available[Identity] = true;
+
+        const bool dynamic = CompressionCache::get().compressible(m_contentType, m_file->info.size);
+        m_negotiated = settings.precompressed || dynamic;
+        for (int i = 0; i < Identity; ++i)
         {
-            std::uintmax_t size;
-            try {
-                size = fs::file_size(path);
-            } catch(const fs::filesystem_error& e) {
-                return sendGenericError(ResponseCreator::InternalError, nopayload);
+            auto encoding = ContentEncoding(i);
+            if (!accept.acceptable(encoding))
+                continue;
+
+            if (settings.precompressed)
+            {
+                // Cached like any other path, missing siblings included, so this is usually free
+                auto variant = FileCache::get().resolve(m_file->path + std::string{encodingSuffix(encoding)});
+                // A sibling older than the original is stale, ignore it
+                if (variant->info.type == Regular && variant->info.mtime >= m_file->info.mtime)
+                {
+                    available[i] = true;
+                    variants[i] = std::move(variant);
+                }
             }
+            if (dynamic && CompressionCache::supported(encoding))
+                available[i] = true;
+        }
+
+        auto chosen = accept.choose(available);
+        if (chosen == EncodingCount)
+        {
+            LOG(INFO) << "No acceptable encoding for " << m_file->path << std::endl;
+            return NotAcceptable;
+        }
 
-            m_responseString += "Accept-Ranges: none\r\n"s
-                             +  "Content-Type: "s + MIMERegistry::fromExtension(file_extension(location)) + "\r\n"
-                             +  "Content-Length: "s + std::to_string(size) +
-                                "\r\n\r\n";
+        m_encoding = chosen;
+        if (chosen != Identity && variants[chosen])
+        {
+            LOG(DEBUG) << "Serving " << encodingName(chosen) << " encoded sibling of " << m_file->path << std::endl;
+            m_file = std::move(variants[chosen]);
         }
-        else
-            return sendGenericError(ResponseCreator::InternalError, nopayload);
+        else if (chosen != Identity)
+        {
+            // Until it's compressed, identity will do if the client takes it
+            m_body = compressedBody(chosen, nullptr, accept.acceptable(Identity));
+            if (!m_body)
+                m_encoding = Identity;
+            if (!m_body && !accept.acceptable(Identity))
+                return NotAcceptable;
+        }
+        return OK;
     }
 
-    void ResponseCreator::sendGenericError(StatusCode code, bool nopayload)
+    CompressionCache::Body ResponseCreator::compressedBody(ContentEncoding encoding, std::shared_ptr<const std::string> data,
+                                                           bool canWait)
     {
-        const std::string html = "<html><head><title>Ryuuk</title></head><body><h2>" +
-                                 std::to_string(code) + " " + responsePhrase.at(code) +
-                                 "</h2><hr><br><br>"
-                                 "The requested resource could not be sent. Light got to this location before you, unfortunately."
-                                 "<br/><br/><br/><hr>"
-                                 "<i>Hosted using <a href=\"https://github.com/amhndu/ryuuk\">Ryuuk</a></i></body></html>";
+        auto& cache = CompressionCache::get();
+        auto key = CompressionCache::makeKey(m_file->path, m_file->info, encoding);
 
-        if (code == MethodNotAllowed)
-                m_responseString += "Allow: GET, HEAD\r\n";
-        if (code != BadRequest && code != MethodNotAllowed)
+        auto source = [&]
         {
-            m_responseString += "Content-Type: text/html\r\n"
-                                "Content-Length: " + std::to_string(html.size()) + "\r\n\r\n";
-            if (!nopayload)
-                m_responseString += html;
+            if (data)
+                return CompressionCache::Source{nullptr, data};
+            return CompressionCache::Source{m_file, nullptr};
+        };
+
+        bool schedule;
+        auto body = cache.find(key, schedule);
+        if (!body && !canWait)
+            return cache.compressNow(key, encoding, source());
+        if (schedule)
+            cache.schedule(key, encoding, source());
+        return body;
+    }
+
+    void ResponseCreator::appendVary()
+    {
+        if (m_negotiated)
+            m_responseString += "Vary: Accept-Encoding\r\n";
+    }
+
+    bool ResponseCreator::etagListMatches(std::string_view header, bool strong) const
+    {
+        const bool exists = m_file->info.type == Regular || m_file->info.type == Directory;
+        std::size_t i = 0;
+        while (i < header.size())
+        {
+            char c = header[i];
+            if (c == ' ' || c == '\t' || c == ',')
+            {
+                ++i;
+                continue;
+            }
+            if (c == '*')
+                return exists;
+
+            bool weak = header.compare(i, 2, "W/") == 0;
+            if (weak)
+                i += 2;
+            auto end = header.find('"', i + 1);
+            if (i >= header.size() || header[i] != '"' || end == std::string_view::npos)
+                return false;   // Malformed, nothing we sent looks like this
+
+            // Bodies compressed on the fly only have a weak tag, which never matches strongly
+            if (exists && !(strong && (weak || m_body)) && m_file->matchesETag(header.substr(i, end - i + 1)))
+                return true;
+            i = end + 1;
         }
-        else
-            m_responseString += "\r\n";
+        return false;
+    }
+
+    ResponseCreator::StatusCode ResponseCreator::evaluatePreconditions() const
+    {
+        const std::time_t modified = m_file->info.mtime / 1000000000;
+        std::time_t date;
+
+        if (!m_request.ifMatch.empty())
+        {
+            if (!etagListMatches(m_request.ifMatch, true))
+                return PreconditionFailed;
+        }
+        else if (!m_request.ifUnmodifiedSince.empty() && parseHttpDate(m_request.ifUnmodifiedSince, date))
+        {
+            if (modified > date)
+                return PreconditionFailed;
+        }
+
+        // Only GET and HEAD make it this far, for which a failed If-None-Match means 304
+        if (!m_request.ifNoneMatch.empty())
+        {
+            if (etagListMatches(m_request.ifNoneMatch, false))
+                return NotModified;
+        }
+        else if (!m_request.ifModifiedSince.empty() && parseHttpDate(m_request.ifModifiedSince, date))
+        {
+            if (modified <= date)
+                return NotModified;
+        }
+
+        return OK;
     }
 
-    void ResponseCreator::sendDirectoryListing(const std::string& path, bool nopayload)
+    void ResponseCreator::appendValidators()
     {
-        // Possibly read these from config or some other file ?
-        static const std::string html_template = "<html>\n<head><title>Directory Listing for $DIR</title></head>\n<body>\n"
-                                          "<h2>Index of $DIR</h2><hr/>\n<ul>\n$LIST</ul>\n<hr>"
-                                          "<i>Hosted using <a href=\"https://github.com/amhndu/ryuuk\">Ryuuk</a></i>"
-                                          "</body>\n</html>";
-        static const std::string entry_template = "<li><a href=\"$URL\">$URL</a></li>\n";
+        if (m_file->info.type != Regular && m_file->info.type != Directory)
+            return;
+        // Bytes compressed on the fly may differ between compression levels, so the tag is weak
+        m_responseString += "ETag: " + (m_body ? "W/"s : ""s) + m_file->etag() + "\r\n"
+                            "Last-Modified: " + httpDate(m_file->info.mtime / 1000000000) + "\r\n";
+    }
 
-        std::string html = replaceAll(html_template, "$DIR", path);
-        std::vector<std::string> listing;
+    void ResponseCreator::appendCachePolicy()
+    {
+        // Listings revalidated with a 304 are HTML as far as type rules go, unless they were asked for as something else
+        std::string_view type = m_contentType;
+        if (type.empty() && m_file->info.type == Directory)
+            type = "text/html";
+        // Drop the '.' of "./path"
+        CachePolicy::get().append(m_responseString, std::string_view{m_path}.substr(1), type);
+    }
+
+    ResponseCreator::StatusCode ResponseCreator::selectRanges()
+    {
+        // Upper limit on the number of ranges in a request, more than this smells of abuse and is ignored
+        const std::size_t MaxRanges = 64;
 
-        DIR *dir;
-        dirent *ep;
-        dir = opendir(path.c_str());
-        if (dir != nullptr)
+        m_ranges.clear();
+        std::string_view header = m_request.range;
+        if (header.empty() || m_file->info.type != Regular)
+            return OK;
+
+        // If the representation changed since the client got its validator, it gets all of it instead.
+        // If-Range requires a strong match: weak tags never match and dates must be exact.
+        if (const auto& ifRange = m_request.ifRange; !ifRange.empty())
         {
-            m_responseString += "Accept-Ranges: none\r\n"
-                                "Content-Type: text/html; charset=utf-8\r\n";
+            bool matches = ifRange.front() == '"' ? !m_body && m_file->matchesETag(ifRange)
+                         : ifRange.compare(0, 2, "W/") != 0 && ifRange == httpDate(m_file->info.mtime / 1000000000);
+            if (!matches)
+            {
+                LOG(DEBUG) << "If-Range doesn't match, ignoring Range" << std::endl;
+                return OK;
+            }
+        }
+
+        // Other (unknown) units are ignored, as are syntactically invalid headers
+        if (header.substr(0, 6) != "bytes=")
+            return OK;
+        header.remove_prefix(6);
 
-            while ((ep = readdir(dir)))
+        auto parseNumber = [](std::string_view text, std::uintmax_t& number)
+        {
+            if (text.empty() || text.size() > 18)  // Keeps us clear of overflow
+                return false;
+            number = 0;
+            for (char c : text)
             {
-                std::string res = {ep->d_name};
-                if (getResourceType(path + res) == Directory)
-                    res += '/';
+                if (c < '0' || c > '9')
+                    return false;
+                number = number * 10 + (c - '0');
+            }
+            return true;
+        };
+
+        const auto size = m_file->info.size;
+        std::size_t count = 0;
+        while (!header.empty())
+        {
+            auto comma = header.find(',');
+            auto spec = header.substr(0, comma);
+            header = comma == std::string_view::npos ? std::string_view{} : header.substr(comma + 1);
 
-                listing.push_back(res);
+            while (!spec.empty() && (spec.front() == ' ' || spec.front() == '\t'))
+                spec.remove_prefix(1);
+            while (!spec.empty() && (spec.back() == ' ' || spec.back() == '\t'))
+                spec.remove_suffix(1);
+            if (spec.empty())
+                continue;
+
+            auto dash = spec.find('-');
+            if (++count > MaxRanges || dash == std::string_view::npos)
+                return OK;
+
+            std::uintmax_t first, last;
+            auto firstText = spec.substr(0, dash), lastText = spec.substr(dash + 1);
+            if (firstText.empty())
+            {
+                // Suffix range, the last N bytes
+                if (!parseNumber(lastText, last))
+                    return OK;
+                if (last == 0 || size == 0)
+                    continue;
+                first = size - std::min(last, size);
+                last = size - 1;
             }
-            closedir(dir);
+            else
+            {
+                if (!parseNumber(firstText, first))
+                    return OK;
+                if (lastText.empty())
+                    last = size;
+                else if (!parseNumber(lastText, last) || last < first)
+                    return OK;
+                if (first >= size)
+                    continue;
+                last = std::min(last, size - 1);
+            }
+            m_ranges.push_back({first, last});
+        }
 
-            std::sort(listing.begin(), listing.end());
-            std::string listing_buf;
-            for (auto&& item : listing)
-                listing_buf.append(replaceAll(entry_template, "$URL", item));
+        if (m_ranges.empty())
+            return RangeNotSatisfiable;
 
-            html = replaceAll(html, "$LIST", listing_buf);
-            m_responseString += "Content-Length: " + std::to_string(html.size()) +
-                                "\r\n\r\n";
+        // Coalesce overlapping and adjacent ranges, so no byte is sent twice
+        std::sort(m_ranges.begin(), m_ranges.end(),
+                  [](const ByteRange& a, const ByteRange& b) { return a.first < b.first; });
+        std::size_t merged = 0;
+        for (std::size_t i = 1; i < m_ranges.size(); ++i)
+        {
+            if (m_ranges[i].first <= m_ranges[merged].last + 1)
+                m_ranges[merged].last = std::max(m_ranges[merged].last, m_ranges[i].last);
+            else
+                m_ranges[++merged] = m_ranges[i];
+        }
+        m_ranges.resize(merged + 1);
+
+        return PartialContent;
+    }
+
+    void ResponseCreator::sendResource(bool nopayload, bool mappable)
+    {
+        if (m_file->info.type != Regular)
+        {
+            sendGenericError(ResponseCreator::InternalError, nopayload);
+            return;
+        }
+
+        const auto size = m_file->info.size;
+        m_responseString += m_body ? "Accept-Ranges: none\r\n" : "Accept-Ranges: bytes\r\n";
+        appendValidators();
+        appendCachePolicy();
+        appendVary();
+        if (m_encoding != Identity)
+            m_responseString += "Content-Encoding: "s + std::string{encodingName(m_encoding)} + "\r\n";
+
+        if (m_body)
+        {
+            m_responseString += m_contentTypeHeader;
+            m_responseString += "Content-Length: " + std::to_string(m_body->size()) + "\r\n\r\n";
             if (!nopayload)
-                m_responseString += html;
+                m_response.setBody(std::move(m_body));
+            return;
+        }
+
+        if (m_ranges.size() > 1)
+        {
+            static thread_local std::mt19937_64 random{std::random_device{}()};
+            char boundary[24];
+            std::snprintf(boundary, sizeof(boundary), "ryuuk%016llx", static_cast<unsigned long long>(random()));
+
+            std::vector<std::string> prefixes;
+            std::uintmax_t length = 0;
+            for (const auto& range : m_ranges)
+            {
+                auto prefix = (prefixes.empty() ? ""s : "\r\n"s) + "--" + boundary + "\r\n" +
+                              std::string{m_contentTypeHeader} +
+                              "Content-Range: bytes " + std::to_string(range.first) + "-" + std::to_string(range.last) +
+                                  "/" + std::to_string(size) + "\r\n\r\n";
+                length += prefix.size() + (range.last - range.first + 1);
+                prefixes.push_back(std::move(prefix));
+            }
+            const auto trailer = "\r\n--"s + boundary + "--\r\n";
+            length += trailer.size();
+
+            m_responseString += "Content-Type: multipart/byteranges; boundary="s + boundary + "\r\n"
+                                "Content-Length: " + std::to_string(length) + "\r\n\r\n";
+            for (std::size_t i = 0; i < m_ranges.size(); ++i)
+            {
+                const auto& range = m_ranges[i];
+                m_responseString += prefixes[i];
+                m_response.addFileSlice(m_file, range.first, range.last - range.first + 1);
+            }
+            m_responseString += trailer;
+        }
+        else if (m_ranges.size() == 1)
+        {
+            const auto& range = m_ranges.front();
+            const auto length = range.last - range.first + 1;
+            m_responseString += m_contentTypeHeader;
+            m_responseString += "Content-Range: bytes " + std::to_string(range.first) + "-" + std::to_string(range.last) +
+                                    "/" + std::to_string(size) + "\r\n"
+                                "Content-Length: " + std::to_string(length) + "\r\n\r\n";
+            m_response.addFileSlice(m_file, range.first, length);
         }
         else
         {
-            LOG(ERROR) << "Couldn't open directory " << path << " to send directory listing" << std::endl;
+            m_responseString += m_contentTypeHeader;
+            m_responseString += "Content-Length: " + std::to_string(size) + "\r\n\r\n";
+            if (nopayload)
+                return;
+
+            if (mappable && settings.mappingMinSize != 0 && size >= settings.mappingMinSize &&
+                size <= settings.mappingMaxSize)
+            {
+                if (auto mapping = m_file->mapping())
+                    return m_response.setMapping(std::move(mapping));
+            }
+            m_response.addFileSlice(m_file, 0, size);
+        }
+    }
+
+    void ResponseCreator::sendGenericError(StatusCode code, bool nopayload)
+    {
+        // Sent from where it is, right after the text
+        const auto& response = prebuilt.at(code);
+        m_response.setBody(nopayload ? response.head : response.message);
+    }
+
+    void ResponseCreator::negotiateListing(const std::string& path)
+    {
+        m_streamListing = ListingOptions::parse(m_request.query).custom;
+        if (!m_streamListing)
+            m_listing = ListingCache::get().listing(m_file, path, m_streamListing);
+        if (!m_listing || !CompressionCache::get().compressible("text/html; charset=utf-8", m_listing->size()))
+            return;
+
+        m_negotiated = true;
+        AcceptEncoding accept{m_request.acceptEncoding};
+        std::array<bool, EncodingCount> available{};
+        available[Identity] = true;
+        for (int i = 0; i < Identity; ++i)
+            available[i] = CompressionCache::supported(ContentEncoding(i));
+
+        auto chosen = accept.choose(available);
+        if (chosen != EncodingCount && chosen != Identity)
+            m_body = compressedBody(chosen, m_listing, accept.acceptable(Identity));
+        if (m_body)
+            m_encoding = chosen;
+    }
+
+    void ResponseCreator::sendDirectoryListing(const std::string& path, bool nopayload, bool chunked)
+    {
+        if (m_streamListing)
+        {
+            auto options = ListingOptions::parse(m_request.query);
+            auto reader = std::make_unique<DirectoryReader>(m_file->fd);
+            if (!reader->isOpen())
+            {
+                sendGenericError(ResponseCreator::InternalError, nopayload);
+                return;
+            }
+
+            // Generated as it's sent, so neither its length nor a compressed body are known up front
+            m_contentType = options.contentType();
+            m_responseString += "Content-Type: "s + std::string{m_contentType} + "\r\n";
+            appendValidators();
+            appendCachePolicy();
+            if (chunked)
+                m_responseString += "Transfer-Encoding: chunked\r\n";
+            m_responseString += "\r\n";
+            if (!nopayload)
+                m_response.setGenerator(std::make_unique<ListingGenerator>(std::move(reader), path, options, chunked));
+            return;
+        }
+
+        if (!m_listing)
+        {
             sendGenericError(ResponseCreator::InternalError, nopayload);
+            return;
         }
+
+        m_contentType = "text/html; charset=utf-8";
+        m_responseString += "Accept-Ranges: none\r\n"
+                            "Content-Type: " + std::string{m_contentType} + "\r\n";
+        appendValidators();
+        appendCachePolicy();
+        appendVary();
+        if (m_body)
+            m_responseString += "Content-Encoding: "s + std::string{encodingName(m_encoding)} + "\r\n";
+
+        // Sent from the cache, right after the text
+        const auto& body = m_body ? m_body : m_listing;
+        m_responseString += "Content-Length: " + std::to_string(body->size()) + "\r\n\r\n";
+        if (!nopayload)
+            m_response.setBody(body);
     }
 
-    void ResponseCreator::permanentRedirect(const std::string& new_location)
+    void ResponseCreator::permanentRedirect(const std::string& new_location, bool nopayload)
     {
-        m_responseString += "Location: " + new_location + "\r\n\r\n";
+        m_responseString += "Location: ";
+        m_responseString += new_location;
+        m_responseString += "\r\n";
+        sendGenericError(MovedPermanently, nopayload);
     }
 }
@@ -2,12 +2,19 @@
 #include "Server.hpp"
 #include "Worker.hpp"
 #include "MIMERegistry.hpp"
+#include "DocumentRoot.hpp"
+#include "NamespaceIndex.hpp"
+#include "FileCache.hpp"
+#include "ListingCache.hpp"
+#include "BufferPool.hpp"
 
 #include <fstream>
 #include <algorithm>
 #include <sstream>
 #include <iomanip>
 #include <functional>
+#include <type_traits>
+#include <poll.h>
 
 namespace
 {
@@ -16,6 +23,9 @@ namespace
         if (c_str) return c_str;
         return {};
     }
+
+    // Time a scrape of the metrics listener gets to send its request and take the answer
+    const int MetricsTimeout = 1000;    // ms
 }
 
 namespace ryuuk
@@ -31,9 +41,41 @@ namespace ryuuk
     {
         LOG(INFO) << "Parsing server configuration file..." << std::endl;
         parseConfigFile();
+        Log::get().configure(server_manifest.logging);
 
         LOG(INFO) << "Adding supported headers..." << std::endl;
 
+        if (!DocumentRoot::get().open(server_manifest.root))
+            throw std::runtime_error("[FATAL] \'" + server_manifest.root + "\': Unable to open the document root!");
+
+        NamespaceIndex::get().configure(server_manifest.indexTree, server_manifest.indexTreeMaxEntries);
+
+        // Types from [MIME] were registered while parsing, and take precedence
+        if (!server_manifest.mimeTypes.empty() && !MIMERegistry::import(server_manifest.mimeTypes))
+        {
+            LOG(ERROR) << "Unable to read MIME types from \'" << server_manifest.mimeTypes << "\'" << std::endl;
+        }
+        MIMERegistry::freeze();
+
+        FileCache::get().configure(server_manifest.fileCacheEntries,
+                                   std::chrono::milliseconds(server_manifest.fileCacheTTL));
+        FileCache::get().enableContentTags(server_manifest.contentETags);
+        ListingCache::get().configure(server_manifest.listingCacheEntries, server_manifest.listingMaxEntries);
+        BufferPool::get().configure(server_manifest.streamBufferSize, server_manifest.streamMemory);
+        ResponseCreator::Settings responseSettings;
+        responseSettings.mappingMinSize = server_manifest.mmapMinSize;
+        responseSettings.mappingMaxSize = server_manifest.mmapMaxSize;
+        responseSettings.precompressed  = server_manifest.precompressed;
+        ResponseCreator::configure(responseSettings);
+        CompressionCache::get().configure(server_manifest.compression);
+        PageTemplates::load(server_manifest.templates);
+        ResponseCreator::prerender();
+        CachePolicy::get().configure(server_manifest.caching);
+        configureWorkers(server_manifest.workers);
+        AccessLog::get().configure(server_manifest.accessLog);
+        Metrics::get().configure(server_manifest.metrics);
+        Trace::get().configure(server_manifest.tracing);
+
         LOG(INFO) << "Attempting to bind listener (SocketListener object)..." << std::endl;
         if (m_listener.listen(server_manifest.port, server_manifest.backlog))
             LOG(INFO) << "Successfully bound listener on port \'" + std::to_string(server_manifest.port) + "\'." << std::endl;
@@ -44,6 +86,33 @@ namespace ryuuk
             throw std::runtime_error("Server could not bind listener on port");
         }
 
+        if (server_manifest.tlsPort != 0)
+        {
+            LOG(INFO) << "Attempting to bind HTTPS listener..." << std::endl;
+            server_manifest.tls.http2 = server_manifest.workers.http2;
+            if (m_tlsListener.listen(server_manifest.tlsPort, server_manifest.backlog, server_manifest.tls))
+                LOG(INFO) << "Successfully bound HTTPS listener on port \'" << server_manifest.tlsPort << "\'." << std::endl;
+            else
+            {
+                LOG(ERROR) << "[FATAL] Server could not bind HTTPS listener on port \'"
+                           << server_manifest.tlsPort << "\'. Exiting..." << std::endl;
+                throw std::runtime_error("Server could not bind HTTPS listener on port");
+            }
+        }
+
+        const auto& metrics = server_manifest.metrics;
+        if (metrics.port != 0)
+        {
+            if (m_metricsListener.listen(metrics.port, server_manifest.backlog, metrics.address))
+                LOG(INFO) << "Serving metrics on " << metrics.address << ":" << metrics.port << std::endl;
+            else
+            {
+                LOG(ERROR) << "[FATAL] Server could not bind the metrics listener on "
+                           << metrics.address << ":" << metrics.port << ". Exiting..." << std::endl;
+                throw std::runtime_error("Server could not bind the metrics listener");
+            }
+        }
+
         m_running = true;
     }
 
@@ -74,7 +143,7 @@ namespace ryuuk
         // Read config options...
         std::string line;
         const std::string fields[] = {"IP", "Port", "Connections"};
-        enum { Connection, MIME, None } section = None;
+        enum { Connection, MIME, Files, Compression, Templates, TLS, Caching, Logging, Metrics, Tracing, None } section = None;
         unsigned int line_no = 0;
         while (std::getline(configFile, line))
         {
@@ -93,6 +162,46 @@ namespace ryuuk
                 LOG(DEBUG) << "Parsing MIME configuration options..." << std::endl;
                 section = MIME;
             }
+            else if (line == "[Files]")
+            {
+                LOG(DEBUG) << "Parsing file serving configuration options..." << std::endl;
+                section = Files;
+            }
+            else if (line == "[Compression]")
+            {
+                LOG(DEBUG) << "Parsing compression configuration options..." << std::endl;
+                section = Compression;
+            }
+            else if (line == "[Templates]")
+            {
+                LOG(DEBUG) << "Parsing template configuration options..." << std::endl;
+                section = Templates;
+            }
+            else if (line == "[Caching]")
+            {
+                LOG(DEBUG) << "Parsing caching rules..." << std::endl;
+                section = Caching;
+            }
+            else if (line == "[Logging]")
+            {
+                LOG(DEBUG) << "Parsing logging configuration options..." << std::endl;
+                section = Logging;
+            }
+            else if (line == "[Metrics]")
+            {
+                LOG(DEBUG) << "Parsing metrics configuration options..." << std::endl;
+                section = Metrics;
+            }
+            else if (line == "[Tracing]")
+            {
+                LOG(DEBUG) << "Parsing tracing configuration options..." << std::endl;
+                section = Tracing;
+            }
+            else if (line == "[TLS]")
+            {
+                LOG(DEBUG) << "Parsing TLS configuration options..." << std::endl;
+                section = TLS;
+            }
             //else if (section == Connection || section == None) // Being lenient, whatevs be the section
             else if (section == Connection)
             {
@@ -107,6 +216,16 @@ namespace ryuuk
                         server_manifest.port = std::stoi(value);
                     else if (field == "Backlog")
                         server_manifest.backlog = std::stoi(value);
+                    else if (field == "PipelineDepth")
+                        server_manifest.workers.pipelineDepth = std::stoul(value);
+                    else if (field == "NotSentLowat")
+                        server_manifest.workers.notSentLowat = std::stoi(value);
+                    else if (field == "HTTP2")
+                        server_manifest.workers.http2 = (value == "true" || value == "1");
+                    else if (field == "MaxStreams")
+                        server_manifest.workers.maxStreams = std::stoul(value);
+                    else if (field == "MaxConnections")
+                        server_manifest.workers.maxConnections = std::stoul(value);
                     else
                     {
                         LOG(INFO) << "Invalid key in configuration file at Line " << line_no << std::endl;
@@ -130,6 +249,262 @@ namespace ryuuk
 
                 LOG(DEBUG) << "Added MIME type: " + field + ": " + value << std::endl;
             }
+            else if (section == Files)
+            {
+                auto divider = line.find("=");
+                std::string field  = ltrim(rtrim(line.substr(0, divider)));
+                std::string value = ltrim(rtrim(line.substr(divider + 1)));
+                try
+                {
+                    if (field == "Root")
+                        server_manifest.root = value;
+                    else if (field == "IndexTree")
+                        server_manifest.indexTree = (value == "true" || value == "1");
+                    else if (field == "IndexTreeMaxEntries")
+                        server_manifest.indexTreeMaxEntries = std::stoul(value);
+                    else if (field == "MimeTypes")
+                        server_manifest.mimeTypes = value;
+                    else if (field == "CacheEntries")
+                        server_manifest.fileCacheEntries = std::stoul(value);
+                    else if (field == "CacheTTL")
+                        server_manifest.fileCacheTTL = std::stoul(value);
+                    else if (field == "ContentETags")
+                        server_manifest.contentETags = (value == "true" || value == "1");
+                    else if (field == "Precompressed")
+                        server_manifest.precompressed = (value == "true" || value == "1");
+                    else if (field == "MmapMinSize")
+                        server_manifest.mmapMinSize = std::stoull(value);
+                    else if (field == "MmapMaxSize")
+                        server_manifest.mmapMaxSize = std::stoull(value);
+                    else if (field == "ListingCacheEntries")
+                        server_manifest.listingCacheEntries = std::stoul(value);
+                    else if (field == "ListingMaxEntries")
+                        server_manifest.listingMaxEntries = std::stoul(value);
+                    else if (field == "StreamBufferSize")
+                        server_manifest.streamBufferSize = std::stoul(value);
+                    else if (field == "StreamMemory")
+                        server_manifest.streamMemory = std::stoull(value);
+                    else
+                    {
+                        LOG(INFO) << "Invalid key in configuration file at Line " << line_no << std::endl;
+                        continue;
+                    }
+
+                    LOG(INFO) << "Configured " << field << " to " << value << std::endl;
+                }
+                catch (const std::invalid_argument& e)
+                {
+                    LOG(INFO) << "Invalid value in configuration file at line " <<  line_no << std::endl;
+                }
+            }
+            else if (section == Compression)
+            {
+                auto divider = line.find("=");
+                std::string field  = ltrim(rtrim(line.substr(0, divider)));
+                std::string value = ltrim(rtrim(line.substr(divider + 1)));
+                auto& compression = server_manifest.compression;
+                try
+                {
+                    if (field == "Enabled")
+                        compression.enabled = (value == "true" || value == "1");
+                    else if (field == "MinSize")
+                        compression.minSize = std::stoull(value);
+                    else if (field == "MaxSize")
+                        compression.maxSize = std::stoull(value);
+                    else if (field == "CacheSize")
+                        compression.cacheSize = std::stoull(value);
+                    else if (field == "Threads")
+                        compression.threads = std::stoul(value);
+                    else if (field == "GzipLevel")
+                        compression.gzipLevel = std::stoi(value);
+                    else if (field == "BrotliLevel")
+                        compression.brotliLevel = std::stoi(value);
+                    else if (field == "ZstdLevel")
+                        compression.zstdLevel = std::stoi(value);
+                    else if (field == "Types")
+                    {
+                        compression.types.clear();
+                        std::istringstream list(value);
+                        for (std::string type; std::getline(list, type, ','); )
+                        {
+                            type = ltrim(rtrim(type));
+                            if (!type.empty())
+                                compression.types.push_back(type);
+                        }
+                    }
+                    else
+                    {
+                        LOG(INFO) << "Invalid key in configuration file at Line " << line_no << std::endl;
+                        continue;
+                    }
+
+                    LOG(INFO) << "Configured " << field << " to " << value << std::endl;
+                }
+                catch (const std::invalid_argument& e)
+                {
+                    LOG(INFO) << "Invalid value in configuration file at line " <<  line_no << std::endl;
+                }
+            }
+            else if (section == TLS)
+            {
+                auto divider = line.find("=");
+                std::string field  = ltrim(rtrim(line.substr(0, divider)));
+                std::string value = ltrim(rtrim(line.substr(divider + 1)));
+                auto& tls = server_manifest.tls;
+                try
+                {
+                    if (field == "Port")
+                        server_manifest.tlsPort = std::stoi(value);
+                    else if (field == "Certificate")
+                        tls.certificate = value;
+                    else if (field == "PrivateKey")
+                        tls.privateKey = value;
+                    else if (field == "KernelTLS")
+                        tls.kernelOffload = (value == "true" || value == "1");
+                    else if (field == "SessionCacheSize")
+                        tls.sessionCacheSize = std::stol(value);
+                    else if (field == "SessionTimeout")
+                        tls.sessionTimeout = std::stol(value);
+                    else
+                    {
+                        LOG(INFO) << "Invalid key in configuration file at Line " << line_no << std::endl;
+                        continue;
+                    }
+
+                    LOG(INFO) << "Configured " << field << " to " << value << std::endl;
+                }
+                catch (const std::invalid_argument& e)
+                {
+                    LOG(INFO) << "Invalid value in configuration file at line " <<  line_no << std::endl;
+                }
+            }
+            else if (section == Logging)
+            {
+                auto divider = line.find("=");
+                std::string field  = ltrim(rtrim(line.substr(0, divider)));
+                std::string value = ltrim(rtrim(line.substr(divider + 1)));
+                auto& logging = server_manifest.logging;
+                try
+                {
+                    if (field == "Policy" && (value == "drop" || value == "block"))
+                        logging.block = (value == "block");
+                    else if (field == "RingSize")
+                        logging.ringSize = std::stoul(value);
+                    else if (field == "RotateSize")
+                        logging.rotateSize = std::stoull(value);
+                    else if (field == "RotateKeep")
+                        logging.rotateKeep = std::stoul(value);
+                    else if (field == "AccessLog")
+                        server_manifest.accessLog.directory = value;
+                    else if (field == "AccessSegmentSize")
+                        server_manifest.accessLog.segmentSize = std::stoull(value);
+                    else
+                    {
+                        LOG(INFO) << "Invalid key in configuration file at Line " << line_no << std::endl;
+                        continue;
+                    }
+
+                    LOG(INFO) << "Configured " << field << " to " << value << std::endl;
+                }
+                catch (const std::invalid_argument& e)
+                {
+                    LOG(INFO) << "Invalid value in configuration file at line " <<  line_no << std::endl;
+                }
+            }
+            else if (section == Metrics)
+            {
+                auto divider = line.find("=");
+                std::string field  = ltrim(rtrim(line.substr(0, divider)));
+                std::string value = ltrim(rtrim(line.substr(divider + 1)));
+                auto& metrics = server_manifest.metrics;
+                try
+                {
+                    if (field == "Path")
+                        metrics.path = value;
+                    else if (field == "Address")
+                        metrics.address = value;
+                    else if (field == "Port")
+                        metrics.port = std::stoul(value);
+                    else if (field == "PerfSampleRate")
+                        metrics.perfSampleRate = std::stoul(value);
+                    else
+                    {
+                        LOG(INFO) << "Invalid key in configuration file at Line " << line_no << std::endl;
+                        continue;
+                    }
+
+                    LOG(INFO) << "Configured metrics " << field << " to " << value << std::endl;
+                }
+                catch (const std::invalid_argument& e)
+                {
+                    LOG(INFO) << "Invalid value in configuration file at line " <<  line_no << std::endl;
+                }
+            }
+            else if (section == Tracing)
+            {
+                auto divider = line.find("=");
+                std::string field  = ltrim(rtrim(line.substr(0, divider)));
+                std::string value = ltrim(rtrim(line.substr(divider + 1)));
+                auto& tracing = server_manifest.tracing;
+                try
+                {
+                    if (field == "File")
+                        tracing.file = value;
+                    else if (field == "SampleRate")
+                        tracing.sampleRate = std::stoul(value);
+                    else if (field == "SlowThreshold")
+                        tracing.slowThreshold = std::stoull(value);
+                    else
+                    {
+                        LOG(INFO) << "Invalid key in configuration file at Line " << line_no << std::endl;
+                        continue;
+                    }
+
+                    LOG(INFO) << "Configured tracing " << field << " to " << value << std::endl;
+                }
+                catch (const std::invalid_argument& e)
+                {
+                    LOG(INFO) << "Invalid value in configuration file at line " <<  line_no << std::endl;
+                }
+            }
+            else if (section == Caching)
+            {
+                // Directives have '=' in them, the pattern doesn't
+                auto divider = line.find("=");
+                std::string pattern = ltrim(rtrim(line.substr(0, divider)));
+                std::string value = ltrim(rtrim(line.substr(divider + 1)));
+                if (divider == std::string::npos || pattern.empty() || value.empty())
+                {
+                    LOG(INFO) << "Invalid caching rule in configuration file at Line " << line_no << std::endl;
+                    continue;
+                }
+
+                server_manifest.caching.push_back({pattern, value});
+                LOG(INFO) << "Configured caching of " << pattern << " to " << value << std::endl;
+            }
+            else if (section == Templates)
+            {
+                auto divider = line.find("=");
+                std::string field  = ltrim(rtrim(line.substr(0, divider)));
+                std::string value = ltrim(rtrim(line.substr(divider + 1)));
+
+                if (field == "Listing")
+                    server_manifest.templates.listing = value;
+                else if (field == "ListingEntry")
+                    server_manifest.templates.listingEntry = value;
+                else if (field == "Error")
+                    server_manifest.templates.error = value;
+                else if (field.size() == 8 && field.compare(0, 5, "Error") == 0 &&
+                         std::all_of(field.begin() + 5, field.end(), ::isdigit))
+                    server_manifest.templates.errors[std::stoi(field.substr(5))] = value;
+                else
+                {
+                    LOG(INFO) << "Invalid key in configuration file at Line " << line_no << std::endl;
+                    continue;
+                }
+
+                LOG(INFO) << "Configured " << field << " to " << value << std::endl;
+            }
             else
                 LOG(ERROR) << "Invalid line in key configuration at Line " << line_no << std::endl;
 
@@ -139,14 +514,24 @@ namespace ryuuk
         LOG(INFO) << "Parsed and applied server configuration from \'" + m_configPath << "\'." << std::endl;
     }
 
-    void Server::run()
+    template <typename Listener>
+    void Server::acceptConnections(Listener& listener)
     {
-        LOG(INFO) << "Server running." << std::endl;
         while(m_running)
         {
-            SocketStream socket = m_listener.accept();    // Blocks until a new connection
+            SocketStream socket = listener.accept();    // Blocks until a new connection
             if (socket.valid())
             {
+                // Before a thread is spawned or a TLS handshake is done for a connection we won't serve
+                if (!admit())
+                {
+                    LOG(INFO) << "Refusing socket " << socket.getSocketFd() << ", "
+                              << server_manifest.workers.maxConnections << " connections are served already" << std::endl;
+                    // A TLS client couldn't read the answer without the handshake, it's only told by the connection closing
+                    if constexpr (!std::is_same_v<Listener, TLSListener>)
+                        refuse(std::move(socket));
+                    continue;
+                }
                 LOG(DEBUG) << "Accepting new connection" << std::endl;
                 auto thread = std::thread(&worker, std::move(socket));
                 thread.detach();
@@ -156,6 +541,62 @@ namespace ryuuk
                 LOG(ERROR) << "accept() error: Unable to establish connection with remote socket. errno: " << errno << std::endl;
             }
         }
+    }
+
+    void Server::serveMetrics()
+    {
+        while (m_running)
+        {
+            SocketStream socket = m_metricsListener.accept();
+            if (!socket.valid())
+                continue;
+
+            // One scrape at a time, off the workers: read the request, answer with everything and close
+            std::string request;
+            pollfd pfd{socket.getSocketFd(), POLLIN, 0};
+            while (request.find("\r\n\r\n") == std::string::npos && request.size() < 4096 &&
+                   poll(&pfd, 1, MetricsTimeout) > 0)
+            {
+                auto [result, reply] = socket.receive();
+                if (result != ReceiveResult::Success && result != ReceiveResult::WouldBlock)
+                    break;
+                request += reply;
+            }
+
+            std::string response;
+            const bool head = request.compare(0, 5, "HEAD ") == 0;
+            if (request.compare(0, 4, "GET ") == 0 || head)
+            {
+                auto body = Metrics::get().render();
+                response = "HTTP/1.1 200 OK\r\nContent-Type: " + std::string(Metrics::ContentType) +
+                           "\r\nContent-Length: " + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n";
+                if (!head)
+                    response += body;
+            }
+            else
+                response = "HTTP/1.1 405 Method Not Allowed\r\nAllow: GET, HEAD\r\nContent-Length: 0\r\n"
+                           "Connection: close\r\n\r\n";
+
+            std::string_view remaining = response;
+            pfd.events = POLLOUT;
+            while (!remaining.empty())
+            {
+                auto sent = socket.sendSome(remaining);
+                if (sent < 0 || (sent == 0 && poll(&pfd, 1, MetricsTimeout) <= 0))
+                    break;
+                remaining.remove_prefix(sent);
+            }
+        }
+    }
+
+    void Server::run()
+    {
+        LOG(INFO) << "Server running." << std::endl;
+        if (m_tlsListener.valid())
+            std::thread(&Server::acceptConnections<TLSListener>, this, std::ref(m_tlsListener)).detach();
+        if (m_metricsListener.valid())
+            std::thread(&Server::serveMetrics, this).detach();
+        acceptConnections(m_listener);
 
         LOG(DEBUG) << "Shutting down sockets for remaining worker threads and waiting for them to finish" << std::endl;
         for (auto i = m_connections.begin(); i != m_connections.end(); ++i)
@@ -26,7 +26,7 @@ namespace ryuuk
         LOG(DEBUG) << "Created empty SocketListener" << std::endl;
     }
 
-    bool SocketListener::listen(int port, int backlog)
+    bool SocketListener::listen(int port, int backlog, const std::string& address)
     {
         int status;
         addrinfo hints;
@@ -35,10 +35,11 @@ namespace ryuuk
         std::memset(&hints, 0, sizeof hints); // make sure the struct is empty
         hints.ai_family = AF_UNSPEC;     // don't care IPv4 or IPv6
         hints.ai_socktype = SOCK_STREAM; // TCP stream sockets
-        hints.ai_flags = AI_PASSIVE;     // fill in my IP for me
+        hints.ai_flags = address.empty() ? AI_PASSIVE : 0;     // fill in my IP for me, unless given one
 
 
-        if ((status = getaddrinfo(NULL, std::to_string(port).c_str(), &hints, &serverInfo)) != 0)
+        if ((status = getaddrinfo(address.empty() ? NULL : address.c_str(), std::to_string(port).c_str(),
+                                  &hints, &serverInfo)) != 0)
         {
             LOG(ERROR) << "getaddrinfo() error: " << gai_strerror(status) << std::endl;
             return false;
@@ -98,7 +99,9 @@ namespace ryuuk
 
         memset(&client_info, 0, sizeof client_info);
 
-        int client_sockfd = ::accept(m_socketfd, reinterpret_cast<sockaddr*>(&client_info), &addr_size);
+        // Connections are non-blocking, the worker waits for them with poll()
+        int client_sockfd = ::accept4(m_socketfd, reinterpret_cast<sockaddr*>(&client_info), &addr_size,
+                                      SOCK_NONBLOCK | SOCK_CLOEXEC);
 
         if (0 > client_sockfd)
         {
@@ -1,6 +1,12 @@
 #include "SocketStream.hpp"
 
+#include <algorithm>
+#include <cerrno>
 #include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 
 namespace ryuuk
 {
@@ -23,7 +29,9 @@ namespace ryuuk
     }
 
     SocketStream::SocketStream(SocketStream&& other) noexcept   : Socket(other.m_socketfd),
-                                                                  m_clientAddr(other.m_clientAddr)
+                                                                  m_clientAddr(other.m_clientAddr),
+                                                                  m_tls(std::move(other.m_tls)),
+                                                                  m_readAhead(std::move(other.m_readAhead))
     {
         other.m_socketfd = INVALID_SOCKET_FD;
     }
@@ -33,6 +41,8 @@ namespace ryuuk
     {
         if (valid())
         {
+            if (m_tls)
+                m_tls->shutdown();
             shutdown();
             close(m_socketfd);
         }
@@ -43,33 +53,194 @@ namespace ryuuk
         ::shutdown(m_socketfd, SHUT_RDWR);
     }
 
-    std::size_t SocketStream::send(std::string_view data)
+    void SocketStream::startTLS(std::unique_ptr<TLSSession> session)
     {
-        std::size_t totalSent = 0;
-        ssize_t sent = 0;
+        m_tls = std::move(session);
+    }
+
+    TLSStatus SocketStream::handshake()
+    {
+        return m_tls ? m_tls->handshake() : TLSStatus::Done;
+    }
+
+    std::string_view SocketStream::protocol() const
+    {
+        return m_tls ? m_tls->protocol() : std::string_view{};
+    }
+
+    bool SocketStream::userSpaceTLS() const
+    {
+        return m_tls && !m_tls->kernelSend();
+    }
+
+    bool SocketStream::pending() const
+    {
+        return m_tls && m_tls->pending();
+    }
 
-        while (totalSent < data.size())
+    void SocketStream::setNotSentLowat(int bytes)
+    {
+        if (setsockopt(m_socketfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &bytes, sizeof(bytes)) < 0)
+        {
+            LOG(DEBUG) << "setsockopt() : Couldn't set TCP_NOTSENT_LOWAT. errno: " << errno << std::endl;
+        }
+    }
+
+    ssize_t SocketStream::sendSome(std::string_view data, bool more)
+    {
+        if (m_tls)
         {
-            if (0 > (sent = ::send(m_socketfd, (const void *)(data.data() + totalSent), data.size() - totalSent, 0)))
+            std::size_t sent = 0;
+            switch (m_tls->write(data, sent))
             {
-                LOG(ERROR) << "send() : Error in sending data to remote client" << std::endl;
-                return totalSent;
+                case TLSStatus::Done:       return sent;
+                case TLSStatus::WantRead:
+                case TLSStatus::WantWrite:  return 0;
+                default:
+                    LOG(ERROR) << "TLS write error with socket " << m_socketfd << std::endl;
+                    return -1;
             }
+        }
+
+        int flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+        while (true)
+        {
+            ssize_t sent = ::send(m_socketfd, data.data(), data.size(), flags);
+            if (sent >= 0)
+                return sent;
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+
+            LOG(ERROR) << "send() : Error in sending data to remote client. errno: " << errno << std::endl;
+            return -1;
+        }
+    }
+
+    ssize_t SocketStream::sendSome(std::string_view data, std::string_view tail, bool more)
+    {
+        if (tail.empty())
+            return sendSome(data, more);
+        if (data.empty())
+            return sendSome(tail, more);
+        if (m_tls)
+        {
+            // TLS takes them one after the other, into records of its own anyway
+            auto sent = sendSome(data, true);
+            if (sent < 0 || static_cast<std::size_t>(sent) < data.size())
+                return sent;
+            auto sentTail = sendSome(tail, more);
+            return sentTail < 0 ? -1 : sent + sentTail;
+        }
 
-            totalSent += sent;
+        iovec parts[2] = {{const_cast<char*>(data.data()), data.size()},
+                          {const_cast<char*>(tail.data()), tail.size()}};
+        msghdr message{};
+        message.msg_iov = parts;
+        message.msg_iovlen = 2;
+        int flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+        while (true)
+        {
+            ssize_t sent = ::sendmsg(m_socketfd, &message, flags);
+            if (sent >= 0)
+                return sent;
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+
+            LOG(ERROR) << "sendmsg() : Error in sending data to remote client. errno: " << errno << std::endl;
+            return -1;
         }
+    }
 
-//         LOG(DEBUG) << "Sent data to remote client" << std::endl;
+    ssize_t SocketStream::sendFileSome(int fd, off_t offset, std::size_t length)
+    {
+        return sendFileSome(fd, offset, length, offset + length);
+    }
+
+    ssize_t SocketStream::sendFileSome(int fd, off_t offset, std::size_t length, off_t end)
+    {
+        if (m_tls && m_tls->kernelSend())
+        {
+            std::size_t sent = 0;
+            switch (m_tls->sendFile(fd, offset, length, sent))
+            {
+                case TLSStatus::Done:       return sent;
+                case TLSStatus::WantRead:
+                case TLSStatus::WantWrite:  return 0;
+                default:
+                    LOG(ERROR) << "TLS sendfile error with socket " << m_socketfd << std::endl;
+                    return -1;
+            }
+        }
 
-        return totalSent;
+        // Without kTLS, TLS has to encrypt the file in user space
+        while (!m_tls)
+        {
+            ssize_t sent = ::sendfile(m_socketfd, fd, &offset, length);
+            if (sent < 0 && errno == EINTR)
+                continue;
+            if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return 0;
+            if (sent < 0 && (errno == EINVAL || errno == ENOSYS))
+                break;  // Not supported for this pair of descriptors, copy it ourselves instead
+            if (sent < 0)
+            {
+                LOG(ERROR) << "sendfile() : Error in sending data to remote client. errno: " << errno << std::endl;
+                return -1;
+            }
+            if (sent == 0 && length != 0)
+            {
+                LOG(ERROR) << "sendfile() : File shorter than expected" << std::endl;
+                return -1;
+            }
+            return sent;
+        }
+
+        bool failed;
+        auto data = m_readAhead.data(fd, offset, end, failed);
+        if (failed)
+            return -1;
+        if (data.empty())
+            return 0;   // Out of buffers, parked until another transfer gives one back, see bufferWait()
+
+        data = data.substr(0, length);
+        auto sent = sendSome(data, data.size() < length);
+        if (sent > 0 && offset + sent == end)
+            m_readAhead.release(fd);
+        else if (sent >= 0 && static_cast<std::size_t>(sent) < data.size())
+            m_readAhead.prefetch();     // Read on while the socket drains
+        return sent;
     }
 
     std::pair<ReceiveResult, std::string_view> SocketStream::receive()
     {
         ssize_t recvd = 0;
 
-        if (0 > (recvd = recv(m_socketfd, m_rwbuffer,
-                    DEFAULT_MSG_LENGTH, 0)))
+        if (m_tls)
+        {
+            std::size_t received = 0;
+            switch (m_tls->read(m_rwbuffer, DEFAULT_MSG_LENGTH, received))
+            {
+                case TLSStatus::Done:
+                    return {ReceiveResult::Success, {m_rwbuffer, received}};
+                case TLSStatus::WantRead:
+                case TLSStatus::WantWrite:
+                    return {ReceiveResult::WouldBlock, {}};
+                case TLSStatus::Closed:
+                    return {ReceiveResult::Disconnected, {}};
+                case TLSStatus::Failed:
+                    LOG(ERROR) << "TLS read error with socket " << m_socketfd << std::endl;
+                    return {ReceiveResult::Error, {}};
+            }
+        }
+
+        while (0 > (recvd = recv(m_socketfd, m_rwbuffer, DEFAULT_MSG_LENGTH, 0)) && errno == EINTR);
+        if (recvd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return {ReceiveResult::WouldBlock, {}};
+        if (recvd < 0)
         {
             LOG(ERROR) << "recv() : Error in receving data from remote client. errno: " << errno << std::endl;
         }
@@ -0,0 +1,209 @@
+#include "TLS.hpp"
+#include "Log.hpp"
+
+#include <cerrno>
+#include <stdexcept>
+
+#ifdef RYUUK_WITH_OPENSSL
+    #include <openssl/err.h>
+    #include <openssl/ssl.h>
+#endif
+
+namespace ryuuk
+{
+#ifdef RYUUK_WITH_OPENSSL
+    namespace
+    {
+        // What the socket should wait for after an operation failed with `result`
+        TLSStatus statusOf(SSL* ssl, int result)
+        {
+            int error = SSL_get_error(ssl, result);
+            switch (error)
+            {
+                case SSL_ERROR_WANT_READ:   return TLSStatus::WantRead;
+                case SSL_ERROR_WANT_WRITE:  return TLSStatus::WantWrite;
+                case SSL_ERROR_ZERO_RETURN: return TLSStatus::Closed;
+                case SSL_ERROR_SYSCALL:
+                    if (errno == 0)
+                        return TLSStatus::Closed;   // The peer went away without a close_notify
+                    LOG(DEBUG) << "TLS socket error. errno: " << errno << std::endl;
+                    return TLSStatus::Failed;
+                default:
+                    char description[256];
+                    ERR_error_string_n(ERR_get_error(), description, sizeof(description));
+                    LOG(DEBUG) << "TLS error " << error << ": " << description << std::endl;
+                    ERR_clear_error();
+                    return TLSStatus::Failed;
+            }
+        }
+
+        // `protocols` are the TLSContext's
+        int selectProtocol(SSL*, const unsigned char** out, unsigned char* outLength,
+                           const unsigned char* offered, unsigned int offeredLength, void* protocols)
+        {
+            auto& ours = *static_cast<const std::string*>(protocols);
+            if (SSL_select_next_proto(const_cast<unsigned char**>(out), outLength,
+                                      reinterpret_cast<const unsigned char*>(ours.data()), ours.size(),
+                                      offered, offeredLength) == OPENSSL_NPN_NEGOTIATED)
+                return SSL_TLSEXT_ERR_OK;
+            return SSL_TLSEXT_ERR_NOACK;    // Nothing in common, carry on without ALPN rather than fail
+        }
+    }
+
+    TLSSession::~TLSSession()
+    {
+        SSL_free(m_ssl);
+    }
+
+    TLSStatus TLSSession::handshake()
+    {
+        ERR_clear_error();
+        int result = SSL_accept(m_ssl);
+        if (result == 1)
+        {
+            LOG(DEBUG) << "TLS handshake done with " << SSL_get_version(m_ssl)
+                       << (SSL_session_reused(m_ssl) ? ", resumed" : "")
+                       << (kernelSend() ? ", kTLS send" : ", software encryption") << std::endl;
+            return TLSStatus::Done;
+        }
+        return statusOf(m_ssl, result);
+    }
+
+    TLSStatus TLSSession::read(char* buffer, std::size_t size, std::size_t& received)
+    {
+        ERR_clear_error();
+        int result = SSL_read_ex(m_ssl, buffer, size, &received);
+        return result == 1 ? TLSStatus::Done : statusOf(m_ssl, result);
+    }
+
+    TLSStatus TLSSession::write(std::string_view data, std::size_t& sent)
+    {
+        ERR_clear_error();
+        int result = SSL_write_ex(m_ssl, data.data(), data.size(), &sent);
+        return result == 1 ? TLSStatus::Done : statusOf(m_ssl, result);
+    }
+
+    TLSStatus TLSSession::sendFile(int fd, off_t offset, std::size_t length, std::size_t& sent)
+    {
+        ERR_clear_error();
+        auto result = SSL_sendfile(m_ssl, fd, offset, length, 0);
+        if (result < 0)
+            return statusOf(m_ssl, static_cast<int>(result));
+        sent = result;
+        return TLSStatus::Done;
+    }
+
+    bool TLSSession::kernelSend() const
+    {
+        return BIO_get_ktls_send(SSL_get_wbio(m_ssl));
+    }
+
+    bool TLSSession::pending() const
+    {
+        return SSL_has_pending(m_ssl);
+    }
+
+    std::string_view TLSSession::protocol() const
+    {
+        const unsigned char* protocol = nullptr;
+        unsigned int length = 0;
+        SSL_get0_alpn_selected(m_ssl, &protocol, &length);
+        return {reinterpret_cast<const char*>(protocol), length};
+    }
+
+    void TLSSession::shutdown()
+    {
+        if (SSL_is_init_finished(m_ssl))
+        {
+            ERR_clear_error();
+            SSL_shutdown(m_ssl);
+        }
+    }
+
+    TLSContext::TLSContext(const Settings& settings)
+        : m_context(SSL_CTX_new(TLS_server_method()))
+    {
+        if (!m_context)
+            throw std::runtime_error("Couldn't create a TLS context");
+
+        auto fail = [this](const std::string& what)
+        {
+            char description[256];
+            ERR_error_string_n(ERR_get_error(), description, sizeof(description));
+            SSL_CTX_free(m_context);
+            throw std::runtime_error(what + ": " + description);
+        };
+
+        SSL_CTX_set_min_proto_version(m_context, TLS1_2_VERSION);
+        if (SSL_CTX_use_certificate_chain_file(m_context, settings.certificate.c_str()) != 1)
+            fail("Couldn't load the TLS certificate " + settings.certificate);
+        if (SSL_CTX_use_PrivateKey_file(m_context, settings.privateKey.c_str(), SSL_FILETYPE_PEM) != 1)
+            fail("Couldn't load the TLS private key " + settings.privateKey);
+        if (SSL_CTX_check_private_key(m_context) != 1)
+            fail("The TLS private key doesn't match the certificate");
+
+        SSL_CTX_set_options(m_context, SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE |
+                                       (settings.kernelOffload ? SSL_OP_ENABLE_KTLS : 0));
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+        // Clients drop connections without a close_notify all the time, that's a close and not an error
+        SSL_CTX_set_options(m_context, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+        // Writes may complete partially and be retried from wherever the rest of the data is, as sendSome() expects
+        SSL_CTX_set_mode(m_context, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                                    SSL_MODE_RELEASE_BUFFERS);
+
+        // Resumption by session ID, tickets (the default) cover the clients that prefer them
+        static const unsigned char SessionContext[] = "ryuuk";
+        SSL_CTX_set_session_cache_mode(m_context, SSL_SESS_CACHE_SERVER);
+        SSL_CTX_sess_set_cache_size(m_context, settings.sessionCacheSize);
+        SSL_CTX_set_timeout(m_context, settings.sessionTimeout);
+        SSL_CTX_set_session_id_context(m_context, SessionContext, sizeof(SessionContext) - 1);
+
+        m_protocols = settings.http2 ? "\x02h2\x08http/1.1" : "\x08http/1.1";
+        SSL_CTX_set_alpn_select_cb(m_context, selectProtocol, &m_protocols);
+    }
+
+    TLSContext::~TLSContext()
+    {
+        SSL_CTX_free(m_context);
+    }
+
+    std::unique_ptr<TLSSession> TLSContext::accept(int fd)
+    {
+        SSL* ssl = SSL_new(m_context);
+        if (!ssl)
+            return nullptr;
+        if (SSL_set_fd(ssl, fd) != 1)
+        {
+            SSL_free(ssl);
+            return nullptr;
+        }
+        SSL_set_accept_state(ssl);
+        return std::unique_ptr<TLSSession>(new TLSSession(ssl));
+    }
+#else
+    // Built without OpenSSL, there can't be any sessions
+
+    TLSSession::~TLSSession() {}
+    TLSStatus TLSSession::handshake() { return TLSStatus::Failed; }
+    TLSStatus TLSSession::read(char*, std::size_t, std::size_t&) { return TLSStatus::Failed; }
+    TLSStatus TLSSession::write(std::string_view, std::size_t&) { return TLSStatus::Failed; }
+    TLSStatus TLSSession::sendFile(int, off_t, std::size_t, std::size_t&) { return TLSStatus::Failed; }
+    bool TLSSession::kernelSend() const { return false; }
+    bool TLSSession::pending() const { return false; }
+    std::string_view TLSSession::protocol() const { return {}; }
+    void TLSSession::shutdown() {}
+
+    TLSContext::TLSContext(const Settings&)
+    {
+        throw std::runtime_error("ryuuk was built without OpenSSL, TLS isn't available");
+    }
+
+    TLSContext::~TLSContext() {}
+
+    std::unique_ptr<TLSSession> TLSContext::accept(int)
+    {
+        return nullptr;
+    }
+#endif
+}
@@ -0,0 +1,28 @@
+#include "TLSListener.hpp"
+#include "Log.hpp"
+
+
+namespace ryuuk
+{
+    bool TLSListener::listen(int port, int backlog, const TLSContext::Settings& settings)
+    {
+        m_context = std::make_unique<TLSContext>(settings);
+        return m_listener.listen(port, backlog);
+    }
+
+    SocketStream TLSListener::accept()
+    {
+        SocketStream socket = m_listener.accept();
+        if (!socket.valid())
+            return socket;
+
+        auto session = m_context->accept(socket.getSocketFd());
+        if (!session)
+        {
+            LOG(ERROR) << "Couldn't create a TLS session for socket " << socket.getSocketFd() << std::endl;
+            return SocketStream{};
+        }
+        socket.startTLS(std::move(session));
+        return socket;
+    }
+}
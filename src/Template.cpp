@@ -0,0 +1,289 @@
+#include "Template.hpp"
+#include "Log.hpp"
+
+#include <algorithm>
+#include <array>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <tuple>
+
+namespace ryuuk
+{
+    namespace
+    {
+        // For each byte, the character reference replacing it in HTML, or null if it stands for itself
+        constexpr auto HtmlReferences = []
+        {
+            std::array<const char*, 256> table{};
+            table['&']  = "&amp;";
+            table['<']  = "&lt;";
+            table['>']  = "&gt;";
+            table['"']  = "&quot;";
+            table['\''] = "&#39;";
+            return table;
+        }();
+
+        // For each byte, whether it may appear in a URL path as it is
+        constexpr auto UrlSafe = []
+        {
+            std::array<bool, 256> table{};
+            for (int c = 'a'; c <= 'z'; ++c)
+                table[c] = true;
+            for (int c = 'A'; c <= 'Z'; ++c)
+                table[c] = true;
+            for (int c = '0'; c <= '9'; ++c)
+                table[c] = true;
+            for (char c : {'-', '.', '_', '~', '/'})
+                table[static_cast<unsigned char>(c)] = true;
+            return table;
+        }();
+
+        bool isNameCharacter(char c)
+        {
+            return (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+        }
+
+        const char* const DefaultListing =
+            "<html>\n<head><title>Directory Listing for $DIR</title></head>\n<body>\n"
+            "<h2>Index of $DIR</h2><hr/>\n<ul>\n${LIST|raw}</ul>\n<hr>"
+            "<i>Hosted using <a href=\"https://github.com/amhndu/ryuuk\">Ryuuk</a></i>"
+            "</body>\n</html>";
+
+        const char* const DefaultListingEntry = "<li><a href=\"${NAME|url}\">$NAME</a></li>\n";
+
+        const char* const DefaultError =
+            "<html><head><title>Ryuuk</title></head><body><h2>$CODE $REASON</h2><hr><br><br>"
+            "The requested resource could not be sent. Light got to this location before you, unfortunately."
+            "<br/><br/><br/><hr>"
+            "<i>Hosted using <a href=\"https://github.com/amhndu/ryuuk\">Ryuuk</a></i></body></html>";
+
+        const char* const DefaultRedirect =
+            "<html><head><title>Ryuuk</title></head><body><h2>$CODE $REASON</h2><hr><br><br>"
+            "The requested resource has moved, follow the Location it was sent with."
+            "<br/><br/><br/><hr>"
+            "<i>Hosted using <a href=\"https://github.com/amhndu/ryuuk\">Ryuuk</a></i></body></html>";
+
+        PageTemplates& templates()
+        {
+            static PageTemplates instance = []
+            {
+                PageTemplates defaults;
+                std::tie(defaults.listingHead, defaults.listingTail) =
+                        Template(DefaultListing, {"DIR", "LIST"}).splitAt("LIST");
+                defaults.listingEntry = Template(DefaultListingEntry, {"NAME"});
+                defaults.error = Template(DefaultError, {"CODE", "REASON"});
+                defaults.errors[301] = Template(DefaultRedirect, {"CODE", "REASON"});
+                return defaults;
+            }();
+            return instance;
+        }
+    }
+
+    void appendHtmlEscaped(std::string& out, std::string_view text)
+    {
+        // Copy runs of characters needing no escaping in one go
+        std::size_t run = 0;
+        for (std::size_t i = 0; i < text.size(); ++i)
+        {
+            if (auto reference = HtmlReferences[static_cast<unsigned char>(text[i])])
+            {
+                out.append(text.data() + run, i - run);
+                out += reference;
+                run = i + 1;
+            }
+        }
+        out.append(text.data() + run, text.size() - run);
+    }
+
+    void appendUrlEncoded(std::string& out, std::string_view text)
+    {
+        static const char hex[] = "0123456789ABCDEF";
+        std::size_t run = 0;
+        for (std::size_t i = 0; i < text.size(); ++i)
+        {
+            auto c = static_cast<unsigned char>(text[i]);
+            if (!UrlSafe[c])
+            {
+                out.append(text.data() + run, i - run);
+                const char encoded[] = {'%', hex[c >> 4], hex[c & 0xf]};
+                out.append(encoded, sizeof(encoded));
+                run = i + 1;
+            }
+        }
+        out.append(text.data() + run, text.size() - run);
+    }
+
+    Template::Template(std::string_view source, std::initializer_list<std::string_view> variables)
+        : m_variables(variables.begin(), variables.end())
+    {
+        auto addLiteral = [this](std::string_view text)
+        {
+            if (text.empty())
+                return;
+            // Literals following each other are merged
+            if (!m_segments.empty() && m_segments.back().variable == -1)
+                m_segments.back().length += text.size();
+            else
+                m_segments.push_back({m_literals.size(), text.size()});
+            m_literals += text;
+        };
+
+        while (!source.empty())
+        {
+            auto dollar = source.find('$');
+            addLiteral(source.substr(0, dollar));
+            if (dollar == std::string_view::npos)
+                break;
+            source.remove_prefix(dollar + 1);
+
+            std::string_view name, filter;
+            if (!source.empty() && source.front() == '{')
+            {
+                auto close = source.find('}');
+                if (close == std::string_view::npos)
+                    throw std::invalid_argument("Unterminated placeholder ${" + std::string{source} + " in template");
+                auto placeholder = source.substr(1, close - 1);
+                source.remove_prefix(close + 1);
+
+                auto bar = placeholder.find('|');
+                name = placeholder.substr(0, bar);
+                if (bar != std::string_view::npos)
+                    filter = placeholder.substr(bar + 1);
+            }
+            else
+            {
+                std::size_t length = 0;
+                while (length < source.size() && isNameCharacter(source[length]))
+                    ++length;
+                name = source.substr(0, length);
+                source.remove_prefix(length);
+                if (name.empty())
+                {
+                    addLiteral("$");
+                    continue;
+                }
+            }
+
+            Segment segment{0, 0};
+            auto variable = std::find(m_variables.begin(), m_variables.end(), name);
+            if (variable == m_variables.end())
+                throw std::invalid_argument("Unknown placeholder $" + std::string{name} + " in template");
+            segment.variable = variable - m_variables.begin();
+
+            if (filter == "url")
+                segment.filter = Url;
+            else if (filter == "raw")
+                segment.filter = Raw;
+            else if (!filter.empty() && filter != "html")
+                throw std::invalid_argument("Unknown filter " + std::string{filter} + " for $" + std::string{name});
+            m_segments.push_back(segment);
+        }
+    }
+
+    Template Template::fromFile(const std::string& path, std::initializer_list<std::string_view> variables)
+    {
+        std::ifstream file(path, std::ios::in | std::ios::binary);
+        if (!file)
+            throw std::runtime_error("Couldn't open template " + path);
+        std::string source{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+        return Template(source, variables);
+    }
+
+    void Template::render(std::string& out, std::initializer_list<std::string_view> values) const
+    {
+        // Enough for the common case of values that need no escaping, so there's a single allocation
+        std::size_t size = m_literals.size();
+        for (const auto& segment : m_segments)
+            if (segment.variable >= 0 && static_cast<std::size_t>(segment.variable) < values.size())
+                size += values.begin()[segment.variable].size();
+        if (out.capacity() < out.size() + size)
+            out.reserve(std::max(out.size() + size, 2 * out.capacity()));
+
+        for (const auto& segment : m_segments)
+        {
+            if (segment.variable < 0)
+            {
+                out.append(m_literals, segment.offset, segment.length);
+                continue;
+            }
+            if (static_cast<std::size_t>(segment.variable) >= values.size())
+                continue;
+
+            auto value = values.begin()[segment.variable];
+            switch (segment.filter)
+            {
+                case Html:  appendHtmlEscaped(out, value);  break;
+                case Url:   appendUrlEncoded(out, value);   break;
+                case Raw:   out += value;                   break;
+            }
+        }
+    }
+
+    std::pair<Template, Template> Template::splitAt(std::string_view variable) const
+    {
+        std::pair<Template, Template> parts;
+        parts.first.m_literals = parts.second.m_literals = m_literals;
+        parts.first.m_variables = parts.second.m_variables = m_variables;
+
+        auto split = std::find_if(m_segments.begin(), m_segments.end(), [&](const Segment& segment)
+        {
+            return segment.variable >= 0 && m_variables[segment.variable] == variable;
+        });
+        parts.first.m_segments.assign(m_segments.begin(), split);
+        if (split != m_segments.end())
+            parts.second.m_segments.assign(split + 1, m_segments.end());
+        return parts;
+    }
+
+    void PageTemplates::load(const Paths& paths)
+    {
+        auto& pages = templates();
+        auto loadTemplate = [](const std::string& path, auto&& apply)
+        {
+            if (path.empty())
+                return;
+            try
+            {
+                apply(path);
+                LOG(INFO) << "Loaded template " << path << std::endl;
+            }
+            catch (const std::exception& e)
+            {
+                LOG(ERROR) << e.what() << ", using the built in template instead" << std::endl;
+            }
+        };
+
+        loadTemplate(paths.listing, [&](const std::string& path)
+        {
+            std::tie(pages.listingHead, pages.listingTail) =
+                    Template::fromFile(path, {"DIR", "LIST"}).splitAt("LIST");
+        });
+        loadTemplate(paths.listingEntry, [&](const std::string& path)
+        {
+            pages.listingEntry = Template::fromFile(path, {"NAME"});
+        });
+        loadTemplate(paths.error, [&](const std::string& path)
+        {
+            pages.error = Template::fromFile(path, {"CODE", "REASON"});
+        });
+        for (const auto& [code, file] : paths.errors)
+        {
+            loadTemplate(file, [&, code = code](const std::string& path)
+            {
+                pages.errors[code] = Template::fromFile(path, {"CODE", "REASON"});
+            });
+        }
+    }
+
+    const Template& PageTemplates::errorPage(int code) const
+    {
+        auto page = errors.find(code);
+        return page != errors.end() ? page->second : error;
+    }
+
+    const PageTemplates& PageTemplates::get()
+    {
+        return templates();
+    }
+}
@@ -0,0 +1,329 @@
+#include "Trace.hpp"
+#include "Log.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <iterator>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <cpuid.h>
+#endif
+
+namespace ryuuk
+{
+    namespace
+    {
+        // How long the writer sleeps when it found nothing to write
+        const std::chrono::milliseconds IdleInterval{10};
+
+        // Events queued for the writer, past which those of further requests are dropped
+        const std::size_t MaxQueued = 16 * 1024 * 1024;
+
+        // Whether the TSC ticks at the same rate whatever the frequency and sleep state of the core
+        bool invariantTSC()
+        {
+#if defined(__x86_64__) || defined(__i386__)
+            unsigned a, b, c, d;
+            if (!__get_cpuid(0x80000007, &a, &b, &c, &d))
+                return false;
+            return d & (1u << 8);
+#else
+            return false;
+#endif
+        }
+
+        long threadId()
+        {
+            thread_local long id = ::syscall(SYS_gettid);
+            return id;
+        }
+
+        void appendJsonString(std::string& out, std::string_view value)
+        {
+            static const char hex[] = "0123456789abcdef";
+            out += '"';
+            for (unsigned char c : value)
+            {
+                if (c == '"' || c == '\\')
+                    (out += '\\') += c;
+                else if (c < 0x20)
+                    ((out += "\\u00") += hex[c >> 4]) += hex[c & 15];
+                else
+                    out += c;
+            }
+            out += '"';
+        }
+
+        std::string format(const char* format, double value)
+        {
+            char text[32];
+            std::snprintf(text, sizeof(text), format, value);
+            return text;
+        }
+    }
+
+    // The events of a request, queued for the writer
+    struct Trace::Batch
+    {
+        std::string events;
+        Batch* next;
+    };
+
+    bool Trace::s_enabled = false;
+    bool Trace::s_tsc = false;
+
+    Trace& Trace::get()
+    {
+        // Never freed, so the (detached) writer can't outlive it during static destruction
+        static Trace* instance = new Trace;
+        return *instance;
+    }
+
+    std::uint64_t Trace::monotonicNow()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void Trace::configure(const Settings& settings)
+    {
+        close();
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_settings = settings;
+        s_enabled = settings.sampleRate != 0 || settings.slowThreshold != 0;
+        if (!s_enabled)
+            return;
+
+        calibrate();
+        m_thresholdTicks = static_cast<std::uint64_t>(settings.slowThreshold * 1000 / m_nsPerTick);
+
+        // Slow requests are still logged without it
+        m_file = ::open(settings.file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (m_file < 0)
+        {
+            LOG(ERROR) << "Couldn't open the trace file " << settings.file << ", errno: " << errno << std::endl;
+            return;
+        }
+        writeOut("[\n");
+        m_open.store(true, std::memory_order_relaxed);
+        if (!m_running)
+        {
+            m_running = true;
+            std::thread(&Trace::run, this).detach();
+        }
+    }
+
+    void Trace::calibrate()
+    {
+        s_tsc = false;
+        m_nsPerTick = 1;
+        m_baseTicks = m_baseNs = 0;
+#if defined(__x86_64__) || defined(__i386__)
+        if (!invariantTSC())
+        {
+            LOG(INFO) << "The TSC doesn't tick at a constant rate, tracing with the monotonic clock" << std::endl;
+            return;
+        }
+
+        const auto startNs = monotonicNow();
+        const auto startTicks = __rdtsc();
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        m_baseNs = monotonicNow();
+        m_baseTicks = __rdtsc();
+        m_nsPerTick = double(m_baseNs - startNs) / double(m_baseTicks - startTicks);
+        s_tsc = true;
+        LOG(INFO) << "Tracing with the TSC, at " << format("%.3f", 1 / m_nsPerTick) << " GHz" << std::endl;
+#endif
+    }
+
+    double Trace::toMicroseconds(std::uint64_t ticks) const
+    {
+        // Ticks before the base come out negative as they should
+        auto sinceBase = static_cast<double>(static_cast<std::int64_t>(ticks - m_baseTicks));
+        return (m_baseNs + sinceBase * m_nsPerTick) / 1000;
+    }
+
+    void Trace::finish(const Marks& marks, const accesslog::Record& record, const PerfCounters::Reading* counters)
+    {
+        int first = marks.at[Start] ? Start : Received;
+        if (!marks.at[first] || !marks.at[Sent])
+            return;
+
+        const auto total = marks.at[Sent] - marks.at[first];
+        const bool slow = m_settings.slowThreshold != 0 && total >= m_thresholdTicks;
+        thread_local std::uint64_t requests = 0;
+        const bool sampled = m_settings.sampleRate != 0 && ++requests % m_settings.sampleRate == 0;
+        if (!slow && !sampled)
+            return;
+
+        std::string requestLine = record.method < std::size(accesslog::MethodNames) ? accesslog::MethodNames[record.method]
+                                                                                     : "-";
+        requestLine += ' ';
+        requestLine += marks.target;
+        requestLine += record.version == 20 ? " HTTP/2" : record.version == 10 ? " HTTP/1.0" : " HTTP/1.1";
+
+        // The request, then its phases nested in it. A phase whose mark wasn't reached is part of the next one.
+        const auto id = std::to_string(m_sequence.fetch_add(1, std::memory_order_relaxed));
+        const auto where = ",\"pid\":" + std::to_string(::getpid()) + ",\"tid\":" + std::to_string(threadId());
+        std::string events;
+        auto event = [&](std::string_view name, char phase, std::uint64_t ticks, const std::string& args)
+        {
+            events += "{\"name\":";
+            appendJsonString(events, name);
+            ((events += ",\"cat\":\"request\",\"ph\":\"") += phase) += "\",\"id\":" + id;
+            events += ",\"ts\":" + format("%.3f", toMicroseconds(ticks)) + where;
+            if (!args.empty())
+                events += ",\"args\":" + args;
+            events += "},\n";
+        };
+
+        std::string args = "{\"request\":";
+        appendJsonString(args, requestLine);
+        args += ",\"status\":" + std::to_string(record.status) + ",\"bytes\":" + std::to_string(record.bytesSent);
+        args += slow ? ",\"slow\":true}" : "}";
+        event(requestLine, 'b', marks.at[first], args);
+
+        std::string breakdown;
+        int previous = first;
+        for (int mark = first + 1; mark < MarkCount; ++mark)
+        {
+            if (!marks.at[mark])
+                continue;
+            std::string phaseArgs;
+            if (counters && counters[previous].taken && counters[mark].taken)
+            {
+                std::uint64_t count[PerfCounters::EventCount];
+                for (int e = 0; e < PerfCounters::EventCount; ++e)
+                {
+                    count[e] = counters[mark].count[e] - counters[previous].count[e];
+                    if (!PerfCounters::counts(PerfCounters::Event(e)))
+                        continue;
+                    phaseArgs += phaseArgs.empty() ? "{\"" : ",\"";
+                    (phaseArgs += PerfCounters::EventNames[e]) += "\":" + std::to_string(count[e]);
+                }
+                if (PerfCounters::counts(PerfCounters::Instructions) && count[PerfCounters::Cycles] != 0)
+                    phaseArgs += ",\"ipc\":" + format("%.3f", double(count[PerfCounters::Instructions]) /
+                                                              count[PerfCounters::Cycles]);
+                phaseArgs += '}';
+            }
+            event(PhaseNames[mark], 'b', marks.at[previous], phaseArgs);
+            event(PhaseNames[mark], 'e', marks.at[mark], {});
+            breakdown += breakdown.empty() ? "" : ", ";
+            breakdown += PhaseNames[mark];
+            breakdown += ' ' + format("%.3f", (marks.at[mark] - marks.at[previous]) * m_nsPerTick / 1e6) + " ms";
+            previous = mark;
+        }
+        event(requestLine, 'e', marks.at[Sent], {});
+
+        if (slow)
+        {
+            LOG(INFO) << "Slow request, " << format("%.3f", total * m_nsPerTick / 1e6) << " ms: " << requestLine
+                      << " " << record.status << " (" << breakdown << ")" << std::endl;
+        }
+
+        if (!m_open.load(std::memory_order_relaxed))
+            return;
+        const auto size = events.size();
+        if (m_queuedBytes.fetch_add(size, std::memory_order_relaxed) + size > MaxQueued)
+        {
+            m_queuedBytes.fetch_sub(size, std::memory_order_relaxed);
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        auto batch = new Batch{std::move(events), m_queued.load(std::memory_order_relaxed)};
+        while (!m_queued.compare_exchange_weak(batch->next, batch, std::memory_order_release, std::memory_order_relaxed))
+            ;
+    }
+
+    void Trace::take(std::string& events)
+    {
+        // Put back in order, oldest first
+        Batch* ordered = nullptr;
+        for (auto batch = m_queued.exchange(nullptr, std::memory_order_acquire); batch; )
+        {
+            auto next = batch->next;
+            batch->next = ordered;
+            ordered = batch;
+            batch = next;
+        }
+        while (ordered)
+        {
+            events += ordered->events;
+            m_queuedBytes.fetch_sub(ordered->events.size(), std::memory_order_relaxed);
+            delete std::exchange(ordered, ordered->next);
+        }
+
+        auto dropped = m_dropped.load(std::memory_order_relaxed);
+        if (dropped != m_reported)
+        {
+            LOG(ERROR) << dropped - m_reported << " requests left out of the trace, the trace file couldn't keep up"
+                       << std::endl;
+            m_reported = dropped;
+        }
+    }
+
+    void Trace::run()
+    {
+        std::string events;
+        while (true)
+        {
+            events.clear();
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (m_file < 0)
+                {
+                    m_running = false;
+                    return;
+                }
+                take(events);
+                if (!events.empty())
+                    writeOut(events);
+            }
+
+            if (events.empty())
+                std::this_thread::sleep_for(IdleInterval);
+        }
+    }
+
+    void Trace::writeOut(const std::string& events)
+    {
+        const char* data = events.data();
+        std::size_t length = events.size();
+        while (length != 0)
+        {
+            auto written = ::write(m_file, data, length);
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written <= 0)
+            {
+                LOG(ERROR) << "Couldn't write to the trace file, errno: " << errno << std::endl;
+                break;
+            }
+            data += written;
+            length -= written;
+        }
+    }
+
+    void Trace::close()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_open.store(false, std::memory_order_relaxed);
+        if (m_file < 0)
+            return;
+
+        // A last event, without a comma after it, to close the array
+        std::string events;
+        take(events);
+        events += "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" + std::to_string(::getpid()) +
+                  ",\"args\":{\"name\":\"ryuuk\"}}\n]\n";
+        writeOut(events);
+        ::close(m_file);
+        m_file = -1;
+    }
+}
@@ -5,10 +5,12 @@
 */
 
 #include <sstream>
-#include <iterator>
-#include <vector>
+#include <stdexcept>
 #include <dirent.h>
 #include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "Utility.hpp"
 #include "Log.hpp"
@@ -36,75 +38,104 @@ namespace ryuuk
             return Other;
     }
 
-    std::string sanitizePath(const std::string& path)
+    namespace
     {
-        std::vector<std::string> dirs;
+        // Length of the prefix of `text` with neither '/' nor '%', that can be copied as it is
+        std::size_t plainRun(const char* text, std::size_t size)
+        {
+            std::size_t i = 0;
+#ifdef __SSE2__
+            // Most segments have no escapes at all, so 16 bytes at a time
+            const auto slash = _mm_set1_epi8('/'), percent = _mm_set1_epi8('%');
+            for (; i + 16 <= size; i += 16)
+            {
+                auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i));
+                auto special = _mm_or_si128(_mm_cmpeq_epi8(chunk, slash), _mm_cmpeq_epi8(chunk, percent));
+                if (auto mask = _mm_movemask_epi8(special))
+                    return i + __builtin_ctz(mask);
+            }
+#endif
+            while (i < size && text[i] != '/' && text[i] != '%')
+                ++i;
+            return i;
+        }
 
-        // Split the path into dirs (split by '/')
-        std::stringstream ss(path);
-        std::string item;
-        while (std::getline(ss, item, '/'))
-            dirs.push_back(item);
+        int hexValue(char c)
+        {
+            if (c >= '0' && c <= '9')
+                return c - '0';
+            if (c >= 'a' && c <= 'f')
+                return c - 'a' + 10;
+            if (c >= 'A' && c <= 'F')
+                return c - 'A' + 10;
+            return -1;
+        }
+    }
 
-        // Ignore . and normalize .. by "deleting" previous non-empty directory from the path.
-        for (std::size_t i = 0; i < dirs.size(); ++i)
+    void normalizePath(std::string_view path, std::string& out)
+    {
+        path = path.substr(0, path.find_first_of("?#"));
+
+        // Kept segments are written to out followed by a slash, the one being decoded comes after them
+        const auto root = out.size();
+        auto segment = root;
+        auto endSegment = [&]
         {
-            if (dirs[i] == ".")
-                dirs[i] = {};
-            else if (dirs[i] == "..")
+            std::string_view name{out.data() + segment, out.size() - segment};
+            if (name.empty() || name == ".")
+                out.resize(segment);
+            else if (name == "..")
             {
-                dirs[i] = {};
-
-                auto saved = i;
-                do
-                {
-                    if (i == 0)   // Underflow, ie. going above the current working directory
-                        throw std::domain_error("Path outside current directory");
-                    else
-                        --i;
-                }
-                while (dirs[i].empty());
-                dirs[i] = {};
-                i = saved;
+                if (segment == root)   // Going above the current working directory
+                    throw std::domain_error("Path outside current directory");
+                // Drop the previous segment, which is followed by the slash at segment - 1
+                auto previous = out.rfind('/', segment - 2);
+                out.resize(previous == std::string::npos || previous < root ? root : previous + 1);
             }
-            else // URL decode
+            else
+                out += '/';
+            segment = out.size();
+        };
+
+        std::size_t i = 0;
+        while (i < path.size())
+        {
+            auto run = plainRun(path.data() + i, path.size() - i);
+            out.append(path.data() + i, run);
+            i += run;
+            if (i == path.size())
+                break;
+
+            if (path[i] == '/')
             {
-                std::size_t j = 0;
-                //auto x = dirs[i].find('d');
-                //auto y = dirs[i].find('%');
-                while ((j = dirs[i].find('%', j)) != std::string::npos)
-                {
-                    if (j + 2 >= dirs[i].size())
-                    {
-                        LOG(INFO) << "Malformed URL" << std::endl;
-                        throw std::domain_error("URL decoding error");
-                    }
-
-                    const std::string hex_ciphers{"0123456789abcdef"};
-                    char c = 0;
-                    for (std::size_t k = j + 1; k <= j + 2; ++k)
-                    {
-                        auto p = hex_ciphers.find(dirs[i][k]);
-                        if (p != std::string::npos)
-                            c = c * 16 + p;
-                        else
-                            throw std::domain_error("URL decoding error");
-                    }
-
-                    dirs[i].replace(j, 3, &c, 1);
-                }
+                endSegment();
+                ++i;
+                continue;
             }
-        }
 
-        ss.clear();
-        ss.str({});
-        std::copy_if(dirs.begin(), dirs.end(), std::ostream_iterator<std::string>(ss, "/"),
-                     [](const std::string& s){ return !s.empty(); });
+            // URL decode
+            int high = i + 2 < path.size() ? hexValue(path[i + 1]) : -1,
+                low  = high >= 0 ? hexValue(path[i + 2]) : -1;
+            if (low < 0)
+            {
+                LOG(INFO) << "Malformed URL" << std::endl;
+                throw std::domain_error("URL decoding error");
+            }
+            char c = static_cast<char>(high * 16 + low);
+            i += 3;
+            // No file name has either of these, an encoded slash still separates segments
+            if (c == '\0')
+                throw std::domain_error("URL decoding error");
+            if (c == '/')
+                endSegment();
+            else
+                out += c;
+        }
+        endSegment();
 
-        auto str = ss.str();
-        if (!str.empty() && path.back() != '/')   // Remove the last slash if the original path didn't had it
-            str.erase(str.size() - 1);
-        return str;
+        // Keep the trailing slash only if the original path had it
+        if (out.size() != root && (path.empty() || path.back() != '/'))
+            out.pop_back();
     }
 
     std::string conv(const std::string& s)
@@ -119,16 +150,4 @@ namespace ryuuk
         }
         return r.str();
     }
-
-    std::string replaceAll(const std::string& str, const std::string& key, const std::string& replacement)
-    {
-        std::string result {str};
-        std::size_t i = 0;
-        while ((i = result.find(key, i)) != std::string::npos)
-        {
-            result.replace(i, key.size(), replacement);
-            i += replacement.size();
-        }
-        return result;
-    }
 }
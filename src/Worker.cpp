@@ -1,80 +1,333 @@
 #include "Worker.hpp"
 #include "HTTP.hpp"
+#include "OutputQueue.hpp"
+#include "HTTP2.hpp"
+#include "Metrics.hpp"
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <list>
+#include <mutex>
 #include <string_view>
+#include <thread>
+#include <vector>
+#include <poll.h>
+#include <sys/socket.h>
 
 
 namespace ryuuk
 {
     namespace
     {
-    std::size_t handleRequest(const std::string& request, SocketStream& socket)
+    WorkerSettings settings;
+
+    // Whether the connection stays open after the response
+    struct Handled
+    {
+        std::size_t bytesRead;      // 0 if there's no complete request yet
+        bool keepAlive;
+    };
+
+    Handled handleRequest(const std::string& request, Response& response, unsigned int flags)
     {
         HTTP http;
-        HTTP::Result result = http.buildResponse(request);
+        HTTP::Result result = http.buildResponse(request, response, flags);
+        return {result.bytesRead, result.keepAlive};
+    }
+
+    // Time a client gets to complete the TLS handshake
+    const int HandshakeTimeout = 10000;     // ms
+
+    // Time a refused client gets to send its request and take the answer
+    const int RefusalTimeout = 1000;        // ms
 
-        // If bytesRead is 0, that means the request is incomplete (or possibly malformed)
-        // We thus return here, and wait for it to complete in the next attempt.
-        if (result.bytesRead == 0)
-            return 0;
+    // Connections admitted, from their acceptance until their worker returns
+    std::atomic<std::size_t> connections{0};
 
-        for (auto chunk = result.response->nextChunk(); !chunk.empty();
-                  chunk = result.response->nextChunk())
+    // Gives back the place admit() took for the connection, however its worker returns
+    struct Admission
+    {
+        ~Admission() { --connections; }
+    };
+
+    // Counts the connection being served for as long as it is
+    struct ConnectionCount
+    {
+        ConnectionCount() { Metrics::local().connectionsOpened.add(); }
+        ~ConnectionCount()
         {
-            if (socket.send(chunk) != chunk.size())
+            Metrics::local().setActive(false);
+            Metrics::local().connectionsClosed.add();
+        }
+    };
+
+    /**
+    * Refused connections, which were answered already, drained of their requests on a
+    * thread of their own until the client closes them or RefusalTimeout has passed:
+    * closing one with the request unread would reset it and could lose the answer.
+    */
+    class Refusals
+    {
+    public:
+        static Refusals& get()
+        {
+            // Never freed, so the (detached) thread can't outlive it during static destruction
+            static Refusals* instance = new Refusals;
+            return *instance;
+        }
+
+        void add(SocketStream&& socket)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_added.emplace_back(std::move(socket), std::chrono::steady_clock::now() +
+                                                    std::chrono::milliseconds(RefusalTimeout));
+            if (!m_running)
             {
-                LOG(ERROR) << "couldn't send http response. errno: " << errno << std::endl;
-                throw std::runtime_error("send error");
+                m_running = true;
+                std::thread(&Refusals::run, this).detach();
             }
+            m_wake.notify_one();
         }
 
-        return result.bytesRead;
+    private:
+        using Lingering = std::pair<SocketStream, std::chrono::steady_clock::time_point>;
+
+        // Often enough for those added meanwhile not to linger much longer than they're meant to
+        static constexpr int PollInterval = 100;   // ms
+
+        Refusals() = default;
+
+        void run()
+        {
+            std::list<Lingering> sockets;
+            std::vector<pollfd> pfds;
+            while (true)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(m_mutex);
+                    m_wake.wait(lock, [&]{ return !sockets.empty() || !m_added.empty(); });
+                    sockets.splice(sockets.end(), m_added);
+                }
+
+                pfds.clear();
+                for (const auto& [socket, deadline] : sockets)
+                    pfds.push_back({socket.getSocketFd(), POLLIN, 0});
+                ::poll(pfds.data(), pfds.size(), PollInterval);
+
+                auto now = std::chrono::steady_clock::now();
+                auto pfd = pfds.begin();
+                for (auto it = sockets.begin(); it != sockets.end(); ++pfd)
+                {
+                    auto& [socket, deadline] = *it;
+                    bool done = now > deadline;
+                    if (!done && pfd->revents)
+                    {
+                        auto result = ReceiveResult::Success;
+                        while (result == ReceiveResult::Success)
+                            result = socket.receive().first;
+                        done = result != ReceiveResult::WouldBlock;
+                    }
+                    it = done ? sockets.erase(it) : std::next(it);
+                }
+            }
+        }
+
+        std::mutex m_mutex;
+        std::condition_variable m_wake;
+        std::list<Lingering> m_added;
+        bool m_running = false;
+    };
+
+    bool finishHandshake(SocketStream& socket)
+    {
+        for (auto status = socket.handshake(); status != TLSStatus::Done; status = socket.handshake())
+        {
+            if (status != TLSStatus::WantRead && status != TLSStatus::WantWrite)
+            {
+                LOG(DEBUG) << "TLS handshake failed with socket " << socket.getSocketFd() << std::endl;
+                return false;
+            }
+
+            pollfd pfd{socket.getSocketFd(), static_cast<short>(status == TLSStatus::WantRead ? POLLIN : POLLOUT), 0};
+            int ready = poll(&pfd, 1, HandshakeTimeout);
+            if (ready < 0 && errno == EINTR)
+                continue;
+            if (ready <= 0)
+            {
+                LOG(DEBUG) << "TLS handshake timed out with socket " << socket.getSocketFd() << std::endl;
+                return false;
+            }
+        }
+        return true;
     }
     }
 
+    void configureWorkers(const WorkerSettings& newSettings)
+    {
+        settings = newSettings;
+    }
+
+    bool admit()
+    {
+        if (++connections <= settings.maxConnections || settings.maxConnections == 0)
+            return true;
+        --connections;
+        return false;
+    }
+
+    void refuse(SocketStream&& socket)
+    {
+        OutputQueue output(1);
+        auto& response = output.prepare();
+        response.markReceived();
+        response.markParsed();
+        ResponseCreator(response).create(ResponseCreator::ServiceUnavailable);
+        response.markCreated();
+        output.push();
+
+        // A new connection's send buffer takes the whole answer, if it doesn't the client isn't worth waiting for
+        if (output.flush(socket) && output.empty())
+        {
+            ::shutdown(socket.getSocketFd(), SHUT_WR);
+            Refusals::get().add(std::move(socket));
+        }
+    }
+
     void worker(SocketStream&& sock)
     {
+        Admission admitted;
         SocketStream socket(std::move(sock));
         LOG(DEBUG) << "Worker starting up with socket " << socket.getSocketFd() << std::endl;
+        if (settings.notSentLowat > 0)
+            socket.setNotSentLowat(settings.notSentLowat);
 
-        std::string request;
-        while (true)
+        if (!finishHandshake(socket))
+            return;
+
+        ConnectionCount active;
+        if (settings.http2 && socket.protocol() == "h2")
         {
-            auto [result, reply] = socket.receive();
-            request += reply;
+            HTTP2Connection(socket, settings.maxStreams).serve({});
+            return;
+        }
 
-            if (request.size() > 4096)   // An arbitrary ceiling
+        std::string request;
+        OutputQueue output(settings.pipelineDepth);
+        const unsigned int flags = socket.userSpaceTLS() ? ResponseCreator::UserSpaceSend : ResponseCreator::None;
+        bool closing = false;   // No more requests are read, the connection is closed once the queue drains
+        bool fresh = true;      // Nothing was answered yet, the client may still start HTTP/2
+        // For the Trace, when the first bytes of the request at the front of `request` came in, and the last ones
+        std::uint64_t requestStart = 0;
+        std::uint64_t lastReceived = 0;
+        try
+        {
+            while (true)
             {
-                LOG(INFO) << "Terminating connection assuming client is sending gibberish" << std::endl;
-                return;
-            }
+                // Answer the complete requests we have, as long as the queue is below its high-water mark.
+                // If the bytesRead is 0, the request is incomplete (or possibly malformed), wait for the rest.
+                while (!closing && !output.full())
+                {
+                    // HTTP/2 with prior knowledge, the client starts with its preface rather than a request
+                    auto preface = HTTP2Connection::Preface;
+                    if (fresh && settings.http2 &&
+                        preface.substr(0, request.size()) == std::string_view(request).substr(0, preface.size()))
+                    {
+                        if (request.size() < preface.size())
+                            break;
+                        HTTP2Connection(socket, settings.maxStreams).serve(std::move(request));
+                        return;
+                    }
 
-            switch(result)
-            {
-                case ReceiveResult::Disconnected:
-                    LOG(DEBUG) << "Removing socket " << socket.getSocketFd() << std::endl;
+                    auto& response = output.prepare();
+                    auto [used, keepAlive] = handleRequest(request, response, flags);
+                    if (used == 0)
+                        break;
+                    response.trace().at[Trace::Start] = requestStart;
+                    requestStart = lastReceived;    // Pipelined requests after it came in with it at the latest
+                    if (!fresh)
+                        Metrics::local().reused.add();
+                    output.push();
+                    fresh = false;
+                    request.erase(0, used);
+                    closing = !keepAlive;
+                }
+
+                // Requests may be left unanswered in the buffer if the queue filled up
+                bool stalled = output.full();
+                if (!output.flush(socket))
+                {
+                    LOG(ERROR) << "couldn't send http response. errno: " << errno << std::endl;
                     return;
-                case ReceiveResult::Error:
-                    LOG(ERROR) << "Receive error with socket " << socket.getSocketFd() << " and errno " << errno << std::endl;
+                }
+                if (closing && output.empty())
                     return;
-                case ReceiveResult::Success:
+                if (stalled && !output.full())
+                    continue;
+
+                // Sleep until the socket can take more of the queue, or there's room for requests and one arrives
+                Metrics::local().setActive(!output.empty() || !request.empty());
+                // Out of buffers to copy a file through, the socket taking more is no use until one is kept for us
+                pollfd pfd[2] = {{socket.getSocketFd(), 0, 0}, {socket.bufferWait(), POLLIN, 0}};
+                if (!closing && !output.full())
+                    pfd[0].events |= POLLIN;
+                if (!output.empty() && pfd[1].fd < 0)
+                    pfd[0].events |= POLLOUT;
+                // TLS may have decrypted more than we've received already, the socket has nothing left to tell
+                if ((pfd[0].events & POLLIN) && socket.pending())
+                    pfd[0].revents = POLLIN;
+                else if (poll(pfd, 2, -1) < 0)
                 {
-                    LOG(DEBUG) << "Received data from " << socket.getSocketFd() << std::endl;
-                    std::size_t used;
-                    try
-                    {
-                        do
-                            used = handleRequest(request, socket);
-                        while (used != 0 && used != request.size());
-                        request.erase(0, used);
-                    }
-                    catch(const std::runtime_error& e)
-                    {
-                        LOG(DEBUG) << e.what() << std::endl;
+                    if (errno == EINTR)
+                        continue;
+                    LOG(ERROR) << "poll() error with socket " << socket.getSocketFd() << " and errno " << errno << std::endl;
+                    return;
+                }
+                if (pfd[0].revents & (POLLERR | POLLNVAL))
+                {
+                    LOG(DEBUG) << "Removing socket " << socket.getSocketFd() << " after an error" << std::endl;
+                    return;
+                }
+                if (!(pfd[0].revents & (POLLIN | POLLHUP)) || !(pfd[0].events & POLLIN))
+                    continue;
+
+                auto [result, reply] = socket.receive();
+                if (Trace::enabled() && !reply.empty())
+                {
+                    lastReceived = Trace::now();
+                    if (request.empty())
+                        requestStart = lastReceived;
+                }
+                request += reply;
+                Metrics::local().bytesIn.add(reply.size());
+
+                if (request.size() > 4096)   // An arbitrary ceiling
+                {
+                    LOG(INFO) << "Terminating connection assuming client is sending gibberish" << std::endl;
+                    return;
+                }
+
+                switch(result)
+                {
+                    case ReceiveResult::Disconnected:
+                        // The client may have only shut down its side, answer what it asked for before that
+                        LOG(DEBUG) << "Removing socket " << socket.getSocketFd() << std::endl;
+                        closing = true;
+                        break;
+                    case ReceiveResult::Error:
+                        LOG(ERROR) << "Receive error with socket " << socket.getSocketFd() << " and errno " << errno << std::endl;
                         return;
-                    }
+                    case ReceiveResult::WouldBlock:
+                        break;
+                    case ReceiveResult::Success:
+                        LOG(DEBUG) << "Received data from " << socket.getSocketFd() << std::endl;
+                        break;
                 }
             }
         }
+        catch(const std::runtime_error& e)
+        {
+            LOG(DEBUG) << e.what() << std::endl;
+        }
     }
 }
@@ -10,6 +10,9 @@
 
 #include "Log.hpp"
 #include "Server.hpp"
+#include "AccessLog.hpp"
+#include "Trace.hpp"
+#include "FileMapping.hpp"
 
 #include <signal.h>
 
@@ -136,13 +139,8 @@ int main(int argc, char **argv)
     if (opts.exit)
         return opts.exit_code;
 
-    std::ofstream logFile(opts.logfile, std::ios::out | std::ios::ate);
-    ryuuk::TeeStream tee(logFile, std::cout);
-
-    if (logFile.is_open() && logFile.good())
-        ryuuk::Log::get().setLogStream(tee);
-    else
-        ryuuk::Log::get().setLogStream(std::cerr);
+    // Logged to standard error only if the file can't be opened
+    ryuuk::Log::get().open(opts.logfile);
 
     ryuuk::Log::get().setLevel(opts.loglevel);
 
@@ -163,7 +161,16 @@ int main(int argc, char **argv)
     if (!opts.configfile.empty())
         serverPtr->setConfigFile(opts.configfile);
 
-    serverPtr->init();
+    try
+    {
+        serverPtr->init();
+    }
+    catch (...)
+    {
+        // Records are written in the background, get the reason out before we're terminated
+        ryuuk::Log::get().flush();
+        throw;
+    }
 
     // struct keyword required to remove ambiguity with the function
     struct sigaction sa;
@@ -182,7 +189,13 @@ int main(int argc, char **argv)
     sa_pipe.sa_handler = [](int sig) { LOG(ryuuk::ERROR) << "Received SIGPIPE" << std::endl; };
     sigaction(SIGPIPE, &sa_pipe, nullptr);
 
+    // Let reads from mapped files fail gracefully should a file be truncated under us
+    ryuuk::FileMapping::installSignalHandler();
+
     Ryuuk.run();
 
+    ryuuk::AccessLog::get().close();
+    ryuuk::Trace::get().close();
+    ryuuk::Log::get().flush();
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,264 @@
+/**
+* ryuuk-logcat - Render the binary access log of Ryuuk as text
+*/
+
+
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "AccessLog.hpp"
+
+#include <arpa/inet.h>
+
+using ryuuk::accesslog::Record;
+using ryuuk::accesslog::SegmentHeader;
+
+namespace
+{
+    enum class Format
+    {
+        Common,
+        Combined,
+        Json,
+    };
+
+    void printHelp()
+    {
+        std::cout << "ryuuk-logcat - Render Ryuuk access log segments as text\n" << std::endl;
+        std::cout << "Usage: ryuuk-logcat [-f FORMAT] SEGMENT...\n" << std::endl;
+        std::cout << "Options:" << std::endl;
+        std::cout << " -h          : Display this help message and exit\n" << std::endl;
+        std::cout << " -f common   : Common Log Format (the default)" << std::endl;
+        std::cout << " -f combined : Combined Log Format, with the Referer and User-Agent" << std::endl;
+        std::cout << " -f json     : One JSON object per request, with every field recorded" << std::endl;
+    }
+
+    std::string clientAddress(const Record& record)
+    {
+        char text[INET6_ADDRSTRLEN];
+        static const std::uint8_t mapped[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+        if (std::memcmp(record.address, mapped, sizeof(mapped)) == 0)
+            inet_ntop(AF_INET, record.address + 12, text, sizeof(text));
+        else
+            inet_ntop(AF_INET6, record.address, text, sizeof(text));
+        return text;
+    }
+
+    std::string_view stored(const char* field, std::size_t size, std::uint16_t length)
+    {
+        return {field, std::min<std::size_t>(size, length)};
+    }
+
+    // Quoted as Apache does, '"' and '\' escaped, other unprintable bytes as \xhh. Truncated values end in "...".
+    void appendQuoted(std::string& out, std::string_view value, bool truncated)
+    {
+        static const char hex[] = "0123456789abcdef";
+        out += '"';
+        for (unsigned char c : value)
+        {
+            if (c == '"' || c == '\\')
+                (out += '\\') += c;
+            else if (c < 0x20 || c == 0x7f)
+                ((out += "\\x") += hex[c >> 4]) += hex[c & 15];
+            else
+                out += c;
+        }
+        if (truncated)
+            out += "...";
+        out += '"';
+    }
+
+    void appendJsonString(std::string& out, std::string_view value)
+    {
+        static const char hex[] = "0123456789abcdef";
+        out += '"';
+        for (unsigned char c : value)
+        {
+            if (c == '"' || c == '\\')
+                (out += '\\') += c;
+            else if (c < 0x20)
+                ((out += "\\u00") += hex[c >> 4]) += hex[c & 15];
+            else
+                out += c;
+        }
+        out += '"';
+    }
+
+    std::string_view versionName(const Record& record)
+    {
+        switch (record.version)
+        {
+            case 10:    return "HTTP/1.0";
+            case 11:    return "HTTP/1.1";
+            case 20:    return "HTTP/2.0";
+            default:    return "-";
+        }
+    }
+
+    std::string_view methodName(const Record& record)
+    {
+        return record.method < std::size(ryuuk::accesslog::MethodNames) ? ryuuk::accesslog::MethodNames[record.method]
+                                                                         : "-";
+    }
+
+    void render(const Record& record, Format format, std::string& out)
+    {
+        const std::time_t seconds = record.time / 1000000000;
+        std::tm tm;
+        gmtime_r(&seconds, &tm);
+        char date[64];
+
+        auto path      = stored(record.path, sizeof(record.path), record.pathLength);
+        auto referer   = stored(record.referer, sizeof(record.referer), record.refererLength);
+        auto userAgent = stored(record.userAgent, sizeof(record.userAgent), record.userAgentLength);
+
+        if (format == Format::Json)
+        {
+            std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &tm);
+            char fraction[16];
+            std::snprintf(fraction, sizeof(fraction), ".%06uZ", unsigned(record.time % 1000000000 / 1000));
+            char pathId[20];
+            std::snprintf(pathId, sizeof(pathId), "%016llx", static_cast<unsigned long long>(record.pathId));
+
+            out += "{\"time\":\"";
+            (out += date) += fraction;
+            out += "\",\"client\":\"" + clientAddress(record) + "\",\"port\":" + std::to_string(record.port);
+            out += ",\"method\":\"";
+            out += methodName(record);
+            out += "\",\"path\":";
+            appendJsonString(out, path);
+            out += ",\"pathLength\":" + std::to_string(record.pathLength);
+            out += ",\"pathId\":\"";
+            out += pathId;
+            out += "\",\"version\":\"";
+            out += versionName(record);
+            out += "\",\"status\":" + std::to_string(record.status);
+            out += ",\"bytes\":" + std::to_string(record.bytesSent);
+            out += ",\"referer\":";
+            appendJsonString(out, referer);
+            out += ",\"userAgent\":";
+            appendJsonString(out, userAgent);
+            out += ",\"parseUs\":" + std::to_string(record.parse);
+            out += ",\"respondUs\":" + std::to_string(record.respond);
+            out += ",\"sendUs\":" + std::to_string(record.send);
+            out += "}\n";
+            return;
+        }
+
+        // 127.0.0.1 - - [10/Oct/2000:13:55:36 +0000] "GET /index.html HTTP/1.1" 200 2326
+        std::strftime(date, sizeof(date), "[%d/%b/%Y:%H:%M:%S +0000]", &tm);
+        out += clientAddress(record);
+        out += " - - ";
+        out += date;
+        out += " \"";
+        out += methodName(record);
+        out += ' ';
+        // The request line as a whole is quoted
+        std::string request;
+        appendQuoted(request, path, record.pathLength > path.size());
+        out.append(request, 1, request.size() - 2);
+        out += ' ';
+        out += versionName(record);
+        out += "\" " + std::to_string(record.status) + ' ';
+        out += record.bytesSent ? std::to_string(record.bytesSent) : "-";
+        if (format == Format::Combined)
+        {
+            out += ' ';
+            if (record.refererLength)
+                appendQuoted(out, referer, record.refererLength > referer.size());
+            else
+                out += "\"-\"";
+            out += ' ';
+            if (record.userAgentLength)
+                appendQuoted(out, userAgent, record.userAgentLength > userAgent.size());
+            else
+                out += "\"-\"";
+        }
+        out += '\n';
+    }
+
+    // Render the complete records of the segment at `path` to the standard output
+    bool catSegment(const std::string& path, Format format)
+    {
+        std::ifstream file(path, std::ios::binary);
+        SegmentHeader header;
+        if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)))
+        {
+            std::cerr << path << ": not an access log segment" << std::endl;
+            return false;
+        }
+        if (std::memcmp(header.magic, ryuuk::accesslog::Magic, sizeof(header.magic)) != 0 ||
+            header.version != ryuuk::accesslog::Version || header.recordSize != sizeof(Record))
+        {
+            std::cerr << path << ": not an access log segment of this version" << std::endl;
+            return false;
+        }
+
+        std::vector<Record> records(4096);
+        std::string out;
+        while (file)
+        {
+            file.read(reinterpret_cast<char*>(records.data()), records.size() * sizeof(Record));
+            auto count = static_cast<std::size_t>(file.gcount()) / sizeof(Record);
+            out.clear();
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                // Being written, never finished or past the end of a segment still open
+                if (records[i].committed)
+                    render(records[i], format, out);
+            }
+            std::cout.write(out.data(), out.size());
+        }
+        return true;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    Format format = Format::Common;
+    std::vector<std::string> segments;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string_view argument = argv[i];
+        if (argument == "-h")
+        {
+            printHelp();
+            return EXIT_SUCCESS;
+        }
+        else if (argument == "-f" && i + 1 < argc)
+        {
+            std::string_view name = argv[++i];
+            if (name == "common")
+                format = Format::Common;
+            else if (name == "combined")
+                format = Format::Combined;
+            else if (name == "json")
+                format = Format::Json;
+            else
+            {
+                std::cerr << "Unknown format " << name << "\nryuuk-logcat -h for help and detailed usage." << std::endl;
+                return EXIT_FAILURE;
+            }
+        }
+        else
+            segments.emplace_back(argument);
+    }
+
+    if (segments.empty())
+    {
+        std::cerr << "Invalid usage!\nryuuk-logcat -h for help and detailed usage." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::ios::sync_with_stdio(false);
+    bool ok = true;
+    for (const auto& segment : segments)
+        ok = catSegment(segment, format) && ok;
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,283 @@
+/**
+* ryuuk-pathfuzz - Check normalizePath against the sanitizePath it replaced, on random request paths
+*/
+
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "Log.hpp"
+#include "Utility.hpp"
+
+namespace
+{
+    // sanitizePath as it was before normalizePath replaced it, the reference the new one is checked against
+    std::string sanitizePath(const std::string& path)
+    {
+        std::vector<std::string> dirs;
+
+        // Split the path into dirs (split by '/')
+        std::stringstream ss(path);
+        std::string item;
+        while (std::getline(ss, item, '/'))
+            dirs.push_back(item);
+
+        // Ignore . and normalize .. by "deleting" previous non-empty directory from the path.
+        for (std::size_t i = 0; i < dirs.size(); ++i)
+        {
+            if (dirs[i] == ".")
+                dirs[i] = {};
+            else if (dirs[i] == "..")
+            {
+                dirs[i] = {};
+
+                auto saved = i;
+                do
+                {
+                    if (i == 0)   // Underflow, ie. going above the current working directory
+                        throw std::domain_error("Path outside current directory");
+                    else
+                        --i;
+                }
+                while (dirs[i].empty());
+                dirs[i] = {};
+                i = saved;
+            }
+            else // URL decode
+            {
+                std::size_t j = 0;
+                while ((j = dirs[i].find('%', j)) != std::string::npos)
+                {
+                    if (j + 2 >= dirs[i].size())
+                        throw std::domain_error("URL decoding error");
+
+                    const std::string hex_ciphers{"0123456789abcdef"};
+                    char c = 0;
+                    for (std::size_t k = j + 1; k <= j + 2; ++k)
+                    {
+                        auto p = hex_ciphers.find(dirs[i][k]);
+                        if (p != std::string::npos)
+                            c = c * 16 + p;
+                        else
+                            throw std::domain_error("URL decoding error");
+                    }
+
+                    dirs[i].replace(j, 3, &c, 1);
+                }
+            }
+        }
+
+        ss.clear();
+        ss.str({});
+        std::copy_if(dirs.begin(), dirs.end(), std::ostream_iterator<std::string>(ss, "/"),
+                     [](const std::string& s){ return !s.empty(); });
+
+        auto str = ss.str();
+        if (!str.empty() && path.back() != '/')   // Remove the last slash if the original path didn't had it
+            str.erase(str.size() - 1);
+        return str;
+    }
+
+    // What HTTP::respond made of the path with each, "!" when it's rejected
+    std::string before(const std::string& path)
+    {
+        try
+        {
+            auto loc = sanitizePath(path);
+            return "./" + (loc != "/" ? loc : "");
+        }
+        catch (const std::domain_error&)
+        {
+            return "!";
+        }
+    }
+
+    std::string after(const std::string& path)
+    {
+        try
+        {
+            std::string out = "./";
+            ryuuk::normalizePath(path, out);
+            return out;
+        }
+        catch (const std::domain_error&)
+        {
+            return "!";
+        }
+    }
+
+    std::string printable(std::string_view text)
+    {
+        static const char hex[] = "0123456789abcdef";
+        std::string out = "\"";
+        for (unsigned char c : text)
+        {
+            if (c < 0x20 || c >= 0x7f || c == '"' || c == '\\')
+                ((out += "\\x") += hex[c >> 4]) += hex[c & 15];
+            else
+                out += c;
+        }
+        return out + '"';
+    }
+
+    /**
+    * Paths both functions are meant to agree on: segments of plain bytes and
+    * lowercase escapes, dot and empty segments, with or without leading and
+    * trailing slashes. Left out are the inputs normalizePath handles differently
+    * on purpose: escapes of '%', '/' and NUL, escapes decoding to a dot segment,
+    * uppercase hex digits, '?' and '#' (the query and fragment, which it drops)
+    * and malformed escapes, which it always rejects.
+    */
+    class PathGenerator
+    {
+    public:
+        explicit PathGenerator(unsigned seed) : m_random(seed) {}
+
+        std::string path()
+        {
+            std::string out;
+            if (chance(90))
+                out += '/';
+            for (int segments = below(9); segments > 0; --segments)
+            {
+                auto roll = below(100);
+                if (roll < 12)
+                    out += ".";
+                else if (roll < 24)
+                    out += "..";
+                else if (roll < 30)
+                    ;   // Empty
+                else
+                    out += segment();
+                out += '/';
+            }
+            if (!out.empty() && out.back() == '/' && !chance(30))
+                out.pop_back();
+            return out;
+        }
+
+        // A valid path with a malformed escape in it
+        std::string malformed()
+        {
+            // Complete whatever follows them, cut short ones only end the path
+            static const char* const escapes[] = {"%g1", "%1g", "%-1", "% 1", "%%41", "%zz"};
+            static const char* const truncated[] = {"%", "%4"};
+            auto base = path();
+            if (chance(25))
+                return base + truncated[below(std::size(truncated))];
+            return base.insert(below(base.size() + 1), escapes[below(std::size(escapes))]);
+        }
+
+    private:
+        std::string segment()
+        {
+            // Long enough at times to cover the runs of plain bytes matched 16 at a time
+            std::string raw, decoded;
+            for (int length = 1 + below(chance(20) ? 40 : 8); length > 0; --length)
+            {
+                char c;
+                do
+                    c = static_cast<char>(chance(90) ? 0x20 + below(0x5f) : 0x80 + below(0x80));
+                while (c == '/' || c == '%' || c == '?' || c == '#');
+
+                if (chance(25))
+                {
+                    // Any byte may be escaped, but those normalizePath treats apart
+                    do
+                        c = static_cast<char>(1 + below(255));
+                    while (c == '/' || c == '%');
+                    static const char hex[] = "0123456789abcdef";
+                    unsigned char byte = c;
+                    ((raw += '%') += hex[byte >> 4]) += hex[byte & 15];
+                }
+                else
+                    raw += c;
+                decoded += c;
+            }
+            if (decoded == "." || decoded == "..")
+                return segment();
+            return raw;
+        }
+
+        bool chance(int percent) { return below(100) < percent; }
+        int below(std::size_t n) { return std::uniform_int_distribution<std::size_t>(0, n - 1)(m_random); }
+
+        std::mt19937 m_random;
+    };
+
+    void printHelp()
+    {
+        std::cout << "ryuuk-pathfuzz - Check normalizePath against the sanitizePath it replaced\n" << std::endl;
+        std::cout << "Usage: ryuuk-pathfuzz [-n ITERATIONS] [-s SEED]\n" << std::endl;
+        std::cout << "Options:" << std::endl;
+        std::cout << " -h   : Display this help message and exit\n" << std::endl;
+        std::cout << " -n N : Check N random paths, and N / 8 malformed ones (1000000 by default)" << std::endl;
+        std::cout << " -s S : Seed the paths with S, for a run to be repeated (random by default)" << std::endl;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    unsigned long iterations = 1000000;
+    unsigned seed = std::random_device{}();
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string_view argument = argv[i];
+        if (argument == "-h")
+        {
+            printHelp();
+            return EXIT_SUCCESS;
+        }
+        else if (argument == "-n" && i + 1 < argc)
+            iterations = std::strtoul(argv[++i], nullptr, 10);
+        else if (argument == "-s" && i + 1 < argc)
+            seed = std::strtoul(argv[++i], nullptr, 10);
+        else
+        {
+            std::cerr << "Invalid usage!\nryuuk-pathfuzz -h for help and detailed usage." << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    // normalizePath logs the malformed escapes
+    ryuuk::Log::get().setLevel(ryuuk::ERROR);
+
+    std::cout << "Checking " << iterations << " paths with seed " << seed << std::endl;
+    PathGenerator generate(seed);
+    unsigned long mismatches = 0;
+    auto report = [&](const std::string& path, const std::string& expected, const std::string& got)
+    {
+        if (++mismatches <= 20)
+            std::cout << printable(path) << ": expected " << printable(expected) << ", got " << printable(got)
+                      << std::endl;
+    };
+
+    unsigned long rejected = 0;
+    for (unsigned long i = 0; i < iterations; ++i)
+    {
+        auto path = generate.path();
+        auto expected = before(path), got = after(path);
+        rejected += expected == "!" && got == "!";
+        if (expected != got)
+            report(path, expected, got);
+
+        if (i % 8 == 0)
+        {
+            path = generate.malformed();
+            got = after(path);
+            if (got != "!")
+                report(path, "!", got);
+        }
+    }
+
+    std::cout << mismatches << " mismatches, " << rejected << " paths above the root rejected by both" << std::endl;
+    return mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,154 @@
+/**
+* ryuuk-readahead - Check that the frames of interleaved HTTP/2 file streams are sent out of the blocks ReadAhead read
+*/
+
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unistd.h>
+
+#include "BufferPool.hpp"
+#include "Log.hpp"
+
+namespace
+{
+    const std::size_t BufferSize = 128 * 1024;
+    const std::size_t FrameSize = 16 * 1024;   // SETTINGS_MAX_FRAME_SIZE's default
+    const std::size_t FileSize = 1024 * 1024;
+
+    // The byte at `offset` of file `file` as written the `generation`th time
+    char pattern(int file, int generation, off_t offset)
+    {
+        return static_cast<char>(offset * 7 + file * 13 + generation * 101);
+    }
+
+    // Writes the file's content for the generation, the old one staying only in the blocks read before
+    bool write(int fd, int file, int generation)
+    {
+        std::vector<char> content(FileSize);
+        for (std::size_t i = 0; i < content.size(); ++i)
+            content[i] = pattern(file, generation, i);
+        return ::pwrite(fd, content.data(), content.size(), 0) == static_cast<ssize_t>(content.size());
+    }
+
+    int temporary()
+    {
+        char name[] = "/tmp/ryuuk-readahead-XXXXXX";
+        int fd = ::mkstemp(name);
+        if (fd >= 0)
+            ::unlink(name);
+        return fd;
+    }
+
+    // An HTTP/2 stream sending a range of a file, one DATA frame at a time
+    struct Stream
+    {
+        int file;
+        int fd;
+        off_t offset;
+        off_t end;
+        bool rewritten = false;
+    };
+
+    void printHelp()
+    {
+        std::cout << "ryuuk-readahead - Check that interleaved HTTP/2 file streams are sent out of their read-ahead blocks\n"
+                  << std::endl;
+        std::cout << "Usage: ryuuk-readahead\n" << std::endl;
+        std::cout << "Options:" << std::endl;
+        std::cout << " -h   : Display this help message and exit" << std::endl;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1)
+    {
+        if (std::string_view(argv[1]) == "-h")
+        {
+            printHelp();
+            return EXIT_SUCCESS;
+        }
+        std::cerr << "Invalid usage!\nryuuk-readahead -h for help and detailed usage." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    ryuuk::Log::get().setLevel(ryuuk::ERROR);
+    ryuuk::BufferPool::get().configure(BufferSize, 8 * BufferSize);
+
+    // The second stream ends short of its file, nothing past it may be returned
+    std::vector<Stream> streams = {{0, temporary(), 0, FileSize}, {1, temporary(), 0, FileSize - 5000}};
+    for (const auto& stream : streams)
+    {
+        if (stream.fd < 0 || !write(stream.fd, stream.file, 0))
+        {
+            std::cerr << "Couldn't write a temporary file" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    /**
+    * Each stream's file is rewritten right after its first block was read: the frames
+    * within that block must still come out of it, the old content, rather than each
+    * frame reading the file again, and those after it must have the new content.
+    */
+    ryuuk::ReadAhead readAhead;
+    unsigned long mismatches = 0, frames = 0;
+    for (bool sending = true; sending; )
+    {
+        sending = false;
+        for (auto& stream : streams)
+        {
+            if (stream.offset == stream.end)
+                continue;
+            sending = true;
+
+            bool failed;
+            auto data = readAhead.data(stream.fd, stream.offset, stream.end, failed);
+            if (failed || data.empty() || static_cast<off_t>(data.size()) > stream.end - stream.offset)
+            {
+                std::cout << "Stream " << stream.file << ": no data, or past its end, at " << stream.offset << std::endl;
+                return EXIT_FAILURE;
+            }
+            if (!stream.rewritten)
+            {
+                stream.rewritten = write(stream.fd, stream.file, 1);
+                if (!stream.rewritten)
+                {
+                    std::cerr << "Couldn't rewrite a temporary file" << std::endl;
+                    return EXIT_FAILURE;
+                }
+            }
+
+            auto frame = data.substr(0, FrameSize);
+            int generation = stream.offset < static_cast<off_t>(BufferSize) ? 0 : 1;
+            for (std::size_t i = 0; i < frame.size(); ++i)
+            {
+                if (frame[i] != pattern(stream.file, generation, stream.offset + i))
+                {
+                    if (++mismatches <= 20)
+                        std::cout << "Stream " << stream.file << ": frame at " << stream.offset
+                                  << " wasn't sent out of the block read for it" << std::endl;
+                    break;
+                }
+            }
+            ++frames;
+
+            // As SocketStream::sendFileSome does, with the socket taking the whole frame
+            stream.offset += frame.size();
+            if (stream.offset == stream.end)
+                readAhead.release(stream.fd);
+            else if (frame.size() < data.size())
+                readAhead.prefetch();
+        }
+    }
+
+    for (const auto& stream : streams)
+        ::close(stream.fd);
+    std::cout << mismatches << " mismatches in " << frames << " frames" << std::endl;
+    return mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}